@@ -0,0 +1,495 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "Compression.h"
+
+#include <string>
+#include <vector>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#ifndef STRINGSORT_WITH_ZSTD
+#define STRINGSORT_WITH_ZSTD 0
+#endif
+#ifndef STRINGSORT_WITH_LZ4
+#define STRINGSORT_WITH_LZ4 0
+#endif
+
+#if STRINGSORT_WITH_ZSTD
+#include <zstd.h>
+#endif
+#if STRINGSORT_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+const uint32_t LZ4_FRAME_MAGIC = 0x184D2204;
+// Both formats share the skippable frames, magic 0x184D2A50 to 0x184D2A5F, which carry no data.
+const uint32_t SKIPPABLE_FRAME_MAGIC = 0x184D2A50;
+const uint32_t SKIPPABLE_FRAME_MASK = 0xFFFFFFF0;
+
+// Output is compressed in blocks of this size, one frame and one task each.
+const size_t COMPRESSION_BLOCK_SIZE = 4 << 20;
+// Decompressed frames of unknown size grow by this much at a time.
+const size_t DECOMPRESSION_CHUNK_SIZE = 256 << 10;
+// Most times its compressed size that the decompressed sizes recorded in an input's frame headers may
+// add up to before they are no longer allocated up front. The headers are part of the input.
+const size_t MAX_TRUSTED_EXPANSION = 1024;
+const int ZSTD_COMPRESSION_LEVEL = 3;
+
+// One frame of a compressed input, and its decompressed size if the frame header records it.
+struct CompressedFrame {
+	size_t offset;
+	size_t size;
+	bool hasContentSize;
+	size_t contentSize;
+};
+
+static uint32_t ReadLittleEndian32(const char* _bytes) {
+	const unsigned char* bytes = (const unsigned char*)_bytes;
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t ReadLittleEndian64(const char* _bytes) {
+	return (uint64_t)ReadLittleEndian32(_bytes) | ((uint64_t)ReadLittleEndian32(_bytes + 4) << 32);
+}
+
+// Runs _work(i) for every i below _count on up to _numThreads threads, each taking the next i.
+template <typename TWork>
+static void RunTasks(size_t _count, unsigned int _numThreads, TWork _work) {
+	atomic<size_t> next{ 0 };
+	auto worker = [&] {
+		for (size_t i = next++; i < _count; i = next++) {
+			_work(i);
+		}
+	};
+
+	size_t numThreads = max((size_t)1, min((size_t)_numThreads, _count));
+	vector<future<void>> workerFutures;
+	for (size_t t = 1; t < numThreads; ++t) {
+		workerFutures.push_back(async(launch::async, worker));
+	}
+	exception_ptr error;
+	try {
+		worker();
+	}
+	catch (...) {
+		error = current_exception();
+		next = _count;
+	}
+	for (auto& workerFuture : workerFutures) {
+		try {
+			workerFuture.get();
+		}
+		catch (...) {
+			if (!error)
+				error = current_exception();
+		}
+	}
+	if (error)
+		rethrow_exception(error);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Frames
+////////////////////////////////////////////////////////////////////////////////////////////////////
+ECompression DetectCompression(const char* _data, size_t _size) {
+	if (_size < 4)
+		return ECompression::None;
+	uint32_t magic = ReadLittleEndian32(_data);
+	if (magic == ZSTD_FRAME_MAGIC)
+		return ECompression::Zstd;
+	if (magic == LZ4_FRAME_MAGIC)
+		return ECompression::Lz4;
+	return ECompression::None;
+}
+
+ECompression GetCompressionForPath(const string& _path) {
+	auto endsWith = [&](const char* _extension) {
+		size_t length = strlen(_extension);
+		return _path.size() >= length && _path.compare(_path.size() - length, length, _extension) == 0;
+	};
+	if (endsWith(".zst"))
+		return ECompression::Zstd;
+	if (endsWith(".lz4"))
+		return ECompression::Lz4;
+	return ECompression::None;
+}
+
+const char* GetCompressionName(ECompression _compression) {
+	switch (_compression) {
+	case ECompression::None:
+		return "none";
+	case ECompression::Zstd:
+		return "zstd";
+	case ECompression::Lz4:
+		return "lz4";
+	}
+	return "unknown";
+}
+
+bool IsCompressionAvailable(ECompression _compression) {
+	switch (_compression) {
+	case ECompression::None:
+		return true;
+	case ECompression::Zstd:
+		return STRINGSORT_WITH_ZSTD != 0;
+	case ECompression::Lz4:
+		return STRINGSORT_WITH_LZ4 != 0;
+	}
+	return false;
+}
+
+static void RequireBytes(size_t _needed, size_t _size, ECompression _compression) {
+	if (_needed > _size)
+		throw runtime_error(string("Truncated ") + GetCompressionName(_compression) + " frame");
+}
+
+// Size of the zstd frame at the start of _data. Walks the block headers, so no library is needed.
+static size_t ParseZstdFrame(const char* _data, size_t _size, CompressedFrame& _frame) {
+	RequireBytes(5, _size, ECompression::Zstd);
+	unsigned char descriptor = (unsigned char)_data[4];
+	unsigned int contentSizeFlag = descriptor >> 6;
+	bool singleSegment = (descriptor & 0x20) != 0;
+	bool hasChecksum = (descriptor & 0x04) != 0;
+	unsigned int dictionaryIdFlag = descriptor & 0x03;
+
+	const size_t dictionaryIdBytes[] = { 0, 1, 2, 4 };
+	const size_t contentSizeBytes[] = { 0, 2, 4, 8 };
+	size_t position = 5 + (singleSegment ? 0 : 1) + dictionaryIdBytes[dictionaryIdFlag];
+	size_t sizeBytes = contentSizeFlag == 0 && singleSegment ? 1 : contentSizeBytes[contentSizeFlag];
+	RequireBytes(position + sizeBytes, _size, ECompression::Zstd);
+	_frame.hasContentSize = sizeBytes > 0;
+	if (sizeBytes > 0) {
+		uint64_t contentSize = 0;
+		for (size_t i = 0; i < sizeBytes; ++i) {
+			contentSize |= (uint64_t)(unsigned char)_data[position + i] << (8 * i);
+		}
+		if (sizeBytes == 2)
+			contentSize += 256;
+		_frame.hasContentSize = contentSize <= SIZE_MAX;
+		_frame.contentSize = (size_t)contentSize;
+	}
+	position += sizeBytes;
+
+	// Each block has a 3 byte header: last block flag, type (raw, RLE, compressed) and size
+	while (true) {
+		RequireBytes(position + 3, _size, ECompression::Zstd);
+		uint32_t header = (unsigned char)_data[position] | ((unsigned char)_data[position + 1] << 8) | ((unsigned char)_data[position + 2] << 16);
+		bool lastBlock = (header & 1) != 0;
+		unsigned int blockType = (header >> 1) & 3;
+		size_t blockSize = header >> 3;
+		position += 3 + (blockType == 1 ? 1 : blockSize);
+		if (blockType == 3)
+			throw runtime_error("Corrupt zstd frame");
+		if (lastBlock)
+			break;
+	}
+	position += hasChecksum ? 4 : 0;
+	RequireBytes(position, _size, ECompression::Zstd);
+	return position;
+}
+
+// Size of the lz4 frame at the start of _data, from its header and block sizes.
+static size_t ParseLz4Frame(const char* _data, size_t _size, CompressedFrame& _frame) {
+	RequireBytes(7, _size, ECompression::Lz4);
+	unsigned char flags = (unsigned char)_data[4];
+	if ((flags >> 6) != 1)
+		throw runtime_error("Unsupported lz4 frame version");
+	bool hasBlockChecksums = (flags & 0x10) != 0;
+	bool hasContentSize = (flags & 0x08) != 0;
+	bool hasContentChecksum = (flags & 0x04) != 0;
+	bool hasDictionaryId = (flags & 0x01) != 0;
+
+	size_t position = 6;
+	_frame.hasContentSize = hasContentSize;
+	if (hasContentSize) {
+		RequireBytes(position + 8, _size, ECompression::Lz4);
+		uint64_t contentSize = ReadLittleEndian64(_data + position);
+		_frame.hasContentSize = contentSize <= SIZE_MAX;
+		_frame.contentSize = (size_t)contentSize;
+		position += 8;
+	}
+	position += (hasDictionaryId ? 4 : 0) + 1;
+
+	// Blocks until the zero end mark; the high bit of a block size only marks it as stored
+	while (true) {
+		RequireBytes(position + 4, _size, ECompression::Lz4);
+		uint32_t blockSize = ReadLittleEndian32(_data + position) & 0x7FFFFFFF;
+		position += 4;
+		if (blockSize == 0)
+			break;
+		position += blockSize + (hasBlockChecksums ? 4 : 0);
+	}
+	position += hasContentChecksum ? 4 : 0;
+	RequireBytes(position, _size, ECompression::Lz4);
+	return position;
+}
+
+// Splits _data into its frames, leaving out skippable frames.
+static vector<CompressedFrame> FindFrames(const char* _data, size_t _size, ECompression _compression) {
+	vector<CompressedFrame> frames;
+	size_t position = 0;
+	while (position < _size) {
+		RequireBytes(position + 4, _size, _compression);
+		uint32_t magic = ReadLittleEndian32(_data + position);
+		if ((magic & SKIPPABLE_FRAME_MASK) == SKIPPABLE_FRAME_MAGIC) {
+			RequireBytes(position + 8, _size, _compression);
+			position += 8 + ReadLittleEndian32(_data + position + 4);
+			RequireBytes(position, _size, _compression);
+			continue;
+		}
+		if (DetectCompression(_data + position, _size - position) != _compression)
+			throw runtime_error(string("Unexpected data between ") + GetCompressionName(_compression) + " frames");
+
+		CompressedFrame frame = { position, 0, false, 0 };
+		if (_compression == ECompression::Zstd)
+			frame.size = ParseZstdFrame(_data + position, _size - position, frame);
+		else
+			frame.size = ParseLz4Frame(_data + position, _size - position, frame);
+		frames.push_back(frame);
+		position += frame.size;
+	}
+	return frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Codecs
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void RequireCodec(ECompression _compression) {
+	if (!IsCompressionAvailable(_compression))
+		throw runtime_error(string("Built without ") + GetCompressionName(_compression) + " support");
+}
+
+// Decompresses one frame into _destination, which must be exactly its decompressed size.
+static void DecompressFrameInto(const char* _frame, size_t _frameSize, ECompression _compression, char* _destination, size_t _destinationSize) {
+#if STRINGSORT_WITH_ZSTD
+	if (_compression == ECompression::Zstd) {
+		size_t result = ZSTD_decompress(_destination, _destinationSize, _frame, _frameSize);
+		if (ZSTD_isError(result))
+			throw runtime_error(string("zstd: ") + ZSTD_getErrorName(result));
+		if (result != _destinationSize)
+			throw runtime_error("zstd frame shorter than its header says");
+		return;
+	}
+#endif
+#if STRINGSORT_WITH_LZ4
+	if (_compression == ECompression::Lz4) {
+		LZ4F_dctx* rawContext = nullptr;
+		LZ4F_errorCode_t created = LZ4F_createDecompressionContext(&rawContext, LZ4F_VERSION);
+		if (LZ4F_isError(created))
+			throw runtime_error(string("lz4: ") + LZ4F_getErrorName(created));
+		unique_ptr<LZ4F_dctx, LZ4F_errorCode_t (*)(LZ4F_dctx*)> context(rawContext, LZ4F_freeDecompressionContext);
+
+		size_t written = 0;
+		size_t consumed = 0;
+		while (true) {
+			size_t destinationSize = _destinationSize - written;
+			size_t sourceSize = _frameSize - consumed;
+			size_t result = LZ4F_decompress(context.get(), _destination + written, &destinationSize, _frame + consumed, &sourceSize, nullptr);
+			if (LZ4F_isError(result))
+				throw runtime_error(string("lz4: ") + LZ4F_getErrorName(result));
+			written += destinationSize;
+			consumed += sourceSize;
+			if (result == 0)
+				break;
+			if (destinationSize == 0 && sourceSize == 0)
+				throw runtime_error("lz4 frame longer than its header says");
+		}
+		if (written != _destinationSize)
+			throw runtime_error("lz4 frame shorter than its header says");
+		return;
+	}
+#endif
+	(void)_frame;
+	(void)_frameSize;
+	(void)_destination;
+	(void)_destinationSize;
+	RequireCodec(_compression);
+}
+
+// Decompresses one frame of unknown decompressed size, appending to _out.
+static void DecompressFrameAppend(const char* _frame, size_t _frameSize, ECompression _compression, string& _out) {
+#if STRINGSORT_WITH_ZSTD
+	if (_compression == ECompression::Zstd) {
+		unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+		ZSTD_inBuffer input = { _frame, _frameSize, 0 };
+		while (true) {
+			size_t start = _out.size();
+			_out.resize(start + DECOMPRESSION_CHUNK_SIZE);
+			ZSTD_outBuffer output = { &_out[start], DECOMPRESSION_CHUNK_SIZE, 0 };
+			size_t result = ZSTD_decompressStream(context.get(), &output, &input);
+			_out.resize(start + output.pos);
+			if (ZSTD_isError(result))
+				throw runtime_error(string("zstd: ") + ZSTD_getErrorName(result));
+			if (result == 0)
+				break;
+			if (input.pos == input.size && output.pos < DECOMPRESSION_CHUNK_SIZE)
+				throw runtime_error("Truncated zstd frame");
+		}
+		return;
+	}
+#endif
+#if STRINGSORT_WITH_LZ4
+	if (_compression == ECompression::Lz4) {
+		LZ4F_dctx* rawContext = nullptr;
+		LZ4F_errorCode_t created = LZ4F_createDecompressionContext(&rawContext, LZ4F_VERSION);
+		if (LZ4F_isError(created))
+			throw runtime_error(string("lz4: ") + LZ4F_getErrorName(created));
+		unique_ptr<LZ4F_dctx, LZ4F_errorCode_t (*)(LZ4F_dctx*)> context(rawContext, LZ4F_freeDecompressionContext);
+
+		size_t consumed = 0;
+		while (true) {
+			size_t start = _out.size();
+			_out.resize(start + DECOMPRESSION_CHUNK_SIZE);
+			size_t destinationSize = DECOMPRESSION_CHUNK_SIZE;
+			size_t sourceSize = _frameSize - consumed;
+			size_t result = LZ4F_decompress(context.get(), &_out[start], &destinationSize, _frame + consumed, &sourceSize, nullptr);
+			_out.resize(start + destinationSize);
+			if (LZ4F_isError(result))
+				throw runtime_error(string("lz4: ") + LZ4F_getErrorName(result));
+			consumed += sourceSize;
+			if (result == 0)
+				break;
+			if (destinationSize == 0 && sourceSize == 0)
+				throw runtime_error("Truncated lz4 frame");
+		}
+		return;
+	}
+#endif
+	(void)_frame;
+	(void)_frameSize;
+	(void)_out;
+	RequireCodec(_compression);
+}
+
+// Compresses _data into one frame that records its decompressed size, appending to _out.
+static void CompressFrame(const char* _data, size_t _size, ECompression _compression, string& _out) {
+#if STRINGSORT_WITH_ZSTD
+	if (_compression == ECompression::Zstd) {
+		size_t start = _out.size();
+		_out.resize(start + ZSTD_compressBound(_size));
+		size_t result = ZSTD_compress(&_out[start], _out.size() - start, _data, _size, ZSTD_COMPRESSION_LEVEL);
+		if (ZSTD_isError(result))
+			throw runtime_error(string("zstd: ") + ZSTD_getErrorName(result));
+		_out.resize(start + result);
+		return;
+	}
+#endif
+#if STRINGSORT_WITH_LZ4
+	if (_compression == ECompression::Lz4) {
+		LZ4F_preferences_t preferences;
+		memset(&preferences, 0, sizeof(preferences));
+		preferences.frameInfo.contentSize = _size;
+		size_t start = _out.size();
+		_out.resize(start + LZ4F_compressFrameBound(_size, &preferences));
+		size_t result = LZ4F_compressFrame(&_out[start], _out.size() - start, _data, _size, &preferences);
+		if (LZ4F_isError(result))
+			throw runtime_error(string("lz4: ") + LZ4F_getErrorName(result));
+		_out.resize(start + result);
+		return;
+	}
+#endif
+	(void)_data;
+	(void)_size;
+	(void)_out;
+	RequireCodec(_compression);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parallel (De)compression
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void DecompressFrames(const char* _data, size_t _size, ECompression _compression, string& _out, unsigned int _numThreads) {
+	RequireCodec(_compression);
+	vector<CompressedFrame> frames = FindFrames(_data, _size, _compression);
+
+	// Sizes that overflow or claim more than MAX_TRUSTED_EXPANSION allows go through the append path,
+	// which only grows the output as far as the frames really decompress
+	bool allSizesKnown = true;
+	size_t totalSize = 0;
+	for (const CompressedFrame& frame : frames) {
+		if (!frame.hasContentSize || frame.contentSize > SIZE_MAX - totalSize) {
+			allSizesKnown = false;
+			break;
+		}
+		totalSize += frame.contentSize;
+	}
+	bool sizesTrusted = allSizesKnown && totalSize / MAX_TRUSTED_EXPANSION <= _size && totalSize <= SIZE_MAX - _out.size();
+
+	// Every frame knows its place in the output, so each thread writes straight into it
+	if (sizesTrusted) {
+		size_t start = _out.size();
+		_out.resize(start + totalSize);
+		vector<size_t> offsets(frames.size());
+		for (size_t i = 0, offset = start; i < frames.size(); offset += frames[i].contentSize, ++i) {
+			offsets[i] = offset;
+		}
+		RunTasks(frames.size(), _numThreads, [&](size_t i) {
+			DecompressFrameInto(_data + frames[i].offset, frames[i].size, _compression, &_out[offsets[i]], frames[i].contentSize);
+		});
+		return;
+	}
+
+	vector<string> decompressed(frames.size());
+	RunTasks(frames.size(), _numThreads, [&](size_t i) {
+		DecompressFrameAppend(_data + frames[i].offset, frames[i].size, _compression, decompressed[i]);
+	});
+	for (string& frameData : decompressed) {
+		_out.append(frameData);
+		string().swap(frameData);
+	}
+}
+
+void CompressBlocks(const char* _data, size_t _size, ECompression _compression, string& _out, unsigned int _numThreads) {
+	RequireCodec(_compression);
+
+	// An empty input still gets one (empty) frame, so the output is a valid compressed file
+	size_t blockCount = max((size_t)1, (_size + COMPRESSION_BLOCK_SIZE - 1) / COMPRESSION_BLOCK_SIZE);
+	vector<string> blocks(blockCount);
+	RunTasks(blockCount, _numThreads, [&](size_t i) {
+		size_t offset = i * COMPRESSION_BLOCK_SIZE;
+		CompressFrame(_data + offset, min(COMPRESSION_BLOCK_SIZE, _size - offset), _compression, blocks[i]);
+	});
+	for (string& block : blocks) {
+		_out.append(block);
+		string().swap(block);
+	}
+}
+
+BlockCompressor::BlockCompressor(ostream& _out, ECompression _compression, unsigned int _numThreads)
+	: out(_out), compression(_compression), numThreads(max(1u, _numThreads)) {
+	RequireCodec(_compression);
+}
+
+void BlockCompressor::Append(const char* _data, size_t _size) {
+	pending.append(_data, _size);
+	size_t batchSize = numThreads * COMPRESSION_BLOCK_SIZE;
+	if (pending.size() >= batchSize)
+		WriteBlocks(pending.size() - pending.size() % COMPRESSION_BLOCK_SIZE);
+}
+
+uint64_t BlockCompressor::Finish() {
+	// Nothing appended still writes one (empty) frame, see CompressBlocks
+	if (!finished && (!pending.empty() || bytesWritten == 0))
+		WriteBlocks(pending.size());
+	finished = true;
+	return bytesWritten;
+}
+
+// Compresses the first _size bytes of pending, whole blocks but for the last batch, and writes them.
+void BlockCompressor::WriteBlocks(size_t _size) {
+	frames.clear();
+	CompressBlocks(pending.data(), _size, compression, frames, numThreads);
+	pending.erase(0, _size);
+	out.write(frames.data(), frames.size());
+	bytesWritten += frames.size();
+}
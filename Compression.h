@@ -0,0 +1,57 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compression
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// zstd and lz4 frames in memory, (de)compressed in parallel. A compressed input is a sequence of
+// frames: each frame is decompressed on its own thread, straight into its place in the output when
+// every frame records its decompressed size. Output is cut into COMPRESSION_BLOCK_SIZE blocks that are
+// compressed in parallel into independent frames, which the standard tools read as one stream.
+//
+// The codecs are only built in when CMake finds their libraries (STRINGSORT_WITH_ZSTD and
+// STRINGSORT_WITH_LZ4); without them compressed data is still recognised, but throws.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+enum class ECompression { None, Zstd, Lz4 };
+
+// The codec of the frame that _data starts with, from its magic number.
+ECompression DetectCompression(const char* _data, size_t _size);
+// The codec for a file name, from its extension: .zst or .lz4.
+ECompression GetCompressionForPath(const std::string& _path);
+const char* GetCompressionName(ECompression _compression);
+// Whether this build can (de)compress _compression.
+bool IsCompressionAvailable(ECompression _compression);
+
+// Decompresses the frames in _data and appends the result to _out. Throws if the data is corrupt or
+// truncated, or the codec is not built in.
+void DecompressFrames(const char* _data, size_t _size, ECompression _compression, std::string& _out, unsigned int _numThreads);
+// Compresses _data into independent frames and appends them to _out.
+void CompressBlocks(const char* _data, size_t _size, ECompression _compression, std::string& _out, unsigned int _numThreads);
+
+// Compresses data as it is appended and writes the frames to _out, _numThreads blocks at a time, so
+// that however long the data runs only one batch of blocks and their frames are held.
+class BlockCompressor {
+public:
+	BlockCompressor(std::ostream& _out, ECompression _compression, unsigned int _numThreads);
+	void Append(const char* _data, size_t _size);
+	void Append(const std::string& _data) { Append(_data.data(), _data.size()); }
+	// Compresses and writes what is left, and returns the compressed bytes written in all.
+	uint64_t Finish();
+
+private:
+	void WriteBlocks(size_t _size);
+
+	std::ostream& out;
+	ECompression compression;
+	unsigned int numThreads;
+	std::string pending;
+	std::string frames;
+	uint64_t bytesWritten = 0;
+	bool finished = false;
+};
@@ -0,0 +1,27 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "Crc32.h"
+
+#include <vector>
+
+using namespace std;
+
+uint32_t UpdateCrc32(uint32_t _crc, const char* _data, size_t _size) {
+	static const vector<uint32_t> table = [] {
+		vector<uint32_t> entries(256);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+			}
+			entries[i] = crc;
+		}
+		return entries;
+	}();
+
+	uint32_t crc = _crc ^ 0xFFFFFFFFu;
+	for (size_t i = 0; i < _size; ++i) {
+		crc = table[(crc ^ (unsigned char)_data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFFu;
+}
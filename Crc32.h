@@ -0,0 +1,20 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// CRC-32
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The CRC-32 of zlib, gzip and PNG, computed a byte at a time from a table. The checksums of the
+// sorted table and front coded formats.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The CRC-32 of _data following data whose CRC-32 is _crc, so that data can be checked in pieces.
+// Start with 0.
+uint32_t UpdateCrc32(uint32_t _crc, const char* _data, size_t _size);
+
+inline uint32_t Crc32(const char* _data, size_t _size) {
+	return UpdateCrc32(0, _data, _size);
+}
@@ -0,0 +1,261 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "FrontCoding.h"
+#include "Crc32.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char FRONT_CODING_MAGIC[8] = { 'F', 'R', 'O', 'N', 'T', 'C', 'D', '2' };
+const char FRONT_CODING_FOOTER_MAGIC[8] = { 'F', 'R', 'O', 'N', 'T', 'E', 'N', 'D' };
+const size_t FRONT_CODING_FOOTER_SIZE = 8 + 8 + 4 + sizeof(FRONT_CODING_FOOTER_MAGIC);
+// The encoder hands its output to the stream in pieces of about this size.
+const size_t FRONT_CODING_WRITE_BUFFER = 1 << 20;
+// Suffixes are read in pieces of at most this size, so that a corrupt length fails on the missing
+// bytes rather than on allocating all of them up front.
+const size_t FRONT_CODING_READ_CHUNK = 1 << 20;
+
+static void AppendVarint(string& _out, uint64_t _value) {
+	while (_value >= 0x80) {
+		_out.push_back((char)(_value | 0x80));
+		_value >>= 7;
+	}
+	_out.push_back((char)_value);
+}
+
+static void AppendLittleEndian(string& _out, uint64_t _value, size_t _bytes) {
+	for (size_t i = 0; i < _bytes; ++i) {
+		_out.push_back((char)(_value >> (8 * i)));
+	}
+}
+
+static uint64_t ReadLittleEndian(const char* _bytes, size_t _count) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		value |= (uint64_t)(unsigned char)_bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+static void ThrowCorrupt(const char* _what) {
+	throw runtime_error(string("Corrupt front coded stream: ") + _what);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Encoding
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void WriteFrontCoded(ostream& _out, const string_view* _lines, size_t _count, size_t _restartInterval) {
+	if (_restartInterval == 0)
+		throw runtime_error("The front coding restart interval must be at least 1");
+
+	string buffer(FRONT_CODING_MAGIC, sizeof(FRONT_CODING_MAGIC));
+	AppendVarint(buffer, _restartInterval);
+	uint64_t written = 0;
+	uint32_t crc = 0;
+	vector<uint64_t> restartOffsets;
+	restartOffsets.reserve(_count / _restartInterval + 1);
+
+	for (size_t i = 0; i < _count; ++i) {
+		// Restart lines share nothing, so decoding can begin at them
+		size_t shared = 0;
+		if (i % _restartInterval == 0) {
+			restartOffsets.push_back(written + buffer.size());
+		}
+		else {
+			size_t maxShared = min(_lines[i].size(), _lines[i - 1].size());
+			shared = (size_t)(mismatch(_lines[i].begin(), _lines[i].begin() + maxShared, _lines[i - 1].begin()).first - _lines[i].begin());
+		}
+		AppendVarint(buffer, (uint64_t)shared + 1);
+		AppendVarint(buffer, _lines[i].size() - shared);
+		buffer.append(_lines[i].data() + shared, _lines[i].size() - shared);
+
+		if (buffer.size() >= FRONT_CODING_WRITE_BUFFER) {
+			crc = UpdateCrc32(crc, buffer.data(), buffer.size());
+			_out.write(buffer.data(), buffer.size());
+			written += buffer.size();
+			buffer.clear();
+		}
+	}
+	AppendVarint(buffer, 0);
+	AppendLittleEndian(buffer, UpdateCrc32(crc, buffer.data(), buffer.size()), 4);
+
+	size_t tableStart = buffer.size();
+	for (uint64_t offset : restartOffsets) {
+		AppendLittleEndian(buffer, offset, 8);
+	}
+	AppendLittleEndian(buffer, restartOffsets.size(), 8);
+	AppendLittleEndian(buffer, _count, 8);
+	AppendLittleEndian(buffer, Crc32(buffer.data() + tableStart, buffer.size() - tableStart), 4);
+	buffer.append(FRONT_CODING_FOOTER_MAGIC, sizeof(FRONT_CODING_FOOTER_MAGIC));
+	_out.write(buffer.data(), buffer.size());
+	if (!_out)
+		throw runtime_error("Could not write the front coded stream");
+}
+
+void WriteFrontCodedFile(const string& _fileName, const vector<string>& _lines, size_t _restartInterval) {
+	ofstream fileOut(_fileName, ofstream::binary | ofstream::trunc);
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _fileName);
+	vector<string_view> views(_lines.begin(), _lines.end());
+	WriteFrontCoded(fileOut, views.data(), views.size(), _restartInterval);
+	fileOut.close();
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _fileName);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decoding
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void DecodeFrontCoded(istream& _in, ostream& _out) {
+	FrontCodedReader reader(_in);
+	string line;
+	while (reader.NextLine(line)) {
+		line.push_back('\n');
+		_out.write(line.data(), line.size());
+	}
+	if (!_out)
+		throw runtime_error("Could not write the decoded lines");
+}
+
+FrontCodedReader::FrontCodedReader(istream& _in) : in(_in) {
+	char magic[sizeof(FRONT_CODING_MAGIC)];
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, FRONT_CODING_MAGIC, sizeof(magic)) != 0)
+		throw runtime_error("Not a front coded stream");
+	crc = Crc32(magic, sizeof(magic));
+	restartInterval = ReadVarint();
+	if (restartInterval == 0)
+		ThrowCorrupt("zero restart interval");
+}
+
+bool FrontCodedReader::NextLine(string& _line) {
+	if (!DecodeNextLine())
+		return false;
+	_line = previousLine;
+	return true;
+}
+
+// Decodes the next line into previousLine, which the line after it is built on.
+bool FrontCodedReader::DecodeNextLine() {
+	if (finished)
+		return false;
+	uint64_t sharedPlusOne = ReadVarint();
+	if (sharedPlusOne == 0) {
+		uint32_t linesCrc = crc;
+		char storedCrc[4];
+		if (!in.read(storedCrc, sizeof(storedCrc)))
+			ThrowCorrupt("truncated checksum");
+		if (checkingCrc && ReadLittleEndian(storedCrc, 4) != linesCrc)
+			ThrowCorrupt("checksum mismatch");
+		finished = true;
+		return false;
+	}
+
+	uint64_t shared = sharedPlusOne - 1;
+	if (shared > previousLine.size() || (shared > 0 && nextLine % restartInterval == 0))
+		ThrowCorrupt("bad shared prefix length");
+	uint64_t suffixLength = ReadVarint();
+	previousLine.resize((size_t)shared);
+	while (suffixLength > 0) {
+		size_t chunk = (size_t)min<uint64_t>(suffixLength, FRONT_CODING_READ_CHUNK);
+		size_t start = previousLine.size();
+		previousLine.resize(start + chunk);
+		ReadChecked(&previousLine[start], chunk, "truncated line");
+		suffixLength -= chunk;
+	}
+	++nextLine;
+	return true;
+}
+
+bool FrontCodedReader::SeekToLine(size_t _line) {
+	ReadFooter();
+	if (_line >= lineCount)
+		return false;
+
+	// The lines decoded from here on are not checked, see the notes in the header
+	size_t restart = (size_t)(_line / restartInterval);
+	checkingCrc = false;
+	in.clear();
+	in.seekg((streamoff)restartOffsets[restart]);
+	nextLine = (size_t)(restart * restartInterval);
+	finished = false;
+	previousLine.clear();
+	while (nextLine < _line) {
+		if (!DecodeNextLine())
+			ThrowCorrupt("fewer lines than the footer says");
+	}
+	return true;
+}
+
+size_t FrontCodedReader::GetLineCount() {
+	ReadFooter();
+	return lineCount;
+}
+
+uint64_t FrontCodedReader::ReadVarint() {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		char byte;
+		ReadChecked(&byte, 1, "truncated varint");
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return value;
+	}
+	ThrowCorrupt("varint too long");
+	return 0;
+}
+
+// Reads _count bytes and adds them to the CRC-32 of the stream, or throws _what if they are missing.
+void FrontCodedReader::ReadChecked(char* _bytes, size_t _count, const char* _what) {
+	if (!in.read(_bytes, _count))
+		ThrowCorrupt(_what);
+	crc = UpdateCrc32(crc, _bytes, _count);
+}
+
+// Reads the restart offsets and line count from the end of the stream, then returns to where it was.
+void FrontCodedReader::ReadFooter() {
+	if (hasFooter)
+		return;
+
+	streampos position = in.tellg();
+	in.seekg(0, ios::end);
+	streamoff size = in.tellg();
+	if (position < 0 || size < (streamoff)FRONT_CODING_FOOTER_SIZE)
+		throw runtime_error("Seeking needs a complete, seekable front coded stream");
+	char footer[FRONT_CODING_FOOTER_SIZE];
+	in.seekg(size - (streamoff)FRONT_CODING_FOOTER_SIZE);
+	if (!in.read(footer, sizeof(footer)) || memcmp(footer + 20, FRONT_CODING_FOOTER_MAGIC, sizeof(FRONT_CODING_FOOTER_MAGIC)) != 0)
+		ThrowCorrupt("missing footer");
+	uint64_t restartCount = ReadLittleEndian(footer, 8);
+	uint64_t lines = ReadLittleEndian(footer + 8, 8);
+	uint64_t tableSize = (uint64_t)(size - (streamoff)FRONT_CODING_FOOTER_SIZE);
+	if (restartCount > tableSize / 8 || restartCount != (lines + restartInterval - 1) / restartInterval)
+		ThrowCorrupt("bad footer");
+
+	string table((size_t)restartCount * 8, '\0');
+	in.seekg((streamoff)(tableSize - restartCount * 8));
+	if (!in.read(&table[0], table.size()))
+		ThrowCorrupt("truncated restart table");
+	if (UpdateCrc32(Crc32(table.data(), table.size()), footer, 16) != ReadLittleEndian(footer + 16, 4))
+		ThrowCorrupt("footer checksum mismatch");
+	restartOffsets.resize((size_t)restartCount);
+	for (size_t i = 0; i < restartOffsets.size(); ++i) {
+		restartOffsets[i] = ReadLittleEndian(table.data() + i * 8, 8);
+		if (restartOffsets[i] >= tableSize)
+			ThrowCorrupt("bad restart offset");
+	}
+	lineCount = (size_t)lines;
+	hasFooter = true;
+
+	in.clear();
+	in.seekg(position);
+}
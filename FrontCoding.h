@@ -0,0 +1,72 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Front Coding
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorted lines stored as the length of the prefix they share with the line before plus the rest of
+// the line. Every restart interval lines the shared length is zero, so decoding can start there:
+//
+//	header		"FRONTCD2", varint restart interval
+//	lines		varint shared length + 1, varint suffix length, the suffix bytes
+//	end			varint 0, uint32 CRC-32 of the header, lines and end marker
+//	restarts	uint64 offset of every restart line, from the start of the file
+//	footer		uint64 restart count, uint64 line count, uint32 CRC-32 of the restarts and the two
+//				counts, "FRONTEND"
+//
+// Varints are LEB128, the fixed size integers little endian. Any order of lines can be encoded, but
+// only sorted neighbours share much. Decoding gives back the lines exactly, and DecodeFrontCoded()
+// the plain text output with a line break after every line.
+//
+// Reading from the start checks the lines against their CRC-32 on reaching the end marker, so the
+// last NextLine() call throws if any of them was corrupt. Seeking checks the restarts and footer, but
+// not the lines it decodes after a restart point.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const size_t FRONT_CODING_RESTART_INTERVAL = 16;
+
+// Encodes _lines to _out. Throws if _out fails.
+void WriteFrontCoded(std::ostream& _out, const std::string_view* _lines, size_t _count, size_t _restartInterval = FRONT_CODING_RESTART_INTERVAL);
+void WriteFrontCodedFile(const std::string& _fileName, const std::vector<std::string>& _lines, size_t _restartInterval = FRONT_CODING_RESTART_INTERVAL);
+// Decodes front coded _in to _out as plain text, one line per line break.
+void DecodeFrontCoded(std::istream& _in, std::ostream& _out);
+
+// Reads the lines of a front coded stream in order. Seeking needs a seekable stream; reading in order
+// does not. Throws on malformed input.
+class FrontCodedReader {
+public:
+	explicit FrontCodedReader(std::istream& _in);
+
+	// Sets _line to the next line and returns true, or returns false after the last one.
+	bool NextLine(std::string& _line);
+	// Positions the reader so that NextLine() returns line _line (counting from 0), decoding from the
+	// restart point before it. Returns false if there is no such line.
+	bool SeekToLine(size_t _line);
+	size_t GetLineCount();
+
+private:
+	bool DecodeNextLine();
+	uint64_t ReadVarint();
+	void ReadChecked(char* _bytes, size_t _count, const char* _what);
+	void ReadFooter();
+
+	std::istream& in;
+	// The CRC-32 of what has been read so far, while reading from the start
+	uint32_t crc = 0;
+	bool checkingCrc = true;
+	uint64_t restartInterval = 0;
+	size_t nextLine = 0;
+	bool finished = false;
+	std::string previousLine;
+	bool hasFooter = false;
+	size_t lineCount = 0;
+	std::vector<uint64_t> restartOffsets;
+};
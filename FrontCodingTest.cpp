@@ -0,0 +1,187 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Front Coding Test
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Notes
+//	* Run by ctest. Encodes lines with several restart intervals and checks that they decode back
+//	  exactly, in order and after seeking to every line, the restart points and the lines around them
+//	  among them. Then cuts the stream short at every length and flips a bit in every byte, and checks
+//	  that reading it all and seeking in it throws.
+//	* Prints what failed and returns 1, or returns 0.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#include "FrontCoding.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <cstdio>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char* TEST_FILE_NAME = "FrontCodingTest.fc";
+
+static int failures = 0;
+
+vector<string> MakeLines(size_t _count);
+void TestRoundTrip(const vector<string>& _lines, size_t _restartInterval);
+void TestFile(const vector<string>& _lines);
+void TestCorruption(const vector<string>& _lines);
+void ReadEverything(const string& _bytes);
+string Encode(const vector<string>& _lines, size_t _restartInterval);
+void Check(bool _passed, const string& _what);
+bool Throws(function<void()> _run);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main() {
+	for (size_t count : { 0, 1, 15, 16, 17, 33, 250 }) {
+		for (size_t restartInterval : { (size_t)1, (size_t)5, FRONT_CODING_RESTART_INTERVAL }) {
+			TestRoundTrip(MakeLines(count), restartInterval);
+		}
+	}
+	TestFile(MakeLines(250));
+	TestCorruption(MakeLines(100));
+
+	remove(TEST_FILE_NAME);
+	if (failures > 0) {
+		cout << failures << " checks failed" << endl;
+		return 1;
+	}
+	cout << "Passed" << endl;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The Stuff
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// _count lines in ascending byte order: an empty line, then groups of lines that share long prefixes,
+// with copies of a line, a line that is a prefix of the next and a long line among them.
+vector<string> MakeLines(size_t _count) {
+	vector<string> lines;
+	if (_count > 0)
+		lines.push_back(string());
+	for (size_t i = 0; lines.size() < _count; ++i) {
+		char line[32];
+		snprintf(line, sizeof(line), "group%02zu/item%03zu", i / 20, i % 20);
+		lines.push_back(line);
+		if (i % 7 == 3 && lines.size() < _count)
+			lines.push_back(line);
+		if (i % 11 == 5 && lines.size() < _count)
+			lines.push_back(string(line) + "/more");
+		if (i == 42 && lines.size() < _count)
+			lines.push_back(string(line) + string(3000, 'x'));
+	}
+	return lines;
+}
+
+void TestRoundTrip(const vector<string>& _lines, size_t _restartInterval) {
+	string name = to_string(_lines.size()) + " lines, restart interval " + to_string(_restartInterval);
+	string bytes = Encode(_lines, _restartInterval);
+
+	istringstream in(bytes);
+	FrontCodedReader reader(in);
+	vector<string> decoded;
+	string line;
+	while (reader.NextLine(line)) {
+		decoded.push_back(line);
+	}
+	Check(decoded == _lines, name + ": lines read in order");
+	Check(reader.GetLineCount() == _lines.size(), name + ": line count");
+
+	// Every line, forwards and then backwards, so that the reader moves both ways across restarts
+	for (size_t pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < _lines.size(); ++i) {
+			size_t target = pass == 0 ? i : _lines.size() - 1 - i;
+			bool found = reader.SeekToLine(target) && reader.NextLine(line);
+			Check(found && line == _lines[target], name + ": SeekToLine(" + to_string(target) + ")");
+		}
+	}
+	// From a restart point to the end, then past the end
+	if (_lines.size() > _restartInterval) {
+		Check(reader.SeekToLine(_restartInterval), name + ": SeekToLine at a restart");
+		vector<string> rest;
+		while (reader.NextLine(line)) {
+			rest.push_back(line);
+		}
+		Check(rest == vector<string>(_lines.begin() + _restartInterval, _lines.end()), name + ": lines read after seeking");
+	}
+	Check(!reader.SeekToLine(_lines.size()), name + ": SeekToLine past the end");
+
+	string text;
+	for (const string& expected : _lines) {
+		text += expected + "\n";
+	}
+	istringstream encoded(bytes);
+	ostringstream plain;
+	DecodeFrontCoded(encoded, plain);
+	Check(plain.str() == text, name + ": DecodeFrontCoded");
+}
+
+void TestFile(const vector<string>& _lines) {
+	WriteFrontCodedFile(TEST_FILE_NAME, _lines);
+	ifstream fileIn(TEST_FILE_NAME, ifstream::binary);
+	string bytes((istreambuf_iterator<char>(fileIn)), istreambuf_iterator<char>());
+	Check(bytes == Encode(_lines, FRONT_CODING_RESTART_INTERVAL), "WriteFrontCodedFile");
+	Check(!Throws([&] { ReadEverything(bytes); }), "reading the file");
+}
+
+void TestCorruption(const vector<string>& _lines) {
+	string bytes = Encode(_lines, FRONT_CODING_RESTART_INTERVAL);
+	for (size_t size = 0; size < bytes.size(); ++size) {
+		Check(Throws([&] { ReadEverything(bytes.substr(0, size)); }), "truncated to " + to_string(size) + " bytes");
+	}
+	for (size_t i = 0; i < bytes.size(); ++i) {
+		string flipped = bytes;
+		flipped[i] ^= (char)(1 << (i % 8));
+		Check(Throws([&] { ReadEverything(flipped); }), "bit " + to_string(i % 8) + " of byte " + to_string(i) + " flipped");
+	}
+}
+
+// Reads every line in order, then seeks to every restart point.
+void ReadEverything(const string& _bytes) {
+	istringstream in(_bytes);
+	FrontCodedReader reader(in);
+	string line;
+	while (reader.NextLine(line)) {
+	}
+	for (size_t i = 0; i < reader.GetLineCount(); i += FRONT_CODING_RESTART_INTERVAL) {
+		if (!reader.SeekToLine(i) || !reader.NextLine(line))
+			throw runtime_error("Missing line " + to_string(i));
+	}
+}
+
+string Encode(const vector<string>& _lines, size_t _restartInterval) {
+	vector<string_view> views(_lines.begin(), _lines.end());
+	ostringstream out;
+	WriteFrontCoded(out, views.data(), views.size(), _restartInterval);
+	return out.str();
+}
+
+void Check(bool _passed, const string& _what) {
+	if (!_passed) {
+		cout << "FAILED: " << _what << endl;
+		++failures;
+	}
+}
+
+bool Throws(function<void()> _run) {
+	try {
+		_run();
+	}
+	catch (const exception&) {
+		return true;
+	}
+	return false;
+}
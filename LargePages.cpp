@@ -0,0 +1,86 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "LargePages.h"
+
+#include <new>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Pages are touched this far apart to fault them in, the smallest page size there is.
+const size_t PREFAULT_STRIDE = 4096;
+
+static size_t RoundUpToLargePages(size_t _bytes) {
+	return (_bytes + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef _WIN32
+// Maps _bytes (a multiple of LARGE_PAGE_SIZE) of ordinary pages starting on a 2 MB boundary, which
+// transparent huge pages need, by over-mapping and trimming both ends.
+static void* MapAlignedPages(size_t _bytes) {
+	void* reserved = mmap(nullptr, _bytes + LARGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserved == MAP_FAILED)
+		return nullptr;
+	uintptr_t start = (uintptr_t)reserved;
+	uintptr_t aligned = (start + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+	if (aligned > start) {
+		munmap(reserved, aligned - start);
+	}
+	size_t tail = start + LARGE_PAGE_SIZE - aligned;
+	if (tail > 0) {
+		munmap((void*)(aligned + _bytes), tail);
+	}
+	return (void*)aligned;
+}
+#endif
+
+void* AllocatePages(size_t _bytes, bool _hugePages) {
+#ifndef _WIN32
+	if (_hugePages && _bytes >= LARGE_PAGE_SIZE) {
+		size_t mappedBytes = RoundUpToLargePages(_bytes);
+#ifdef MAP_HUGETLB
+		// Fails at once if the reserved pool cannot hold the whole mapping
+		void* memory = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (memory != MAP_FAILED)
+			return memory;
+#endif
+		char* pages = (char*)MapAlignedPages(mappedBytes);
+		if (pages == nullptr)
+			throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+		madvise(pages, mappedBytes, MADV_HUGEPAGE);
+#endif
+		// Faulted in after the advice, so that the faults can be served with huge pages
+		for (size_t offset = 0; offset < mappedBytes; offset += PREFAULT_STRIDE) {
+			((volatile char*)pages)[offset] = 0;
+		}
+		return pages;
+	}
+#endif
+	(void)_hugePages;
+	return ::operator new(_bytes);
+}
+
+void FreePages(void* _memory, size_t _bytes, bool _hugePages) {
+	if (_memory == nullptr)
+		return;
+#ifndef _WIN32
+	if (_hugePages && _bytes >= LARGE_PAGE_SIZE) {
+		munmap(_memory, RoundUpToLargePages(_bytes));
+		return;
+	}
+#endif
+	(void)_hugePages;
+	(void)_bytes;
+	::operator delete(_memory);
+}
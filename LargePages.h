@@ -0,0 +1,66 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Large Pages
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Memory for the big buffers of a sort (line views, index permutations, packed records and their
+// arena), which the sort reads at random and which at tens of GB miss the TLB on nearly every access.
+// With huge pages on, an allocation of at least LARGE_PAGE_SIZE is mapped from the reserved 2 MB page
+// pool (MAP_HUGETLB, pre-faulted with MAP_POPULATE) and, when the pool is empty or missing, from
+// ordinary pages aligned to 2 MB and marked for transparent huge pages with madvise(). Either way every
+// page is faulted in by the allocation, not inside the sort loops.
+//
+// Smaller allocations, allocations with huge pages off and all allocations on platforms without mmap
+// come from operator new.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+const size_t LARGE_PAGE_SIZE = (size_t)2 << 20;
+
+// Returns _bytes of memory, from huge pages if _hugePages is set and the allocation is big enough.
+// Throws bad_alloc on failure.
+void* AllocatePages(size_t _bytes, bool _hugePages);
+// Frees memory from AllocatePages(), given the same _bytes and _hugePages.
+void FreePages(void* _memory, size_t _bytes, bool _hugePages);
+
+// Standard allocator over AllocatePages(). Whether it uses huge pages is chosen at run time, per
+// allocator; allocators only compare equal if they make the same choice.
+template <typename T>
+class PageAllocator {
+public:
+	using value_type = T;
+
+	PageAllocator() = default;
+	explicit PageAllocator(bool _hugePages) : hugePages(_hugePages) {}
+	template <typename U>
+	PageAllocator(const PageAllocator<U>& _other) : hugePages(_other.hugePages) {}
+
+	T* allocate(size_t _count) {
+		if (_count > SIZE_MAX / sizeof(T))
+			throw std::bad_array_new_length();
+		return static_cast<T*>(AllocatePages(_count * sizeof(T), hugePages));
+	}
+	void deallocate(T* _memory, size_t _count) {
+		FreePages(_memory, _count * sizeof(T), hugePages);
+	}
+
+	bool hugePages = false;
+};
+
+template <typename T, typename U>
+bool operator==(const PageAllocator<T>& _first, const PageAllocator<U>& _second) {
+	return _first.hugePages == _second.hugePages;
+}
+
+template <typename T, typename U>
+bool operator!=(const PageAllocator<T>& _first, const PageAllocator<U>& _second) {
+	return !(_first == _second);
+}
+
+template <typename T>
+using LargeBuffer = std::vector<T, PageAllocator<T>>;
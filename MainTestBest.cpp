@@ -20,6 +20,15 @@
 //	* 10 points - Improve safety and stability; fix memory leaks and handle unexpected input and edge cases.
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#include "StringSort.h"
+#include "Compression.h"
+#include "SortedTable.h"
+#include "FrontCoding.h"
+#include "ShardedOutput.h"
+#include "MultiProcessSort.h"
+#include "Metrics.h"
+#include "TextLines.h"
+
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -28,6 +37,24 @@
 #include <ctime>
 #include <vector>
 #include <future>
+#include <unordered_map>
+#include <iomanip>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <deque>
+#include <memory>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #ifndef INCLUDE_STD_FILESYSTEM_EXPERIMENTAL
 #   if defined(__cpp_lib_filesystem)
@@ -76,61 +103,252 @@ using std::async;
 // Definitions and Declarations
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 #define MULTITHREADED_ENABLED 1
+#define DISTINCT_ENABLED 1
+// Runs the Multi* sorts across MULTIPROCESS_WORKER_COUNT forked processes, see MultiProcessSort.h.
+// POSIX only.
+#define MULTIPROCESS_ENABLED 0
+// Writes the outputs compressed with OUTPUT_COMPRESSION, as <name>.txt.zst or <name>.txt.lz4.
+#define COMPRESSED_OUTPUT_ENABLED 0
 
-enum class ESortType { AlphabeticalAscending, AlphabeticalDescending, LastLetterAscending };
+// Writes the sorted outputs front coded, as <name>.fc, instead of as text, see FrontCoding.h.
+#define FRONT_CODED_OUTPUT_ENABLED 0
+// Writes the sorted outputs as OUTPUT_SHARD_COUNT range shards plus a manifest instead of one text
+// file, see ShardedOutput.h.
+#define SHARDED_OUTPUT_ENABLED 0
+// Neither applies to the Distinct* outputs, which stay text (compressed if COMPRESSED_OUTPUT_ENABLED).
+// Their lines start with the count, as `uniq -c` writes them, so they are not in sort order: front
+// coding would find no shared prefixes, and the shard cuts and the manifest's first and last lines
+// rely on the lines being sorted.
+// Also writes the byte ordered outputs as <name>.sst sorted tables, see SortedTable.h.
+#define SORTED_TABLE_OUTPUT_ENABLED 0
+// Rewrites METRICS_FILE_NAME every METRICS_INTERVAL with the live counters of Metrics.h, in the
+// Prometheus text format, while the jobs run.
+#define LIVE_METRICS_ENABLED 1
+// Shows the live counters as a progress line on stderr.
+#define PROGRESS_LINE_ENABLED 0
 
-class IStringComparer {
-public:
-	virtual bool IsFirstAboveSecond(string _first, string _second) = 0;
+const ECompression OUTPUT_COMPRESSION = ECompression::Zstd;
+// What reading the input files does with lines that are not valid UTF-8, see TextLines.h.
+const EInvalidUtf8 INPUT_UTF8_POLICY = EInvalidUtf8::Replace;
+const unsigned int OUTPUT_SHARD_COUNT = 8;
+const unsigned int MULTIPROCESS_WORKER_COUNT = 4;
+const char* const METRICS_FILE_NAME = "SortMetrics.prom";
+const chrono::milliseconds METRICS_INTERVAL(1000);
+
+// Run time switches of the Multi* and Distinct* sorts, read from the environment by main():
+// SORT_HUGE_PAGES=1 backs their buffers with 2 MB pages and SORT_PREFETCH=0 turns off the prefetches
+// in their radix and merge loops, see SortPlan.
+static bool sortHugePages = false;
+static bool sortPrefetch = true;
+
+// The lines of one input file, handed from its reader task to the thread gathering the results.
+struct LineBatch {
+	vector<string> lines;
+	exception_ptr error;		// Set instead of lines if reading the file failed
+	LineBatch* next = nullptr;
 };
 
-class AlphabeticalAscendingStringComparer : public IStringComparer {
+// Multi-producer, single-consumer queue of finished batches. Producers push onto an atomic list head;
+// the consumer takes the whole list in one exchange, so no node is ever popped while another thread
+// may still be looking at it. A consumer that finds the list empty sleeps on a condition variable,
+// which every push signals under the lock, so that it cannot miss a push between its check and its
+// wait.
+class LineBatchQueue {
 public:
-	virtual bool IsFirstAboveSecond(string _first, string _second);
+	~LineBatchQueue() {
+		for (LineBatch* batch = PopAll(); batch != nullptr;) {
+			LineBatch* next = batch->next;
+			delete batch;
+			batch = next;
+		}
+	}
+
+	void Push(LineBatch* _batch) {
+		_batch->next = head.load(memory_order_relaxed);
+		while (!head.compare_exchange_weak(_batch->next, _batch, memory_order_release, memory_order_relaxed)) {
+		}
+		lock_guard<mutex> guard(lock);
+		pushed.notify_one();
+	}
+
+	// Like PopAll(), but waits until there is at least one batch.
+	LineBatch* WaitAll() {
+		unique_lock<mutex> guard(lock);
+		pushed.wait(guard, [this] { return head.load(memory_order_relaxed) != nullptr; });
+		guard.unlock();
+		return PopAll();
+	}
+
+	// Takes every batch pushed so far, oldest first, or returns nullptr if there are none.
+	LineBatch* PopAll() {
+		LineBatch* newestFirst = head.exchange(nullptr, memory_order_acquire);
+		LineBatch* oldestFirst = nullptr;
+		while (newestFirst != nullptr) {
+			LineBatch* next = newestFirst->next;
+			newestFirst->next = oldestFirst;
+			oldestFirst = newestFirst;
+			newestFirst = next;
+		}
+		return oldestFirst;
+	}
+
+private:
+	atomic<LineBatch*> head{ nullptr };
+	mutex lock;
+	condition_variable pushed;
+};
+
+// Files the Multi* and Distinct* jobs read as one task: a file of at least SMALL_FILE_BYTES on its own,
+// smaller files bundled, so that a directory of many tiny files does not pay for a task per file.
+// bytes is the size of all the files, from a stat before reading.
+struct ReadTask {
+	vector<string> fileNames;
+	uintmax_t bytes = 0;
+};
+
+// Files below this size are bundled with others into one read task.
+const uintmax_t SMALL_FILE_BYTES = (uintmax_t)1 << 20;
+// Most bytes in one bundle of small files. Bundles are made smaller when there are too few small
+// files to give every reader READ_TASKS_PER_READER of them.
+const uintmax_t READ_TASK_BYTES = (uintmax_t)16 << 20;
+const unsigned int READ_TASKS_PER_READER = 4;
+
+// Share of physical memory that the memory estimates of the jobs main() runs at the same time may add
+// up to, and the cap where physical memory is unknown. SORT_JOB_MEMORY_MB sets the cap instead.
+const size_t JOB_MEMORY_PERCENT = 50;
+const size_t DEFAULT_JOB_MEMORY_CAP = (size_t)2 << 30;
+// Bytes read from the start of every input file to estimate what the jobs will hold.
+const size_t JOB_SAMPLE_BYTES_PER_FILE = 16 << 10;
+// Bytes of an unordered_map<string, size_t> entry besides its string: the next pointer, the count,
+// the cached hash and the bucket.
+const size_t TABLE_ENTRY_BYTES = 4 * sizeof(size_t);
+
+// What main() knows of the input before any job has read it: its size and the lines at the start of
+// every file. Compressed files are not sampled and count at their compressed size.
+struct InputSample {
+	size_t bytes = 0;
+	size_t largestFileBytes = 0;
+	vector<string> lines;
 };
 
-class AlphabeticalDescendingStringComparer : public IStringComparer {
+// What the scheduler hands a job it starts: the threads the job may use and its memory estimate's
+// place under the cap. The memory is given back when the last copy of the reservation goes, so a job
+// passes it on to the output that holds its results and the estimate counts until they are written.
+// With COMPRESSED_OUTPUT_ENABLED the reservation holds the job's threads as well, which compress the
+// output.
+struct JobResources {
+	unsigned int numThreads = 1;
+	shared_ptr<void> reservation;
+};
+
+// Runs a batch of jobs on a shared pool of worker threads. A job starts once a worker is free and its
+// memory estimate fits under the cap next to the jobs already running; of the jobs that fit, the one
+// with the highest priority goes first, ties in the order they were added. A job that is over the cap
+// on its own starts once nothing else is running.
+//
+// There are as many workers as threads, and a job is handed the number of threads it may use: the
+// threads the running jobs do not hold, split evenly between it and the other jobs that free workers
+// could start with it, at least one. So jobs running side by side share the cores instead of each
+// starting a thread per core, while a job that runs on its own gets all of them.
+class JobScheduler {
 public:
-	virtual bool IsFirstAboveSecond(string _first, string _second) override{
-	return _first > _second;
-	}
+	JobScheduler(unsigned int _numWorkers, size_t _memoryCap) : numWorkers(max(1u, _numWorkers)), memoryCap(_memoryCap) {}
+	void Add(string _name, int _priority, size_t _memoryEstimate, function<void(const JobResources&)> _run);
+	// Runs every job added so far and returns once all of them are done. A job that throws is reported
+	// and the others carry on.
+	void RunAll();
+
+private:
+	struct Job {
+		string name;
+		int priority;
+		size_t memoryEstimate;
+		function<void(const JobResources&)> run;
+	};
+
+	int PickJob() const;
+	void RunWorker();
+	void Release(size_t _memoryEstimate, unsigned int _threads);
+
+	unsigned int numWorkers;
+	size_t memoryCap;
+	vector<Job> pending;
+	size_t memoryInUse = 0;
+	unsigned int threadsInUse = 0;
+	unsigned int running = 0;
+	mutex lock;
+	condition_variable jobFinished;
 };
 
-class LastLetterAscendingStringComparer : public IStringComparer {
+// Jobs run at the same time, so their console output is written under this lock.
+static mutex outputLock;
+
+// Most outputs handed to the OutputWriter and not yet written: one being written and one waiting.
+const unsigned int MAX_OUTPUTS_IN_FLIGHT = 2;
+
+// Writes the jobs' outputs on a background thread, so that a job's worker goes on to the next job
+// while its results are written. Each output owns the results it writes, taken over from its job. At
+// most MAX_OUTPUTS_IN_FLIGHT are queued or being written at once and Submit() waits for room, and
+// each holds its job's memory reservation until it is written, see JobResources. Until Start(),
+// outputs are written on the thread that submits them, so that no thread exists while
+// MULTIPROCESS_ENABLED forks its workers.
+class OutputWriter {
 public:
-	virtual bool IsFirstAboveSecond(string _first, string _second) override {
-		if (_first.empty() || _second.empty()) {
-			return false;
+	~OutputWriter() { Finish(); }
+	void Start();
+	void Submit(string _outputName, function<void()> _write);
+	// Waits until every output submitted so far is written, then stops the writer thread.
+	void Finish();
 
-			char lastCharFirst = _first[_first.length() - 1];
-			char lastCharSecond = _second[_second.length() - 1];
+private:
+	struct Output {
+		string name;
+		function<void()> write;
+	};
 
-			return lastCharFirst < lastCharSecond;
-		}
-	}
+	void Run();
+	static void WriteOutput(const Output& _output);
+
+	mutex lock;
+	condition_variable changed;
+	deque<Output> queued;
+	unsigned int inFlight = 0;
+	bool started = false;
+	bool stopping = false;
+	thread writer;
 };
 
-// Function to create the appropriate comparer
-IStringComparer* CreateComparer(ESortType _sortType) {
-	switch (_sortType) {
-	case ESortType::AlphabeticalAscending:
-		return new AlphabeticalAscendingStringComparer();
-	case ESortType::AlphabeticalDescending:
-		return new AlphabeticalDescendingStringComparer();
-	case ESortType::LastLetterAscending:
-		return new LastLetterAscendingStringComparer();
-	}
-	return nullptr;  // Or throw an exception
-}
+static OutputWriter outputWriter;
 
-void DoSingleThreaded(vector<string> _fileList, ESortType _sortType, string _outputName);
-void DoMultiThreaded(vector<string> _fileList, ESortType _sortType, string _outputName);
-vector<string> ReadFile(string _fileName);
+void DoSingleThreaded(vector<string> _fileList, ESortType _sortType, string _outputName, const JobResources& _resources);
+void DoMultiThreaded(vector<string> _fileList, ESortType _sortType, string _outputName, const JobResources& _resources);
+void DoDistinctMultiThreaded(vector<string> _fileList, ESortType _sortType, string _outputName, const JobResources& _resources);
+void DoMultiProcess(vector<string> _fileList, ESortType _sortType, string _outputName);
+vector<string> ReadFile(string _fileName, unsigned int _numThreads);
+void ReadFileDistinct(string _fileName, unordered_map<string, size_t>& _countsOut, unsigned int _numThreads);
 void ThreadedReadFile(string _fileName, vector<string>* _listOut);
+vector<ReadTask> PlanReadTasks(const vector<string>& _fileList, unsigned int _numReaders);
+vector<future<void>> StartReadTasks(const vector<ReadTask>& _tasks, unsigned int _numReaders, function<void(size_t)> _readTask);
+unsigned int ThreadsPerReader(const vector<ReadTask>& _tasks, unsigned int _numThreads);
+void AdviseWillRead(const ReadTask& _task);
+vector<size_t> LargestFirst(const vector<uintmax_t>& _sizes);
+void ReadInputText(string _fileName, string& _textOut, unsigned int _numThreads);
+template <typename TLineVisitor> void ForEachInputLine(const string& _fileName, const string& _text, TLineVisitor _visitLine);
 //vector<string> BubbleSort(vector<string> _listToSort, ESortType _sortType);
-void WriteAndPrintResults(const vector<string>& _masterStringList, string _outputName, int _clocksTaken);
-void merge(vector<string>& arr, int low, int mid, int high, ESortType _sortType);
-void mergeSort(vector<string>& arr, int low, int high, ESortType _sortType, int depth=0);
+void WriteAndPrintResults(const vector<string>& _masterStringList, ESortType _sortType, string _outputName, int _clocksTaken, const SortCounters* _counters, unsigned int _numThreads);
+void WriteAndPrintDistinctResults(const vector<string>& _uniqueStringList, const unordered_map<string, size_t>& _lineCounts, string _outputName, int _clocksTaken, const SortCounters* _counters, unsigned int _numThreads);
+string DescribeSortCounters(const SortCounters* _counters);
+void SubmitResults(vector<string>&& _masterStringList, ESortType _sortType, string _outputName, int _clocksTaken, shared_ptr<SortCounters> _counters, const JobResources& _resources);
+void SubmitDistinctResults(vector<string>&& _uniqueStringList, unordered_map<string, size_t>&& _lineCounts, ESortType _sortType, string _outputName, int _clocksTaken, shared_ptr<SortCounters> _counters, const JobResources& _resources);
+string GetCompressedFileName(string _outputName);
+void WriteSortedTableOutput(const vector<string>& _sortedLines, ESortType _sortType, string _outputName);
+void PrintSortPlan(const SortPlan& _plan, string _outputName);
+void PrintStageClocks(const SortPlan& _plan, string _outputName, int _readClocks, int _sortClocks);
+bool ReadEnvironmentSwitch(const char* _name, bool _default);
+size_t ReadJobMemoryCap();
+InputSample SampleInput(const vector<string>& _fileList);
+size_t EstimateJobMemory(const InputSample& _input, ESortType _sortType, bool _distinct);
+int ClocksSince(chrono::steady_clock::time_point _startTime);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Main
@@ -145,15 +363,60 @@ int main() {
 		}
 	}
 
-	// Do the stuff
-	DoSingleThreaded(fileList, ESortType::AlphabeticalAscending,	"SingleAscending");
-	DoSingleThreaded(fileList, ESortType::AlphabeticalDescending,	"SingleDescending");
-	DoSingleThreaded(fileList, ESortType::LastLetterAscending,		"SingleLastLetter");
+	sortHugePages = ReadEnvironmentSwitch("SORT_HUGE_PAGES", false);
+	sortPrefetch = ReadEnvironmentSwitch("SORT_PREFETCH", true);
+
+	// Do the stuff, longest jobs first so that the shorter ones fill in around them
+	JobScheduler scheduler(thread::hardware_concurrency(), ReadJobMemoryCap());
+	InputSample inputSample = SampleInput(fileList);
+	auto addJob = [&](void (*_doJob)(vector<string>, ESortType, string, const JobResources&), ESortType _sortType, string _outputName, int _priority) {
+		size_t memoryEstimate = EstimateJobMemory(inputSample, _sortType, _doJob == DoDistinctMultiThreaded);
+		scheduler.Add(_outputName, _priority, memoryEstimate, [&fileList, _doJob, _sortType, _outputName](const JobResources& _resources) { _doJob(fileList, _sortType, _outputName, _resources); });
+	};
+	addJob(DoSingleThreaded, ESortType::AlphabeticalAscending,	"SingleAscending",	2);
+	addJob(DoSingleThreaded, ESortType::AlphabeticalDescending,	"SingleDescending",	2);
+	addJob(DoSingleThreaded, ESortType::LastLetterAscending,	"SingleLastLetter",	2);
 #if MULTITHREADED_ENABLED
-	DoMultiThreaded(fileList, ESortType::AlphabeticalAscending,		"MultiAscending");
-	DoMultiThreaded(fileList, ESortType::AlphabeticalDescending,	"MultiDescending");
-	DoMultiThreaded(fileList, ESortType::LastLetterAscending,		"MultiLastLetter");
+	// Worker processes must be forked while this process has a single thread, so with
+	// MULTIPROCESS_ENABLED the Multi* sorts run right here, before the scheduler starts its threads
+	auto addMultiJob = [&](ESortType _sortType, string _outputName) {
+#if MULTIPROCESS_ENABLED
+		try {
+			DoMultiProcess(fileList, _sortType, _outputName);
+		}
+		catch (const exception& e) {
+			cout << endl << _outputName << "\t- Failed: " << e.what() << endl;
+		}
+#else
+		addJob(DoMultiThreaded, _sortType, _outputName, 1);
+#endif
+	};
+	addMultiJob(ESortType::AlphabeticalAscending,		"MultiAscending");
+	addMultiJob(ESortType::AlphabeticalDescending,		"MultiDescending");
+	addMultiJob(ESortType::LastLetterAscending,			"MultiLastLetter");
+	addMultiJob(ESortType::CaseInsensitiveAscending,	"MultiCaseInsensitive");
+	addMultiJob(ESortType::LocaleAscending,				"MultiLocale");
+	addMultiJob(ESortType::NaturalAscending,			"MultiNatural");
+	addMultiJob(ESortType::SuffixAscending,				"MultiSuffix");
+	addMultiJob(ESortType::LastCharacterAscending,		"MultiLastCharacter");
 #endif
+#if DISTINCT_ENABLED
+	addJob(DoDistinctMultiThreaded, ESortType::AlphabeticalAscending,	"DistinctAscending",	0);
+	addJob(DoDistinctMultiThreaded, ESortType::AlphabeticalDescending,	"DistinctDescending",	0);
+	addJob(DoDistinctMultiThreaded, ESortType::LastLetterAscending,		"DistinctLastLetter",	0);
+#endif
+	{
+#if LIVE_METRICS_ENABLED || PROGRESS_LINE_ENABLED
+		// Not started before this point: with MULTIPROCESS_ENABLED the workers are forked above, from a
+		// single thread
+		MetricsPublisher metricsPublisher(LIVE_METRICS_ENABLED ? METRICS_FILE_NAME : "", METRICS_INTERVAL, PROGRESS_LINE_ENABLED != 0);
+#endif
+		// Started here for the same reason
+		outputWriter.Start();
+		scheduler.RunAll();
+		// Every output is on disk before the final metrics are published and main() reports back
+		outputWriter.Finish();
+	}
 
 	// Wait
 	cout << endl << "Finished...";
@@ -164,189 +427,706 @@ int main() {
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // The Stuff
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void DoSingleThreaded(vector<string> _fileList, ESortType _sortType, string _outputName) {
-	clock_t startTime = clock();
+void DoSingleThreaded(vector<string> _fileList, ESortType _sortType, string _outputName, const JobResources& _resources) {
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
 	vector<string> masterStringList;
+	shared_ptr<SortCounters> counters = make_shared<SortCounters>();
 	for (unsigned int i = 0; i < _fileList.size(); ++i) {
-		vector<string> fileStringList = ReadFile(_fileList[i]);
+		vector<string> fileStringList = ReadFile(_fileList[i], _resources.numThreads);
 		for (unsigned int j = 0; j < fileStringList.size(); ++j) {
 			masterStringList.push_back(fileStringList[j]);
 		}
 
-		mergeSort(masterStringList, 0, masterStringList.size() - 1, _sortType);
+		SortPlan plan = PlanSort(masterStringList, _sortType, _resources.numThreads);
+		plan.counters = counters.get();
+		SortLines(masterStringList, _sortType, plan);
+		AddMetric(EMetric::LinesSorted, masterStringList.size());
 		//masterStringList = BubbleSort(masterStringList, _sortType);
 		_fileList.erase(_fileList.begin() + i);
 	}
-	clock_t endTime = clock();
 
-	WriteAndPrintResults(masterStringList, _outputName, endTime - startTime);
+	SubmitResults(move(masterStringList), _sortType, _outputName, ClocksSince(startTime), counters, _resources);
 }
 
-void DoMultiThreaded(vector<string> _fileList, ESortType _sortType, string _outputName) {
-	clock_t startTime = clock();
+void DoMultiThreaded(vector<string> _fileList, ESortType _sortType, string _outputName, const JobResources& _resources) {
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
 	vector<string> masterStringList;
-	vector<thread> workerThreads(_fileList.size());
-	//for (unsigned int i = 0; i < _fileList.size() - 1; ++i) {
-	//	workerThreads[i] = thread(ThreadedReadFile, _fileList[i], &masterStringList);
-	//}
-	
-	//workerThreads[workerThreads.size() - 1].join(); 
 
-	// use a vector of futures
-	vector<future<vector<string>>> workerFutures;
+	// Every reader publishes its task's files as soon as it is done, so the lines are gathered in the
+	// order the tasks finish rather than waiting on them in list order. The gathering order only
+	// affects where lines that sort as equal start out. Every sort type breaks its ties by the whole
+	// line, so such lines are identical and the sorted output is the same in any gathering order.
+	unsigned int numReaders = max(1u, _resources.numThreads);
+	vector<ReadTask> readTasks = PlanReadTasks(_fileList, numReaders);
+	unsigned int readerThreads = ThreadsPerReader(readTasks, numReaders);
+	LineBatchQueue finishedFiles;
+	vector<future<void>> workerFutures = StartReadTasks(readTasks, numReaders, [&finishedFiles, &readTasks, readerThreads](size_t _task) {
+		LineBatch* batch = new LineBatch();
+		try {
+			for (const string& fileName : readTasks[_task].fileNames) {
+				vector<string> fileLines = ReadFile(fileName, readerThreads);
+				if (batch->lines.empty())
+					batch->lines = move(fileLines);
+				else
+					batch->lines.insert(batch->lines.end(), make_move_iterator(fileLines.begin()), make_move_iterator(fileLines.end()));
+			}
+		}
+		catch (...) {
+			batch->error = current_exception();
+		}
+		finishedFiles.Push(batch);
+	});
+
+	exception_ptr readError;
+	size_t tasksGathered = 0;
+	while (tasksGathered < readTasks.size()) {
+		LineBatch* batch = finishedFiles.WaitAll();
+		while (batch != nullptr) {
+			if (batch->error && !readError)
+				readError = batch->error;
+			masterStringList.insert(masterStringList.end(), make_move_iterator(batch->lines.begin()), make_move_iterator(batch->lines.end()));
+			++tasksGathered;
 
-	for (unsigned int i = 0; i < _fileList.size(); ++i) {
-		//workerThreads[i] = thread(ThreadedReadFile, _fileList[i], &masterStringList);
-		  // create a new future for each file read operation
-		workerFutures.push_back(async(launch::async, ReadFile, _fileList[i]));
+			LineBatch* next = batch->next;
+			delete batch;
+			batch = next;
+		}
 	}
-
 	for (auto& workerFuture : workerFutures) {
-		// get the result of each future and concatenate it to masterStringList
-		vector<string> fileStrings = workerFuture.get();
-		masterStringList.insert(masterStringList.end(), fileStrings.begin(), fileStrings.end());
+		workerFuture.get();
 	}
+	if (readError)
+		rethrow_exception(readError);
+	int readClocks = ClocksSince(startTime);
 
 
 	//masterStringList = BubbleSort(masterStringList, _sortType);
-	mergeSort(masterStringList, 0, masterStringList.size() - 1, _sortType);
-	clock_t endTime = clock();
+	chrono::steady_clock::time_point sortStartTime = chrono::steady_clock::now();
+	shared_ptr<SortCounters> counters = make_shared<SortCounters>();
+	SortPlan plan = PlanSort(masterStringList, _sortType, _resources.numThreads);
+	plan.hugePages = sortHugePages;
+	plan.prefetch = sortPrefetch;
+	plan.counters = counters.get();
+	PrintSortPlan(plan, _outputName);
+	SortLines(masterStringList, _sortType, plan);
+	AddMetric(EMetric::LinesSorted, masterStringList.size());
+	PrintStageClocks(plan, _outputName, readClocks, ClocksSince(sortStartTime));
+
+	SubmitResults(move(masterStringList), _sortType, _outputName, ClocksSince(startTime), counters, _resources);
+}
 
-	WriteAndPrintResults(masterStringList, _outputName, endTime - startTime);
+// Like DoMultiThreaded, but the files are read and sorted by forked worker processes, each with a
+// share of the hardware threads. Must be called while this process has a single thread.
+void DoMultiProcess(vector<string> _fileList, ESortType _sortType, string _outputName) {
+#if MULTIPROCESS_ENABLED
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+	MultiProcessConfig config;
+	config.sortType = _sortType;
+	config.numWorkers = MULTIPROCESS_WORKER_COUNT;
+	config.threadsPerWorker = max(1u, thread::hardware_concurrency() / MULTIPROCESS_WORKER_COUNT);
+	config.invalidUtf8 = INPUT_UTF8_POLICY;
+	vector<string> masterStringList = SortFilesMultiProcess(_fileList, config);
+	AddMetric(EMetric::LinesSorted, masterStringList.size());
+
+	JobResources resources;
+	resources.numThreads = thread::hardware_concurrency();
+	SubmitResults(move(masterStringList), _sortType, _outputName, ClocksSince(startTime), nullptr, resources);
+#else
+	(void)_fileList;
+	(void)_sortType;
+	(void)_outputName;
+	throw runtime_error("Built without MULTIPROCESS_ENABLED");
+#endif
+}
+
+// Like DoMultiThreaded, but collapses duplicate lines while reading so that only the unique lines
+// are sorted. Every reader builds its own hash table of line counts; the tables are then folded
+// into the largest one and the output carries a count per line, in the same format as `uniq -c`.
+void DoDistinctMultiThreaded(vector<string> _fileList, ESortType _sortType, string _outputName, const JobResources& _resources) {
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+	// One table per read task, filled by whichever reader takes it
+	unsigned int numReaders = max(1u, _resources.numThreads);
+	vector<ReadTask> readTasks = PlanReadTasks(_fileList, numReaders);
+	unsigned int readerThreads = ThreadsPerReader(readTasks, numReaders);
+	vector<unordered_map<string, size_t>> fileCounts(readTasks.size());
+	vector<future<void>> workerFutures = StartReadTasks(readTasks, numReaders, [&fileCounts, &readTasks, readerThreads](size_t _task) {
+		for (const string& fileName : readTasks[_task].fileNames) {
+			ReadFileDistinct(fileName, fileCounts[_task], readerThreads);
+		}
+	});
+	exception_ptr readError;
+	for (auto& workerFuture : workerFutures) {
+		try {
+			workerFuture.get();
+		}
+		catch (...) {
+			if (!readError)
+				readError = current_exception();
+		}
+	}
+	if (readError)
+		rethrow_exception(readError);
+
+	// Merge the smaller tables into the largest one so we rehash as little as possible
+	unordered_map<string, size_t> lineCounts;
+	size_t largest = 0;
+	for (size_t i = 1; i < fileCounts.size(); ++i) {
+		if (fileCounts[i].size() > fileCounts[largest].size())
+			largest = i;
+	}
+	if (!fileCounts.empty()) {
+		lineCounts = move(fileCounts[largest]);
+	}
+	for (size_t i = 0; i < fileCounts.size(); ++i) {
+		if (i == largest)
+			continue;
+		for (auto& entry : fileCounts[i]) {
+			lineCounts[entry.first] += entry.second;
+		}
+		fileCounts[i].clear();
+	}
+
+	vector<string> uniqueStringList;
+	uniqueStringList.reserve(lineCounts.size());
+	for (const auto& entry : lineCounts) {
+		uniqueStringList.push_back(entry.first);
+	}
+
+	int readClocks = ClocksSince(startTime);
+
+	chrono::steady_clock::time_point sortStartTime = chrono::steady_clock::now();
+	shared_ptr<SortCounters> counters = make_shared<SortCounters>();
+	SortPlan plan = PlanSort(uniqueStringList, _sortType, _resources.numThreads);
+	plan.hugePages = sortHugePages;
+	plan.prefetch = sortPrefetch;
+	plan.counters = counters.get();
+	PrintSortPlan(plan, _outputName);
+	SortLines(uniqueStringList, _sortType, plan);
+	AddMetric(EMetric::LinesSorted, uniqueStringList.size());
+	PrintStageClocks(plan, _outputName, readClocks, ClocksSince(sortStartTime));
+
+	SubmitDistinctResults(move(uniqueStringList), move(lineCounts), _sortType, _outputName, ClocksSince(startTime), counters, _resources);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// File Processing
+// Job Scheduling
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-vector<string> ReadFile(string _fileName) {
-	vector<string> listOut;
-	//streampos positionInFile = 0;
-	//bool endOfFile = false;
-	//while (!endOfFile) {
-		ifstream fileIn(_fileName, ifstream::in);
-		//fileIn.seekg(positionInFile, ios::beg);
-		string line;
-
-		while (getline(fileIn, line)) {
-			listOut.push_back(line);
-		}
+void JobScheduler::Add(string _name, int _priority, size_t _memoryEstimate, function<void(const JobResources&)> _run) {
+	lock_guard<mutex> guard(lock);
+	pending.push_back({ move(_name), _priority, _memoryEstimate, move(_run) });
+}
+
+void JobScheduler::RunAll() {
+	vector<thread> workers;
+	for (unsigned int i = 1; i < numWorkers; ++i) {
+		workers.emplace_back(&JobScheduler::RunWorker, this);
+	}
+	RunWorker();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
 
-		//string* tempString = new string();
-		//getline(fileIn, *tempString);
+// Index of the pending job to start next, or -1 if none fits right now. Called with the lock held.
+int JobScheduler::PickJob() const {
+	int best = -1;
+	for (size_t i = 0; i < pending.size(); ++i) {
+		bool fits = running == 0 || memoryInUse + pending[i].memoryEstimate <= memoryCap;
+		if (fits && (best < 0 || pending[i].priority > pending[best].priority))
+			best = (int)i;
+	}
+	return best;
+}
 
-		//endOfFile = fileIn.peek() == EOF;
-		//positionInFile = endOfFile ? ios::beg : fileIn.tellg();
-		//if (!endOfFile)
-			//listOut.push_back(*tempString);
+void JobScheduler::RunWorker() {
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		int next = -1;
+		jobFinished.wait(guard, [&] { return pending.empty() || (next = PickJob()) >= 0; });
+		if (pending.empty())
+			return;
 
-		//fileIn.close();
-	//}
-	return listOut; 
+		// Every job that a free worker could start now gets the same share of the free threads
+		unsigned int freeThreads = threadsInUse < numWorkers ? numWorkers - threadsInUse : 0;
+		size_t sharingJobs = min(pending.size(), (size_t)(numWorkers - running));
+		unsigned int jobThreads = max(1u, (unsigned int)(freeThreads / sharingJobs));
+		// The threads that compress the output stay held until it is written, see JobResources
+		unsigned int outputThreads = COMPRESSED_OUTPUT_ENABLED ? jobThreads : 0;
+
+		Job job = move(pending[next]);
+		pending.erase(pending.begin() + next);
+		memoryInUse += job.memoryEstimate;
+		threadsInUse += jobThreads;
+		++running;
+		guard.unlock();
+
+		{
+			size_t memoryEstimate = job.memoryEstimate;
+			JobResources resources;
+			resources.numThreads = jobThreads;
+			resources.reservation = shared_ptr<void>(nullptr, [this, memoryEstimate, outputThreads](void*) { Release(memoryEstimate, outputThreads); });
+			try {
+				job.run(resources);
+			}
+			catch (const exception& e) {
+				lock_guard<mutex> outputGuard(outputLock);
+				cout << endl << job.name << "\t- Failed: " << e.what() << endl;
+			}
+		}
+
+		guard.lock();
+		threadsInUse -= jobThreads - outputThreads;
+		--running;
+		jobFinished.notify_all();
+	}
 }
 
-void ThreadedReadFile(string _fileName, vector<string>* _listOut) {
-	*_listOut = ReadFile(_fileName);
+// Gives back the memory, and the threads that compress the output, of a job whose results are
+// written, or dropped if it failed.
+void JobScheduler::Release(size_t _memoryEstimate, unsigned int _threads) {
+	lock_guard<mutex> guard(lock);
+	memoryInUse -= _memoryEstimate;
+	threadsInUse -= _threads;
+	jobFinished.notify_all();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-// Sorting
+// Background Output
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-bool AlphabeticalAscendingStringComparer::IsFirstAboveSecond(string _first, string _second) {
-	unsigned int i = 0;
-	while (i < _first.length() && i < _second.length()) {
-		if (_first[i] < _second[i])
-			return true;
-		else if (_first[i] > _second[i])
-			return false;
-		++i;
-	}
-	return (i == _second.length());
-}
-
-//vector<string> BubbleSort(vector<string> _listToSort, ESortType _sortType) {
-//	//AlphabeticalAscendingStringComparer* stringSorter = new AlphabeticalAscendingStringComparer();
-	//IStringComparer* stringSorter = CreateComparer(_sortType);
-
-	//if (stringSorter == nullptr) {
-	//	throw runtime_error("Invalid sort type"); // throw an exception if an invalid _sortType is passed
-	//}
-
-	//vector<string> sortedList = _listToSort;
-	//for (unsigned int i = 0; i < sortedList.size() - 1; ++i) {
-	//	for (unsigned int j = 0; j < sortedList.size() - 1; ++j) {
-	//		if (!stringSorter->IsFirstAboveSecond(sortedList[j], sortedList[j+1])) {
-	//			string tempString = sortedList[j];
-	//			sortedList[j] = sortedList[j+1];
-	//			sortedList[j+1] = tempString;
-	//		}
-	//	}
-	//}
-	//delete stringSorter;
-	//return sortedList; 
-//}
-
-// merge function to merge two sorted sublists
-void merge(vector<string>& arr, int low, int mid, int high, ESortType _sortType) {
-	vector<string> temp(high - low + 1);
-	int i = low, j = mid + 1, k = 0;
-
-	while (i <= mid && j <= high) {
-		if (!CreateComparer(_sortType)->IsFirstAboveSecond(arr[i], arr[j])) {
-			temp[k++] = arr[i++];
-		}
-		else {
-			temp[k++] = arr[j++];
-		}
+void OutputWriter::Start() {
+	lock_guard<mutex> guard(lock);
+	if (!started && !stopping) {
+		writer = thread(&OutputWriter::Run, this);
+		started = true;
 	}
+}
 
-	while (i <= mid) {
-		temp[k++] = arr[i++];
+void OutputWriter::Submit(string _outputName, function<void()> _write) {
+	Output output{ move(_outputName), move(_write) };
+	unique_lock<mutex> guard(lock);
+	if (!started || stopping) {
+		guard.unlock();
+		WriteOutput(output);
+		return;
 	}
+	changed.wait(guard, [this] { return inFlight < MAX_OUTPUTS_IN_FLIGHT; });
+	++inFlight;
+	queued.push_back(move(output));
+	changed.notify_all();
+}
 
-	while (j <= high) {
-		temp[k++] = arr[j++];
+void OutputWriter::Finish() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
 	}
+	changed.notify_all();
+	if (writer.joinable())
+		writer.join();
+}
 
-	for (k = 0, i = low; i <= high; ++i, ++k) {
-		arr[i] = temp[k];
+void OutputWriter::Run() {
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		changed.wait(guard, [this] { return !queued.empty() || stopping; });
+		if (queued.empty())
+			return;
+		Output output = move(queued.front());
+		queued.pop_front();
+		guard.unlock();
+
+		WriteOutput(output);
+		// The results go now, not when the next output is taken
+		output.write = nullptr;
+
+		guard.lock();
+		--inFlight;
+		changed.notify_all();
 	}
 }
 
-// A threshold for the size of the list below which we will not create new threads.
-const int THREAD_THRESHOLD = 1000;
-// A limit on the depth of the recursion at which we will stop creating new threads.
-const int MAX_THREAD_DEPTH = 3;
+// A failed output is reported like a failed job, the others are still written.
+void OutputWriter::WriteOutput(const Output& _output) {
+	try {
+		_output.write();
+	}
+	catch (const exception& e) {
+		lock_guard<mutex> outputGuard(outputLock);
+		cout << endl << _output.name << "\t- Failed: " << e.what() << endl;
+	}
+}
 
-void mergeSort(vector<string>& arr, int low, int high, ESortType _sortType, int depth) {
-	if (low < high) {
-		int mid = low + (high - low) / 2;
+// The cap on the jobs' memory estimates: SORT_JOB_MEMORY_MB megabytes if it is set to a number,
+// otherwise JOB_MEMORY_PERCENT of physical memory.
+size_t ReadJobMemoryCap() {
+	const char* value = getenv("SORT_JOB_MEMORY_MB");
+	if (value != nullptr) {
+		char* end = nullptr;
+		unsigned long long megabytes = strtoull(value, &end, 10);
+		if (end != value && *end == '\0' && megabytes > 0)
+			return (size_t)megabytes << 20;
+	}
+#if !defined(_WIN32) && defined(_SC_PHYS_PAGES)
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGE_SIZE);
+	if (pages > 0 && pageSize > 0)
+		return (size_t)pages * (size_t)pageSize / 100 * JOB_MEMORY_PERCENT;
+#endif
+	return DEFAULT_JOB_MEMORY_CAP;
+}
 
-		if (depth < MAX_THREAD_DEPTH && high - low > THREAD_THRESHOLD) {
-			std::thread left_thread(mergeSort, std::ref(arr), low, mid, _sortType, depth + 1);
-			std::thread right_thread(mergeSort, std::ref(arr), mid + 1, high, _sortType, depth + 1);
+// Sizes the files of _fileList and reads the lines at the start of each, up to
+// JOB_SAMPLE_BYTES_PER_FILE of them. A line cut off by the limit is left out.
+InputSample SampleInput(const vector<string>& _fileList) {
+	InputSample sample;
+	string head;
+	for (const string& fileName : _fileList) {
+		error_code error;
+		uintmax_t fileSize = fs::file_size(fileName, error);
+		if (error)
+			continue;
+		sample.bytes += (size_t)fileSize;
+		sample.largestFileBytes = max(sample.largestFileBytes, (size_t)fileSize);
 
-			left_thread.join();
-			right_thread.join();
+		ifstream fileIn(fileName, ifstream::binary);
+		head.resize((size_t)min<uintmax_t>(fileSize, JOB_SAMPLE_BYTES_PER_FILE));
+		if (!fileIn.read(&head[0], head.size()) || DetectCompression(head.data(), head.size()) != ECompression::None)
+			continue;
+		size_t headSize = head.size() < fileSize ? head.rfind('\n') + 1 : head.size();
+		ForEachTextLine(head.data(), headSize, EInvalidUtf8::PassThrough, [&](string_view _line) { sample.lines.emplace_back(_line); });
+	}
+	return sample;
+}
+
+// Rough peak memory of a sort job over the input that _input describes: its lines as strings, the text
+// of the files being read and the buffers of the engine the planner is expected to pick for them. A
+// Distinct job holds a table entry and a copy of every unique line instead, and sorts only those.
+size_t EstimateJobMemory(const InputSample& _input, ESortType _sortType, bool _distinct) {
+	vector<string_view> sampleLines(_input.lines.begin(), _input.lines.end());
+	CorpusStats stats = SampleCorpus(sampleLines.data(), sampleLines.size(), _sortType);
+	double lineCount = _input.bytes / (stats.meanLength + 1);
+	// A line too long for the string itself takes a heap block of its own
+	double stringBytes = sizeof(string) + (stats.meanLength >= sizeof(string) ? stats.meanLength + 1 : 0);
+	double bytes = (double)min(_input.bytes, _input.largestFileBytes * max(1u, thread::hardware_concurrency()));
+	if (_distinct) {
+		lineCount *= stats.distinctRatio;
+		stats.distinctRatio = 1;
+		bytes += lineCount * (2 * stringBytes + TABLE_ENTRY_BYTES);
+	}
+	else {
+		bytes += lineCount * stringBytes;
+	}
+	stats.lineCount = (size_t)lineCount;
+	SortPlan plan = PlanSort(stats, _sortType, thread::hardware_concurrency());
+	return (size_t)bytes + EstimateSortMemory(stats, _sortType, plan);
+}
+
+// Wall time since _startTime in clock() ticks. clock() itself counts the CPU time of the whole
+// process, which would include every other job running at the same time.
+int ClocksSince(chrono::steady_clock::time_point _startTime) {
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - _startTime;
+	return (int)(elapsed.count() * CLOCKS_PER_SEC);
+}
+
+// Returns false if environment variable _name is "0", true if it is set to anything else and _default
+// if it is not set.
+bool ReadEnvironmentSwitch(const char* _name, bool _default) {
+	const char* value = getenv(_name);
+	if (value == nullptr)
+		return _default;
+	return strcmp(value, "0") != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// File Processing
+////////////////////////////////////////////////////////////////////////////////////////////////////
+vector<string> ReadFile(string _fileName, unsigned int _numThreads) {
+	vector<string> listOut;
+	string text;
+	ReadInputText(_fileName, text, _numThreads);
+	ForEachInputLine(_fileName, text, [&](string_view _line) { listOut.emplace_back(_line); });
+	AddMetric(EMetric::BytesParsed, text.size());
+	AddMetric(EMetric::FilesRead, 1);
+	return listOut; 
+}
+
+// Adds the count of every line of _fileName to _countsOut.
+void ReadFileDistinct(string _fileName, unordered_map<string, size_t>& _countsOut, unsigned int _numThreads) {
+	string text;
+	ReadInputText(_fileName, text, _numThreads);
+	ForEachInputLine(_fileName, text, [&](string_view _line) { ++_countsOut[string(_line)]; });
+	AddMetric(EMetric::BytesParsed, text.size());
+	AddMetric(EMetric::FilesRead, 1);
+}
+
+void ThreadedReadFile(string _fileName, vector<string>* _listOut) {
+	*_listOut = ReadFile(_fileName, thread::hardware_concurrency());
+}
+
+// Stats the files of _fileList and groups them into read tasks, largest first, so that the biggest
+// files start first and do not stretch the read stage when they happen to come last in the list.
+vector<ReadTask> PlanReadTasks(const vector<string>& _fileList, unsigned int _numReaders) {
+	vector<uintmax_t> fileSizes;
+	uintmax_t smallBytes = 0;
+	for (const string& fileName : _fileList) {
+		error_code error;
+		uintmax_t fileSize = fs::file_size(fileName, error);
+		fileSizes.push_back(error ? 0 : fileSize);
+		if (fileSizes.back() < SMALL_FILE_BYTES)
+			smallBytes += fileSizes.back();
+	}
+	uintmax_t bundleBytes = min(READ_TASK_BYTES, max(SMALL_FILE_BYTES, smallBytes / (max(1u, _numReaders) * READ_TASKS_PER_READER)));
+
+	vector<ReadTask> tasks;
+	ReadTask bundle;
+	for (size_t file : LargestFirst(fileSizes)) {
+		if (fileSizes[file] >= SMALL_FILE_BYTES) {
+			tasks.push_back({ { _fileList[file] }, fileSizes[file] });
+			continue;
 		}
-		else {
-			mergeSort(arr, low, mid, _sortType, depth + 1);
-			mergeSort(arr, mid + 1, high, _sortType, depth + 1);
+		bundle.fileNames.push_back(_fileList[file]);
+		bundle.bytes += fileSizes[file];
+		if (bundle.bytes >= bundleBytes) {
+			tasks.push_back(move(bundle));
+			bundle = ReadTask();
 		}
+	}
+	if (!bundle.fileNames.empty())
+		tasks.push_back(move(bundle));
 
-		merge(arr, low, mid, high, _sortType);
+	// Bundles can be bigger than some of the files on their own
+	vector<uintmax_t> taskSizes;
+	for (const ReadTask& task : tasks) {
+		taskSizes.push_back(task.bytes);
 	}
+	vector<ReadTask> tasksOut;
+	for (size_t task : LargestFirst(taskSizes)) {
+		tasksOut.push_back(move(tasks[task]));
+	}
+	return tasksOut;
 }
 
+// Indices of _sizes from the largest size to the smallest, equal sizes in index order.
+vector<size_t> LargestFirst(const vector<uintmax_t>& _sizes) {
+	auto isSmaller = [&](size_t _first, size_t _second) {
+		return _sizes[_first] != _sizes[_second] ? _sizes[_first] < _sizes[_second] : _first > _second;
+	};
+	priority_queue<size_t, vector<size_t>, decltype(isSmaller)> largest(isSmaller);
+	for (size_t i = 0; i < _sizes.size(); ++i) {
+		largest.push(i);
+	}
+	vector<size_t> order;
+	order.reserve(_sizes.size());
+	while (!largest.empty()) {
+		order.push_back(largest.top());
+		largest.pop();
+	}
+	return order;
+}
+
+// Runs _readTask(i) for every task of _tasks on up to _numReaders threads and returns their futures,
+// which rethrow what _readTask threw. A reader takes the next task in plan order whenever it is done
+// with one, and first asks the kernel to start reading the files of the task one round of readers
+// ahead, so those are in the page cache by the time a reader gets to them.
+vector<future<void>> StartReadTasks(const vector<ReadTask>& _tasks, unsigned int _numReaders, function<void(size_t)> _readTask) {
+	size_t numReaders = min((size_t)max(1u, _numReaders), _tasks.size());
+	shared_ptr<atomic<size_t>> nextTask = make_shared<atomic<size_t>>(0);
+	vector<future<void>> readerFutures;
+	for (size_t reader = 0; reader < numReaders; ++reader) {
+		readerFutures.push_back(async(launch::async, [&_tasks, numReaders, nextTask, _readTask] {
+			for (size_t task = nextTask->fetch_add(1); task < _tasks.size(); task = nextTask->fetch_add(1)) {
+				if (task + numReaders < _tasks.size())
+					AdviseWillRead(_tasks[task + numReaders]);
+				_readTask(task);
+			}
+		}));
+	}
+	return readerFutures;
+}
+
+// Threads each reader of _tasks may decompress with when the read has _numThreads threads: fewer
+// tasks than threads leave threads for the readers that do run.
+unsigned int ThreadsPerReader(const vector<ReadTask>& _tasks, unsigned int _numThreads) {
+	size_t numReaders = max((size_t)1, min((size_t)max(1u, _numThreads), _tasks.size()));
+	return max(1u, (unsigned int)(_numThreads / numReaders));
+}
+
+// Hints that the files of _task will be read soon, so the kernel reads them ahead in the background.
+// Only a hint: does nothing where posix_fadvise() is missing and ignores files that cannot be opened.
+void AdviseWillRead(const ReadTask& _task) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+	for (const string& fileName : _task.fileNames) {
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+#else
+	(void)_task;
+#endif
+}
+
+// Reads all of _fileName into _textOut, decompressed if it is zstd or lz4 (one frame per thread, on up
+// to _numThreads threads). A file that cannot be opened reads as empty.
+void ReadInputText(string _fileName, string& _textOut, unsigned int _numThreads) {
+	_textOut.clear();
+	ifstream fileIn(_fileName, ifstream::binary | ifstream::ate);
+	if (!fileIn)
+		return;
+	streamoff size = fileIn.tellg();
+	fileIn.seekg(0, ios::beg);
+	string fileText((size_t)size, '\0');
+	if (!fileIn.read(&fileText[0], size))
+		throw runtime_error("Could not read " + _fileName);
+
+	ECompression compression = DetectCompression(fileText.data(), fileText.size());
+	if (compression == ECompression::None)
+		_textOut.swap(fileText);
+	else
+		DecompressFrames(fileText.data(), fileText.size(), compression, _textOut, _numThreads);
+}
+
+// Calls _visitLine for each line of _text, split as getline() would split it but without the CR of a
+// CRLF and with invalid UTF-8 handled by INPUT_UTF8_POLICY, see TextLines.h.
+template <typename TLineVisitor>
+void ForEachInputLine(const string& _fileName, const string& _text, TLineVisitor _visitLine) {
+	try {
+		ForEachTextLine(_text.data(), _text.size(), INPUT_UTF8_POLICY, _visitLine);
+	}
+	catch (const runtime_error& e) {
+		throw runtime_error(_fileName + ": " + e.what());
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Output
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-void WriteAndPrintResults(const vector<string>& _masterStringList, string _outputName, int _clocksTaken) {
-	cout << endl << _outputName << "\t- Clocks Taken: " << _clocksTaken << endl;
-	
+void PrintSortPlan(const SortPlan& _plan, string _outputName) {
+	lock_guard<mutex> outputGuard(outputLock);
+	cout << endl << _outputName << "\t- Engine: " << GetEngineName(_plan.engine) << " x" << _plan.numThreads << " (" << _plan.reasons << ")";
+}
+
+// The read (and gather) and sort stages of a job, to compare runs with the memory switches changed.
+void PrintStageClocks(const SortPlan& _plan, string _outputName, int _readClocks, int _sortClocks) {
+	lock_guard<mutex> outputGuard(outputLock);
+	cout << endl << _outputName << "\t- Read Clocks: " << _readClocks << "\t- Sort Clocks: " << _sortClocks
+		<< " (" << (_plan.hugePages ? "huge pages" : "normal pages") << ", prefetch " << (_plan.prefetch ? "on" : "off") << ")";
+}
+
+// Hands the sorted lines of a job over to the output writer, which writes and reports them with the
+// job's threads and then lets go of its reservation. The job's clocks stop here, writing overlaps the
+// jobs that follow.
+void SubmitResults(vector<string>&& _masterStringList, ESortType _sortType, string _outputName, int _clocksTaken, shared_ptr<SortCounters> _counters, const JobResources& _resources) {
+	shared_ptr<vector<string>> lines = make_shared<vector<string>>(move(_masterStringList));
+	outputWriter.Submit(_outputName, [lines, _sortType, _outputName, _clocksTaken, _counters, _resources] {
+		WriteAndPrintResults(*lines, _sortType, _outputName, _clocksTaken, _counters.get(), _resources.numThreads);
+		WriteSortedTableOutput(*lines, _sortType, _outputName);
+	});
+}
+
+void SubmitDistinctResults(vector<string>&& _uniqueStringList, unordered_map<string, size_t>&& _lineCounts, ESortType _sortType, string _outputName, int _clocksTaken, shared_ptr<SortCounters> _counters, const JobResources& _resources) {
+	shared_ptr<vector<string>> lines = make_shared<vector<string>>(move(_uniqueStringList));
+	shared_ptr<unordered_map<string, size_t>> lineCounts = make_shared<unordered_map<string, size_t>>(move(_lineCounts));
+	outputWriter.Submit(_outputName, [lines, lineCounts, _sortType, _outputName, _clocksTaken, _counters, _resources] {
+		WriteAndPrintDistinctResults(*lines, *lineCounts, _outputName, _clocksTaken, _counters.get(), _resources.numThreads);
+		WriteSortedTableOutput(*lines, _sortType, _outputName);
+	});
+}
+
+// The work counted by an instrumented build of the library, to go after "Clocks Taken". Empty for
+// other builds and without counters.
+string DescribeSortCounters(const SortCounters* _counters) {
+	if (!SORT_COUNTERS_ENABLED || _counters == nullptr)
+		return string();
+	ostringstream description;
+	description << "\t- Comparisons: " << _counters->comparisons << "\t- Bytes Compared: " << _counters->bytesCompared
+		<< "\t- Moves: " << _counters->moves << "\t- Depth: " << _counters->maxDepth;
+	return description.str();
+}
+
+void WriteAndPrintResults(const vector<string>& _masterStringList, ESortType _sortType, string _outputName, int _clocksTaken, const SortCounters* _counters, unsigned int _numThreads) {
+	{
+		lock_guard<mutex> outputGuard(outputLock);
+		cout << endl << _outputName << "\t- Clocks Taken: " << _clocksTaken << DescribeSortCounters(_counters) << endl;
+	}
+
+#if SHARDED_OUTPUT_ENABLED
+	(void)_numThreads;
+	for (const OutputShard& shard : WriteShardedOutput(_outputName, _masterStringList, _sortType, OUTPUT_SHARD_COUNT)) {
+		AddMetric(EMetric::BytesWritten, shard.byteCount);
+	}
+#elif FRONT_CODED_OUTPUT_ENABLED
+	(void)_sortType;
+	(void)_numThreads;
+	WriteFrontCodedFile(_outputName + ".fc", _masterStringList);
+	AddMetric(EMetric::BytesWritten, fs::file_size(_outputName + ".fc"));
+#else
+	(void)_sortType;
+#if COMPRESSED_OUTPUT_ENABLED
+	ofstream fileOut(GetCompressedFileName(_outputName), ofstream::binary | ofstream::trunc);
+	BlockCompressor compressor(fileOut, OUTPUT_COMPRESSION, _numThreads);
+	for (unsigned int i = 0; i < _masterStringList.size(); ++i) {
+		compressor.Append(_masterStringList[i]);
+		compressor.Append("\n", 1);
+	}
+	AddMetric(EMetric::BytesWritten, compressor.Finish());
+#else
+	(void)_numThreads;
 	ofstream fileOut(_outputName + ".txt", ofstream::trunc);
 	for (unsigned int i = 0; i < _masterStringList.size(); ++i) {
 		fileOut << _masterStringList[i] << endl;
+		AddMetric(EMetric::BytesWritten, _masterStringList[i].size() + 1);
+	}
+#endif
+	fileOut.close();
+#endif
+}
+
+// Always text, whatever FRONT_CODED_OUTPUT_ENABLED and SHARDED_OUTPUT_ENABLED say; see there.
+void WriteAndPrintDistinctResults(const vector<string>& _uniqueStringList, const unordered_map<string, size_t>& _lineCounts, string _outputName, int _clocksTaken, const SortCounters* _counters, unsigned int _numThreads) {
+	{
+		lock_guard<mutex> outputGuard(outputLock);
+		cout << endl << _outputName << "\t- Clocks Taken: " << _clocksTaken << DescribeSortCounters(_counters) << "\t- Unique Lines: " << _uniqueStringList.size() << endl;
 	}
+
+#if COMPRESSED_OUTPUT_ENABLED
+	ofstream fileOut(GetCompressedFileName(_outputName), ofstream::binary | ofstream::trunc);
+	BlockCompressor compressor(fileOut, OUTPUT_COMPRESSION, _numThreads);
+	ostringstream line;
+	for (unsigned int i = 0; i < _uniqueStringList.size(); ++i) {
+		line.str(string());
+		line << setw(7) << _lineCounts.at(_uniqueStringList[i]) << ' ' << _uniqueStringList[i] << '\n';
+		compressor.Append(line.str());
+	}
+	AddMetric(EMetric::BytesWritten, compressor.Finish());
+#else
+	(void)_numThreads;
+	ofstream fileOut(_outputName + ".txt", ofstream::trunc);
+	for (unsigned int i = 0; i < _uniqueStringList.size(); ++i) {
+		fileOut << setw(7) << _lineCounts.at(_uniqueStringList[i]) << ' ' << _uniqueStringList[i] << '\n';
+	}
+	AddMetric(EMetric::BytesWritten, (uint64_t)fileOut.tellp());
+#endif
 	fileOut.close();
 }
+
+// The name of a compressed output: the text file's name plus the codec's extension.
+string GetCompressedFileName(string _outputName) {
+	return _outputName + ".txt" + (OUTPUT_COMPRESSION == ECompression::Lz4 ? ".lz4" : ".zst");
+}
+
+// Writes _sortedLines as a sorted table when they are in byte order, the only order it can search.
+void WriteSortedTableOutput(const vector<string>& _sortedLines, ESortType _sortType, string _outputName) {
+#if SORTED_TABLE_OUTPUT_ENABLED
+	if (_sortType == ESortType::AlphabeticalAscending) {
+		WriteSortedTable(_outputName + ".sst", _sortedLines);
+		AddMetric(EMetric::BytesWritten, fs::file_size(_outputName + ".sst"));
+	}
+#else
+	(void)_sortedLines;
+	(void)_sortType;
+	(void)_outputName;
+#endif
+}
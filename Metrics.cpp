@@ -0,0 +1,170 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "Metrics.h"
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdio>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Threads are spread over this many shards; threads that share one still only share it with a few.
+const size_t METRIC_SHARDS = 64;
+
+// One cache line per shard, so that threads adding to different shards never contend.
+struct alignas(64) MetricShard {
+	atomic<uint64_t> values[METRIC_COUNT] = {};
+};
+
+static MetricShard metricShards[METRIC_SHARDS];
+static atomic<size_t> nextMetricShard{ 0 };
+
+struct MetricInfo {
+	const char* name;
+	const char* help;
+};
+
+static const MetricInfo METRIC_INFO[METRIC_COUNT] = {
+	{ "stringsort_files_read_total", "Input files read." },
+	{ "stringsort_bytes_parsed_total", "Input bytes split into lines." },
+	{ "stringsort_lines_sorted_total", "Lines handed to the sort engines, counted when their sort finishes." },
+	{ "stringsort_lines_merged_total", "Lines written by merge passes, once per pass." },
+	{ "stringsort_bytes_written_total", "Bytes of sorted output written." },
+};
+
+// Shards are handed out to threads in turn, when a thread first counts something.
+static MetricShard& GetThreadShard() {
+	thread_local MetricShard& shard = metricShards[nextMetricShard.fetch_add(1, memory_order_relaxed) % METRIC_SHARDS];
+	return shard;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Counters
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void AddMetric(EMetric _metric, uint64_t _amount) {
+	GetThreadShard().values[(size_t)_metric].fetch_add(_amount, memory_order_relaxed);
+}
+
+uint64_t ReadMetric(EMetric _metric) {
+	uint64_t total = 0;
+	for (const MetricShard& shard : metricShards) {
+		total += shard.values[(size_t)_metric].load(memory_order_relaxed);
+	}
+	return total;
+}
+
+const char* GetMetricName(EMetric _metric) {
+	return METRIC_INFO[(size_t)_metric].name;
+}
+
+string FormatMetrics() {
+	ostringstream text;
+	for (size_t i = 0; i < METRIC_COUNT; ++i) {
+		text << "# HELP " << METRIC_INFO[i].name << ' ' << METRIC_INFO[i].help << '\n';
+		text << "# TYPE " << METRIC_INFO[i].name << " counter\n";
+		text << METRIC_INFO[i].name << ' ' << ReadMetric((EMetric)i) << '\n';
+	}
+	return text.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Publishing
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static string FormatBytes(double _bytes) {
+	const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+	size_t unit = 0;
+	while (_bytes >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+		_bytes /= 1024;
+		++unit;
+	}
+	ostringstream text;
+	text << fixed << setprecision(unit == 0 ? 0 : 1) << _bytes << ' ' << units[unit];
+	return text.str();
+}
+
+static string FormatCount(double _count) {
+	const char* units[] = { "", "K", "M", "G" };
+	size_t unit = 0;
+	while (_count >= 1000 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+		_count /= 1000;
+		++unit;
+	}
+	ostringstream text;
+	text << fixed << setprecision(unit == 0 ? 0 : 1) << _count << units[unit];
+	return text.str();
+}
+
+MetricsPublisher::MetricsPublisher(string _fileName, chrono::milliseconds _interval, bool _progressLine)
+	: fileName(move(_fileName)), interval(_interval), progressLine(_progressLine) {
+	startTime = chrono::steady_clock::now();
+	lastTime = startTime;
+	lastParsed = ReadMetric(EMetric::BytesParsed);
+	lastWritten = ReadMetric(EMetric::BytesWritten);
+	publisher = thread(&MetricsPublisher::Run, this);
+}
+
+MetricsPublisher::~MetricsPublisher() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	stopSignal.notify_all();
+	publisher.join();
+	Publish();
+	if (progressLine)
+		cerr << endl;
+}
+
+void MetricsPublisher::Run() {
+	unique_lock<mutex> guard(lock);
+	while (!stopSignal.wait_for(guard, interval, [this] { return stopping; })) {
+		guard.unlock();
+		Publish();
+		guard.lock();
+	}
+}
+
+// Failing to write the file is not worth stopping the sort for; the next publish tries again.
+void MetricsPublisher::Publish() {
+	if (!fileName.empty()) {
+		string temporaryName = fileName + ".tmp";
+		ofstream fileOut(temporaryName, ofstream::binary | ofstream::trunc);
+		fileOut << FormatMetrics();
+		fileOut.close();
+		if (fileOut) {
+			// Windows will not rename over an existing file
+			if (rename(temporaryName.c_str(), fileName.c_str()) != 0) {
+				remove(fileName.c_str());
+				rename(temporaryName.c_str(), fileName.c_str());
+			}
+		}
+	}
+
+	if (progressLine) {
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		double seconds = chrono::duration<double>(now - lastTime).count();
+		uint64_t parsed = ReadMetric(EMetric::BytesParsed);
+		uint64_t written = ReadMetric(EMetric::BytesWritten);
+		double parseRate = seconds > 0 ? (parsed - lastParsed) / seconds : 0;
+		double writeRate = seconds > 0 ? (written - lastWritten) / seconds : 0;
+		lastTime = now;
+		lastParsed = parsed;
+		lastWritten = written;
+
+		// Rewritten in place; the trailing spaces clear what is left of a longer previous line
+		cerr << "\r[" << setw(5) << (long long)chrono::duration<double>(now - startTime).count() << "s]"
+			<< " files " << ReadMetric(EMetric::FilesRead)
+			<< "  parsed " << FormatBytes((double)parsed) << " (" << FormatBytes(parseRate) << "/s)"
+			<< "  sorted " << FormatCount((double)ReadMetric(EMetric::LinesSorted)) << " lines"
+			<< "  merged " << FormatCount((double)ReadMetric(EMetric::LinesMerged)) << " lines"
+			<< "  written " << FormatBytes((double)written) << " (" << FormatBytes(writeRate) << "/s)    " << flush;
+	}
+}
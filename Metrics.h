@@ -0,0 +1,63 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Metrics
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Live counters of the whole process, for watching a long job while it runs: files read, bytes
+// parsed into lines, lines sorted, lines written by merge passes and bytes written. Any thread adds to
+// them at any time. Every thread adds to its own shard of the counters with a relaxed atomic add, so
+// counting costs about as much as a plain add, and a reader sums the shards.
+//
+// MetricsPublisher reads them on its own thread and rewrites a file in the Prometheus text format,
+// for a node exporter's textfile collector or any scraper, and optionally a one-line progress display
+// on stderr.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+enum class EMetric { FilesRead, BytesParsed, LinesSorted, LinesMerged, BytesWritten };
+const size_t METRIC_COUNT = 5;
+
+void AddMetric(EMetric _metric, uint64_t _amount);
+uint64_t ReadMetric(EMetric _metric);
+// The metric's Prometheus name, e.g. stringsort_files_read_total.
+const char* GetMetricName(EMetric _metric);
+// Every metric in the Prometheus text exposition format.
+std::string FormatMetrics();
+
+// Publishes the metrics every _interval until destroyed, and once more then, so that the file ends
+// with the final totals.
+class MetricsPublisher {
+public:
+	// _fileName may be empty for the progress line only. The file is replaced through a rename, so a
+	// scraper never sees it half written.
+	MetricsPublisher(std::string _fileName, std::chrono::milliseconds _interval, bool _progressLine);
+	~MetricsPublisher();
+	MetricsPublisher(const MetricsPublisher&) = delete;
+	MetricsPublisher& operator=(const MetricsPublisher&) = delete;
+
+private:
+	void Run();
+	void Publish();
+
+	std::string fileName;
+	std::chrono::milliseconds interval;
+	bool progressLine;
+	std::chrono::steady_clock::time_point startTime;
+	// Totals at the last publish, for the rates on the progress line
+	std::chrono::steady_clock::time_point lastTime;
+	uint64_t lastParsed = 0;
+	uint64_t lastWritten = 0;
+
+	std::mutex lock;
+	std::condition_variable stopSignal;
+	bool stopping = false;
+	std::thread publisher;
+};
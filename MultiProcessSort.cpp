@@ -0,0 +1,436 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "MultiProcessSort.h"
+#include "Compression.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Every run offers this many evenly spaced lines per worker to choose the splitters from.
+const size_t SAMPLES_PER_WORKER = 32;
+// How long a worker waiting at the barrier, or the coordinator waiting on the workers, sleeps
+// between checks.
+const useconds_t EXCHANGE_POLL_MICROSECONDS = 200;
+const size_t WORKER_ERROR_SIZE = 256;
+
+static_assert(atomic<uint64_t>::is_always_lock_free && atomic<uint32_t>::is_always_lock_free, "The exchange shares atomics between processes, which only works if they are lock-free");
+
+// What each worker publishes in the control segment.
+struct WorkerSlot {
+	atomic<uint64_t> runSize;
+	atomic<uint64_t> shardSize;
+	atomic<uint64_t> shardLineCount;
+};
+
+// Start of the control segment, followed by one WorkerSlot per worker.
+struct ExchangeControl {
+	atomic<uint32_t> arrived;
+	atomic<uint32_t> failed;
+	char error[WORKER_ERROR_SIZE];
+
+	WorkerSlot* GetSlots() { return (WorkerSlot*)(this + 1); }
+};
+
+// A POSIX shared memory segment mapped into this process, unmapped again by the destructor. The
+// segment itself stays until its name is unlinked.
+class SharedSegment {
+public:
+	SharedSegment() {}
+	SharedSegment(SharedSegment&& _other) : data(_other.data), size(_other.size) { _other.data = nullptr; }
+	SharedSegment& operator=(SharedSegment&& _other);
+	~SharedSegment();
+	SharedSegment(const SharedSegment&) = delete;
+	SharedSegment& operator=(const SharedSegment&) = delete;
+
+	// Creates the segment _name, with its memory reserved so that running out of it fails here rather
+	// than with a SIGBUS on first touch.
+	static SharedSegment Create(const string& _name, size_t _size);
+	static SharedSegment Open(const string& _name);
+
+	char* data = nullptr;
+	size_t size = 0;
+};
+
+// A run as the other workers see it: lineCount, then lineCount + 1 offsets into the line bytes.
+struct RunView {
+	size_t lineCount;
+	const uint64_t* offsets;
+	const char* bytes;
+
+	string_view GetLine(size_t _line) const { return string_view(bytes + offsets[_line], (size_t)(offsets[_line + 1] - offsets[_line])); }
+};
+
+// The names of one sort's segments, all unlinked by the destructor.
+struct ExchangeNames {
+	string prefix;
+	unsigned int numWorkers = 0;
+
+	string Control() const { return prefix + "-control"; }
+	string Run(unsigned int _worker) const { return prefix + "-run-" + to_string(_worker); }
+	string Shard(unsigned int _worker) const { return prefix + "-shard-" + to_string(_worker); }
+	void UnlinkRuns() const;
+	~ExchangeNames();
+};
+
+static int RunWorker(unsigned int _worker, const vector<string>& _fileNames, const MultiProcessConfig& _config, const ExchangeNames& _names, ExchangeControl* _control);
+static void SortWorkerFiles(unsigned int _worker, const vector<string>& _fileNames, const MultiProcessConfig& _config, const ExchangeNames& _names, ExchangeControl* _control, vector<SharedSegment>& _segments);
+static void WaitForWorkers(ExchangeControl* _control, uint32_t _arrivals);
+static size_t LowerBound(const RunView& _run, string_view _splitter, ESortType _sortType);
+static void AppendFile(const string& _fileName, string& _data, unsigned int _numThreads);
+static vector<vector<string>> AssignFiles(const vector<string>& _fileNames, unsigned int _numWorkers);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Coordinator
+////////////////////////////////////////////////////////////////////////////////////////////////////
+vector<string> SortFilesMultiProcess(const vector<string>& _fileNames, const MultiProcessConfig& _config) {
+	static atomic<unsigned int> sortCount{ 0 };
+	ExchangeNames names;
+	names.prefix = "/stringsort-" + to_string(getpid()) + "-" + to_string(sortCount++);
+	names.numWorkers = max(_config.numWorkers, 1u);
+
+	SharedSegment controlSegment = SharedSegment::Create(names.Control(), sizeof(ExchangeControl) + names.numWorkers * sizeof(WorkerSlot));
+	ExchangeControl* control = new (controlSegment.data) ExchangeControl();
+	for (unsigned int i = 0; i < names.numWorkers; ++i) {
+		new (control->GetSlots() + i) WorkerSlot();
+	}
+
+	// Buffered output would be written again by every child that flushes it
+	fflush(nullptr);
+	vector<vector<string>> workerFiles = AssignFiles(_fileNames, names.numWorkers);
+	vector<pid_t> workers;
+	for (unsigned int worker = 0; worker < names.numWorkers; ++worker) {
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(RunWorker(worker, workerFiles[worker], _config, names, control));
+		if (pid < 0) {
+			// The workers already forked may have failed first, their error stays
+			int forkError = errno;
+			uint32_t expected = 0;
+			if (control->failed.compare_exchange_strong(expected, 1))
+				snprintf(control->error, sizeof(control->error), "fork failed: %s", strerror(forkError));
+			break;
+		}
+		workers.push_back(pid);
+	}
+
+	// A worker that dies makes the others stop waiting for it at the barrier
+	size_t running = workers.size();
+	while (running > 0) {
+		for (pid_t& pid : workers) {
+			if (pid <= 0)
+				continue;
+			int status = 0;
+			pid_t waited = waitpid(pid, &status, WNOHANG);
+			if (waited == 0 || (waited < 0 && errno == EINTR))
+				continue;
+			// Any other error, such as ECHILD when SIGCHLD is ignored, loses the worker's exit status,
+			// so it counts as failed rather than as still running
+			int waitError = errno;
+			pid = 0;
+			--running;
+			if (waited < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				uint32_t expected = 0;
+				if (control->failed.compare_exchange_strong(expected, 1)) {
+					if (waited < 0)
+						snprintf(control->error, sizeof(control->error), "could not wait for a worker: %s", strerror(waitError));
+					else
+						snprintf(control->error, sizeof(control->error), "a worker was killed");
+				}
+			}
+		}
+		if (running > 0)
+			usleep(EXCHANGE_POLL_MICROSECONDS);
+	}
+	names.UnlinkRuns();
+	if (control->failed)
+		throw runtime_error(string("Multi-process sort failed: ") + control->error);
+
+	// The shards are in key order, so appending them in worker order gives the whole sorted output
+	size_t lineCount = 0;
+	for (unsigned int worker = 0; worker < names.numWorkers; ++worker) {
+		lineCount += (size_t)control->GetSlots()[worker].shardLineCount;
+	}
+	vector<string> linesOut;
+	linesOut.reserve(lineCount);
+	for (unsigned int worker = 0; worker < names.numWorkers; ++worker) {
+		SharedSegment shard = SharedSegment::Open(names.Shard(worker));
+		const char* shardEnd = shard.data + control->GetSlots()[worker].shardSize;
+		for (const char* lineStart = shard.data; lineStart < shardEnd;) {
+			const char* lineEnd = (const char*)memchr(lineStart, '\n', shardEnd - lineStart);
+			linesOut.emplace_back(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+		}
+	}
+	return linesOut;
+}
+
+// Greedy balance by bytes: every file, largest first, goes to the worker with the fewest bytes so far.
+static vector<vector<string>> AssignFiles(const vector<string>& _fileNames, unsigned int _numWorkers) {
+	vector<pair<off_t, string>> files;
+	for (const string& fileName : _fileNames) {
+		struct stat fileStat;
+		files.emplace_back(stat(fileName.c_str(), &fileStat) == 0 ? fileStat.st_size : 0, fileName);
+	}
+
+	vector<vector<string>> workerFiles(_numWorkers);
+	vector<off_t> workerBytes(_numWorkers, 0);
+	for (size_t assigned = 0; assigned < files.size(); ++assigned) {
+		auto largest = max_element(files.begin() + assigned, files.end(), [](const pair<off_t, string>& _first, const pair<off_t, string>& _second) {
+			return _first.first < _second.first;
+		});
+		swap(files[assigned], *largest);
+		size_t worker = (size_t)(min_element(workerBytes.begin(), workerBytes.end()) - workerBytes.begin());
+		workerFiles[worker].push_back(files[assigned].second);
+		workerBytes[worker] += files[assigned].first;
+	}
+	return workerFiles;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Workers
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Entry point of a forked worker. Returns its exit code; the first worker to fail leaves its error
+// for the coordinator.
+static int RunWorker(unsigned int _worker, const vector<string>& _fileNames, const MultiProcessConfig& _config, const ExchangeNames& _names, ExchangeControl* _control) {
+	try {
+		vector<SharedSegment> segments;
+		SortWorkerFiles(_worker, _fileNames, _config, _names, _control, segments);
+		return 0;
+	}
+	catch (const exception& e) {
+		uint32_t expected = 0;
+		if (_control->failed.compare_exchange_strong(expected, 1))
+			snprintf(_control->error, sizeof(_control->error), "worker %u: %s", _worker, e.what());
+		return 1;
+	}
+}
+
+static void SortWorkerFiles(unsigned int _worker, const vector<string>& _fileNames, const MultiProcessConfig& _config, const ExchangeNames& _names, ExchangeControl* _control, vector<SharedSegment>& _segments) {
+	unsigned int numWorkers = _names.numWorkers;
+	SortConfig config;
+	config.sortType = _config.sortType;
+	config.numThreads = max(_config.threadsPerWorker, 1u);
+
+	// Sort this worker's files into one run
+	string data;
+	for (const string& fileName : _fileNames) {
+		AppendFile(fileName, data, config.numThreads);
+	}
+	vector<string_view> lines;
+	deque<string> repairedLines;
+	SplitTextLines(data.data(), data.size(), _config.invalidUtf8, lines, repairedLines);
+	vector<size_t> order = SortLineOrder(lines.data(), lines.size(), config);
+
+	size_t lineBytes = 0;
+	for (string_view line : lines) {
+		lineBytes += line.size();
+	}
+	size_t runSize = sizeof(uint64_t) * (lines.size() + 2) + lineBytes;
+	_segments.push_back(SharedSegment::Create(_names.Run(_worker), runSize));
+	char* run = _segments.back().data;
+	uint64_t* offsets = (uint64_t*)(run + sizeof(uint64_t));
+	char* bytes = (char*)(offsets + lines.size() + 1);
+	*(uint64_t*)run = lines.size();
+	offsets[0] = 0;
+	for (size_t i = 0; i < order.size(); ++i) {
+		memcpy(bytes + offsets[i], lines[order[i]].data(), lines[order[i]].size());
+		offsets[i + 1] = offsets[i] + lines[order[i]].size();
+	}
+	string().swap(data);
+	vector<string_view>().swap(lines);
+	deque<string>().swap(repairedLines);
+	_control->GetSlots()[_worker].runSize = runSize;
+	WaitForWorkers(_control, numWorkers);
+
+	// Every worker sees the same runs, so every worker picks the same splitters
+	vector<RunView> runs;
+	for (unsigned int worker = 0; worker < numWorkers; ++worker) {
+		if (worker != _worker)
+			_segments.push_back(SharedSegment::Open(_names.Run(worker)));
+		const char* runData = worker == _worker ? run : _segments.back().data;
+		RunView view;
+		view.lineCount = (size_t)*(const uint64_t*)runData;
+		view.offsets = (const uint64_t*)(runData + sizeof(uint64_t));
+		view.bytes = (const char*)(view.offsets + view.lineCount + 1);
+		runs.push_back(view);
+	}
+
+	vector<string_view> samples;
+	for (const RunView& view : runs) {
+		size_t sampleCount = min(view.lineCount, SAMPLES_PER_WORKER * numWorkers);
+		for (size_t i = 0; i < sampleCount; ++i) {
+			samples.push_back(view.GetLine((i * view.lineCount + view.lineCount / 2) / sampleCount));
+		}
+	}
+	SortConfig sampleConfig = config;
+	sampleConfig.numThreads = 1;
+	vector<size_t> sampleOrder = SortLineOrder(samples.data(), samples.size(), sampleConfig);
+
+	// This worker's key range is [splitter _worker - 1, splitter _worker), open ended at either end
+	vector<string_view> rangeLines;
+	for (const RunView& view : runs) {
+		size_t rangeBegin = 0;
+		size_t rangeEnd = view.lineCount;
+		if (!samples.empty() && _worker > 0)
+			rangeBegin = LowerBound(view, samples[sampleOrder[_worker * samples.size() / numWorkers]], _config.sortType);
+		if (!samples.empty() && _worker + 1 < numWorkers)
+			rangeEnd = LowerBound(view, samples[sampleOrder[(_worker + 1) * samples.size() / numWorkers]], _config.sortType);
+		for (size_t i = rangeBegin; i < rangeEnd; ++i) {
+			rangeLines.push_back(view.GetLine(i));
+		}
+	}
+	vector<size_t> rangeOrder = SortLineOrder(rangeLines.data(), rangeLines.size(), config);
+
+	size_t shardSize = 0;
+	for (string_view line : rangeLines) {
+		shardSize += line.size() + 1;
+	}
+	SharedSegment shard = SharedSegment::Create(_names.Shard(_worker), shardSize);
+	char* shardPosition = shard.data;
+	for (size_t i : rangeOrder) {
+		memcpy(shardPosition, rangeLines[i].data(), rangeLines[i].size());
+		shardPosition += rangeLines[i].size();
+		*shardPosition++ = '\n';
+	}
+	_control->GetSlots()[_worker].shardSize = shardSize;
+	_control->GetSlots()[_worker].shardLineCount = rangeLines.size();
+}
+
+// Waits until _arrivals workers in total have arrived. Throws if a worker failed meanwhile.
+static void WaitForWorkers(ExchangeControl* _control, uint32_t _arrivals) {
+	++_control->arrived;
+	while (_control->arrived < _arrivals) {
+		if (_control->failed)
+			throw runtime_error("stopped, another worker failed");
+		usleep(EXCHANGE_POLL_MICROSECONDS);
+	}
+}
+
+// Index of the first line of _run that does not sort below _splitter.
+static size_t LowerBound(const RunView& _run, string_view _splitter, ESortType _sortType) {
+	size_t low = 0;
+	size_t high = _run.lineCount;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (IsLineBelow(_run.GetLine(middle), _splitter, _sortType))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// Appends the whole file to _data, decompressed if it is zstd or lz4, ending with a line break.
+static void AppendFile(const string& _fileName, string& _data, unsigned int _numThreads) {
+	ifstream fileIn(_fileName, ifstream::binary | ifstream::ate);
+	if (!fileIn)
+		throw runtime_error("Cannot open " + _fileName);
+	streamoff size = fileIn.tellg();
+	fileIn.seekg(0);
+
+	size_t start = _data.size();
+	_data.resize(start + (size_t)size);
+	fileIn.read(&_data[start], size);
+	_data.resize(start + (size_t)fileIn.gcount());
+
+	ECompression compression = DetectCompression(_data.data() + start, _data.size() - start);
+	if (compression != ECompression::None) {
+		string compressed(_data, start);
+		_data.resize(start);
+		DecompressFrames(compressed.data(), compressed.size(), compression, _data, _numThreads);
+	}
+	if (_data.size() > start && _data.back() != '\n')
+		_data.push_back('\n');
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Shared Memory
+////////////////////////////////////////////////////////////////////////////////////////////////////
+SharedSegment SharedSegment::Create(const string& _name, size_t _size) {
+	int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		throw runtime_error("Cannot create shared memory " + _name + ": " + strerror(errno));
+
+	// mmap() cannot map nothing, so an empty segment still gets a byte
+	SharedSegment segment;
+	segment.size = max(_size, (size_t)1);
+	int error = ftruncate(fd, (off_t)segment.size) != 0 ? errno : posix_fallocate(fd, 0, (off_t)segment.size);
+	void* mapped = error == 0 ? mmap(nullptr, segment.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (error == 0 && mapped == MAP_FAILED)
+		error = errno;
+	close(fd);
+	if (error != 0)
+		throw runtime_error("Cannot allocate " + to_string(segment.size) + " bytes of shared memory " + _name + ": " + strerror(error));
+	segment.data = (char*)mapped;
+	return segment;
+}
+
+SharedSegment SharedSegment::Open(const string& _name) {
+	int fd = shm_open(_name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		throw runtime_error("Cannot open shared memory " + _name + ": " + strerror(errno));
+
+	SharedSegment segment;
+	struct stat segmentStat;
+	int error = fstat(fd, &segmentStat) != 0 ? errno : 0;
+	segment.size = (size_t)segmentStat.st_size;
+	void* mapped = error == 0 ? mmap(nullptr, segment.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (error == 0 && mapped == MAP_FAILED)
+		error = errno;
+	close(fd);
+	if (error != 0)
+		throw runtime_error("Cannot map shared memory " + _name + ": " + strerror(error));
+	segment.data = (char*)mapped;
+	return segment;
+}
+
+SharedSegment& SharedSegment::operator=(SharedSegment&& _other) {
+	if (this != &_other) {
+		if (data != nullptr)
+			munmap(data, size);
+		data = _other.data;
+		size = _other.size;
+		_other.data = nullptr;
+	}
+	return *this;
+}
+
+SharedSegment::~SharedSegment() {
+	if (data != nullptr)
+		munmap(data, size);
+}
+
+void ExchangeNames::UnlinkRuns() const {
+	for (unsigned int worker = 0; worker < numWorkers; ++worker) {
+		shm_unlink(Run(worker).c_str());
+	}
+}
+
+ExchangeNames::~ExchangeNames() {
+	shm_unlink(Control().c_str());
+	UnlinkRuns();
+	for (unsigned int worker = 0; worker < numWorkers; ++worker) {
+		shm_unlink(Shard(worker).c_str());
+	}
+}
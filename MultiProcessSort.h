@@ -0,0 +1,41 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Multi-Process Sort
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorts a set of files across forked worker processes, each with its own heap, so that the workers do
+// not contend on one allocator. POSIX only.
+//
+//	1. The coordinator hands the files out to the workers, largest first to the least loaded one.
+//	2. Every worker reads its files, sorts them into one run and publishes the run as a POSIX shared
+//	   memory segment.
+//	3. Every worker maps all runs and picks the same splitters from a regular sample of them, then
+//	   takes the lines between its two splitters from every run (a binary search each) and sorts them.
+//	   Worker w ends up with the w-th key range, disjoint from all others, and publishes it as a shard.
+//	4. The coordinator concatenates the shards in order.
+//
+// The workers wait on each other through a barrier in a shared control segment; a worker that fails
+// makes the others give up instead of waiting forever. All segments are removed before returning.
+//
+// Fork from a single threaded process only: a child starts with the one thread that called fork(),
+// and locks held by any other thread at that moment are never released in it.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include "StringSort.h"
+#include "TextLines.h"
+
+#include <string>
+#include <vector>
+
+struct MultiProcessConfig {
+	ESortType sortType = ESortType::AlphabeticalAscending;
+	unsigned int numWorkers = 4;
+	unsigned int threadsPerWorker = 1;
+	EInvalidUtf8 invalidUtf8 = EInvalidUtf8::Replace;
+};
+
+// Returns the lines of _fileNames sorted by _config.sortType. Files are split into lines as by
+// ForEachTextLine(), with _config.invalidUtf8; zstd and lz4 files are decompressed. Throws if a file cannot be read or a
+// worker fails.
+std::vector<std::string> SortFilesMultiProcess(const std::vector<std::string>& _fileNames, const MultiProcessConfig& _config);
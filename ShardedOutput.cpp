@@ -0,0 +1,149 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "ShardedOutput.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <future>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Each shard writer hands its lines to the file in pieces of about this size.
+const size_t SHARD_WRITE_BUFFER = 1 << 20;
+
+static void WriteShard(const OutputShard& _shard, const string_view* _lines);
+static void WriteManifest(const string& _fileName, const vector<OutputShard>& _shards, const string_view* _lines);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sharding
+////////////////////////////////////////////////////////////////////////////////////////////////////
+vector<OutputShard> PlanOutputShards(const string_view* _lines, size_t _count, ESortType _sortType, unsigned int _shardCount) {
+	_shardCount = max(_shardCount, 1u);
+	size_t totalBytes = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		totalBytes += _lines[i].size() + 1;
+	}
+
+	// Lines sort equal if neither goes before the other; without a comparer only identical lines do
+	IStringComparer* comparer = CreateComparer(_sortType);
+	auto sortsEqual = [&](size_t _first) {
+		if (comparer == nullptr)
+			return _lines[_first] == _lines[_first + 1];
+		return comparer->IsFirstAboveSecond(_lines[_first + 1], _lines[_first]);
+	};
+
+	vector<OutputShard> shards;
+	size_t shardStart = 0;
+	size_t shardStartBytes = 0;
+	size_t position = 0;
+	size_t bytesBefore = 0;
+	for (unsigned int shard = 1; shard <= _shardCount; ++shard) {
+		// Cut at the first line past this shard's share of the bytes, moved past any equal lines
+		size_t targetBytes = totalBytes / _shardCount * shard + totalBytes % _shardCount * shard / _shardCount;
+		while (position < _count && (shard == _shardCount || bytesBefore < targetBytes)) {
+			bytesBefore += _lines[position].size() + 1;
+			++position;
+		}
+		while (position > 0 && position < _count && sortsEqual(position - 1)) {
+			bytesBefore += _lines[position].size() + 1;
+			++position;
+		}
+
+		if (position > shardStart) {
+			OutputShard outputShard;
+			outputShard.firstLine = shardStart;
+			outputShard.lineCount = position - shardStart;
+			outputShard.byteCount = bytesBefore - shardStartBytes;
+			shards.push_back(outputShard);
+		}
+		shardStart = position;
+		shardStartBytes = bytesBefore;
+	}
+
+	delete comparer;
+	return shards;
+}
+
+vector<OutputShard> WriteShardedOutput(const string& _baseName, const string_view* _lines, size_t _count, ESortType _sortType, unsigned int _shardCount) {
+	vector<OutputShard> shards = PlanOutputShards(_lines, _count, _sortType, _shardCount);
+	for (size_t i = 0; i < shards.size(); ++i) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "-%03zu.txt", i);
+		shards[i].fileName = _baseName + suffix;
+	}
+
+	vector<future<void>> writerFutures;
+	for (const OutputShard& shard : shards) {
+		writerFutures.push_back(async(launch::async, WriteShard, cref(shard), _lines));
+	}
+	// Every writer is done with the shards before a failed one is rethrown
+	for (auto& writerFuture : writerFutures) {
+		writerFuture.wait();
+	}
+	for (auto& writerFuture : writerFutures) {
+		writerFuture.get();
+	}
+
+	WriteManifest(_baseName + ".manifest", shards, _lines);
+	return shards;
+}
+
+vector<OutputShard> WriteShardedOutput(const string& _baseName, const vector<string>& _lines, ESortType _sortType, unsigned int _shardCount) {
+	vector<string_view> views(_lines.begin(), _lines.end());
+	return WriteShardedOutput(_baseName, views.data(), views.size(), _sortType, _shardCount);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void WriteShard(const OutputShard& _shard, const string_view* _lines) {
+	ofstream fileOut(_shard.fileName, ofstream::binary | ofstream::trunc);
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _shard.fileName);
+
+	string buffer;
+	buffer.reserve(SHARD_WRITE_BUFFER + 4096);
+	for (size_t i = _shard.firstLine; i < _shard.firstLine + _shard.lineCount; ++i) {
+		buffer.append(_lines[i]);
+		buffer.push_back('\n');
+		if (buffer.size() >= SHARD_WRITE_BUFFER) {
+			fileOut.write(buffer.data(), buffer.size());
+			buffer.clear();
+		}
+	}
+	fileOut.write(buffer.data(), buffer.size());
+	fileOut.close();
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _shard.fileName);
+}
+
+static void WriteManifest(const string& _fileName, const vector<OutputShard>& _shards, const string_view* _lines) {
+	ofstream fileOut(_fileName, ofstream::binary | ofstream::trunc);
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _fileName);
+	size_t lineCount = 0;
+	size_t byteCount = 0;
+	for (const OutputShard& shard : _shards) {
+		lineCount += shard.lineCount;
+		byteCount += shard.byteCount;
+	}
+	fileOut << "shards " << _shards.size() << ' ' << lineCount << ' ' << byteCount << '\n';
+	for (const OutputShard& shard : _shards) {
+		size_t nameStart = shard.fileName.find_last_of("/\\");
+		string fileName = nameStart == string::npos ? shard.fileName : shard.fileName.substr(nameStart + 1);
+		fileOut << "shard " << fileName << ' ' << shard.lineCount << ' ' << shard.byteCount << '\n';
+		fileOut << "first " << _lines[shard.firstLine] << '\n';
+		fileOut << "last " << _lines[shard.firstLine + shard.lineCount - 1] << '\n';
+	}
+	fileOut.close();
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _fileName);
+}
@@ -0,0 +1,43 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sharded Output
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorted lines written as several text files that each hold one contiguous range of the order, so
+// that they can be written and loaded in parallel. Shards are cut to hold about the same number of
+// bytes, and never between two lines that sort equal, so no key is in two shards. A shard may come
+// out empty when long runs of equal lines leave nothing for it; empty shards are not written.
+//
+// Next to the shards a manifest, <base>.manifest, lists them in order:
+//
+//	shards <shard count> <line count> <byte count>
+//	shard <file name> <line count> <byte count>
+//	first <first line of the shard>
+//	last <last line of the shard>
+//
+// with the shard, first and last lines repeated for every shard. File names are relative to the
+// manifest's directory.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include "StringSort.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct OutputShard {
+	std::string fileName;
+	size_t firstLine = 0;
+	size_t lineCount = 0;
+	size_t byteCount = 0;
+};
+
+// Splits _lines, sorted by _sortType, into at most _shardCount shards. Lines are counted with their
+// line break. The file names are left empty.
+std::vector<OutputShard> PlanOutputShards(const std::string_view* _lines, size_t _count, ESortType _sortType, unsigned int _shardCount);
+// Writes _lines as <_baseName>-<shard>.txt files, one thread each, then the manifest. Returns the
+// shards written. Throws if a file cannot be written.
+std::vector<OutputShard> WriteShardedOutput(const std::string& _baseName, const std::string_view* _lines, size_t _count, ESortType _sortType, unsigned int _shardCount);
+std::vector<OutputShard> WriteShardedOutput(const std::string& _baseName, const std::vector<std::string>& _lines, ESortType _sortType, unsigned int _shardCount);
@@ -0,0 +1,893 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sort Daemon
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Notes
+//	* Takes sort jobs over a Unix domain socket and keeps its worker threads and their buffers alive
+//	  between jobs, so a job does not pay again for process start-up, thread creation, allocator
+//	  warm-up and first-touch page faults. POSIX only.
+//	* Usage: SortDaemon <socket path> [worker threads]. Stops on SIGINT or SIGTERM once the accepted
+//	  requests have been read and the queued jobs are done. SORT_HUGE_PAGES=1 in the environment backs
+//	  the sort buffers with 2 MB pages and SORT_PREFETCH=0 turns off the prefetches in the sort loops,
+//	  see SortPlan.
+//	* The accepting thread only accepts. Requests are read by a pool of READER_THREADS readers, so a
+//	  slow client holds up no one but its own reader.
+//	* Whoever can connect to the socket can have the daemon read and write files with its own
+//	  permissions, so the socket (created with the umask) must only be reachable by trusted users.
+//	  SORT_ROOT=<directory> in the environment restricts INPUT and OUTPUT to paths inside that
+//	  directory. They are opened when the job runs, one directory at a time from a descriptor of the
+//	  root taken at startup and without following symbolic links, so a path that passed the check
+//	  cannot be switched to lead outside the root before it is used.
+// Protocol
+//	* One job per connection. The client sends a request of text lines and then reads the response:
+//		SORT <sort type>		ESortType name, e.g. SORT AlphabeticalAscending
+//		INPUT <path>			any number of times, read on the daemon's side; zstd and lz4 files are
+//								decompressed
+//		DATA <byte count>		followed by that many bytes of lines, any number of times as long as
+//								they add up to at most MAX_DATA_BYTES
+//		UTF8 <policy>			EInvalidUtf8 name for lines that are not valid UTF-8, Replace by
+//								default; CRLF line endings are always read as LF
+//		OUTPUT <path>			or - to get the sorted lines back on the socket; a path ending in .zst
+//								or .lz4 is written compressed, one ending in .sst as a sorted table
+//								(AlphabeticalAscending only) and one ending in .fc front coded
+//		END
+//	* The response is "OK <lines> <queued us> <run us> <total us>" or "ERROR <message>". For OUTPUT -
+//	  it is followed by "DATA <byte count>" and the sorted lines.
+//	* Small jobs that are waiting together, and those that follow them within BATCH_WINDOW, are taken
+//	  by one worker as a micro-batch and run back to back on one thread each. A batch only takes its
+//	  worker's share of the waiting jobs, the rest are left to the idle workers. A large job gets up to
+//	  its share of the hardware threads that running jobs do not hold, split with the waiting jobs that
+//	  idle workers will take, and the planner picks from those.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "StringSort.h"
+#include "Compression.h"
+#include "SortedTable.h"
+#include "FrontCoding.h"
+#include "TextLines.h"
+
+#include <string>
+#include <iostream>
+#include <streambuf>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Jobs with less input than this are run on one thread and may be batched.
+const size_t SMALL_JOB_BYTES = 1 << 20;
+// Most jobs one worker takes at once.
+const size_t BATCH_MAX_JOBS = 64;
+// How long a worker that took a small job waits for more to join its batch.
+const chrono::microseconds BATCH_WINDOW(200);
+const int LISTEN_BACKLOG = 128;
+// Threads that read the requests of accepted connections.
+const unsigned int READER_THREADS = 8;
+// A client that stalls for this long while sending its request is dropped, as is one that takes
+// longer than REQUEST_TIMEOUT altogether.
+const int CLIENT_TIMEOUT_SECONDS = 5;
+const chrono::seconds REQUEST_TIMEOUT(60);
+const size_t MAX_REQUEST_LINE = 64 * 1024;
+// Most bytes of lines a request may send with DATA; larger inputs are read from files with INPUT.
+const size_t MAX_DATA_BYTES = (size_t)1 << 30;
+// Bytes an output stream collects before they are written to its file.
+const size_t FILE_BUFFER_SIZE = 64 * 1024;
+#ifdef O_PATH
+// The directories on the way to a path under SORT_ROOT are only walked through, never read.
+const int DIRECTORY_OPEN_FLAGS = O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+#else
+const int DIRECTORY_OPEN_FLAGS = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+#endif
+
+using Clock = chrono::steady_clock;
+
+struct SortJob {
+	size_t id = 0;
+	int clientFd = -1;
+	ESortType sortType = ESortType::AlphabeticalAscending;
+	EInvalidUtf8 invalidUtf8 = EInvalidUtf8::Replace;
+	vector<string> inputPaths;
+	string inlineData;
+	string outputPath;
+	size_t inputBytes = 0;
+	Clock::time_point received;
+};
+
+// The lines and output of the jobs one worker runs. Kept from job to job so that their capacity, and
+// the pages behind it, is reused rather than allocated and faulted in again for every job.
+struct WorkerBuffers {
+	string data;
+	vector<string_view> lines;
+	deque<string> repairedLines;
+	string output;
+	string compressed;
+	vector<string_view> sortedLines;
+};
+
+// Jobs waiting for a worker, oldest first, and the _numThreads hardware threads they run on.
+class JobQueue {
+public:
+	explicit JobQueue(unsigned int _numThreads) : numThreads(max(1u, _numThreads)) {}
+	void Push(SortJob* _job);
+	// Waits for a job and returns it together with the small jobs waiting behind it and those arriving
+	// within BATCH_WINDOW after them, up to this worker's share of them when other workers are idle.
+	// Sets _threadsOut to the threads the batch may use, which Done() gives back. Returns an empty
+	// batch once the queue is stopped and drained.
+	vector<SortJob*> PopBatch(unsigned int& _threadsOut);
+	void Done(unsigned int _threads);
+	void Stop();
+
+private:
+	mutex lock;
+	condition_variable ready;
+	deque<SortJob*> jobs;
+	size_t idleWorkers = 0;		// Workers waiting in PopBatch() for a first job
+	unsigned int numThreads;
+	unsigned int threadsInUse = 0;
+	bool stopped = false;
+};
+
+// Accepted connections waiting for a reader, oldest first.
+class ConnectionQueue {
+public:
+	void Push(int _clientFd);
+	// Waits for a connection and returns its socket, or -1 once the queue is stopped and drained.
+	int Pop();
+	void Stop();
+
+private:
+	mutex lock;
+	condition_variable ready;
+	deque<int> clientFds;
+	bool stopped = false;
+};
+
+// An output stream buffer that writes to a file descriptor it does not own, for the library writers
+// that take an ostream.
+class FileDescriptorBuffer : public streambuf {
+public:
+	explicit FileDescriptorBuffer(int _fd) : fd(_fd), buffer(FILE_BUFFER_SIZE) { setp(buffer.data(), buffer.data() + buffer.size()); }
+
+protected:
+	int overflow(int _c) override;
+	int sync() override;
+
+private:
+	int fd;
+	vector<char> buffer;
+};
+
+// Reads a request from a client socket: text lines and blocks of raw bytes.
+class RequestReader {
+public:
+	explicit RequestReader(int _fd) : fd(_fd), deadline(Clock::now() + REQUEST_TIMEOUT) {}
+	string ReadLine();
+	void ReadBytes(size_t _count, string& _out);
+
+private:
+	void Fill();
+
+	int fd;
+	Clock::time_point deadline;
+	string buffer;
+	size_t position = 0;
+};
+
+// The stop signals write a byte to the write end, which the accepting thread polls next to the socket.
+static int stopPipe[2] = { -1, -1 };
+static mutex reportLock;
+static atomic<size_t> nextJobId(1);
+// Set from the environment before the workers start, see the notes above.
+static bool sortHugePages = false;
+static bool sortPrefetch = true;
+// SORT_ROOT resolved and as given, a descriptor of it, and the directory relative paths start from.
+static string sortRoot;
+static string sortRootGiven;
+static int sortRootFd = -1;
+static string workingDirectory;
+
+static bool IsSmallJob(const SortJob& _job);
+static bool HasExtension(const string& _path, const char* _extension);
+static SortJob* ReadJob(int _clientFd);
+static string ConfinePath(const string& _path);
+static int OpenPath(const string& _path, int _flags);
+static void RunReader(ConnectionQueue& _connections, JobQueue& _queue);
+static void RunWorker(JobQueue& _queue);
+static void RunJob(SortJob& _job, WorkerBuffers& _buffers, unsigned int _numThreads, size_t _batchSize);
+static void AppendFile(const string& _fileName, string& _data, unsigned int _numThreads);
+static int CreateOutputFile(const string& _fileName);
+static bool WriteAll(int _fd, const char* _bytes, size_t _count);
+static void AppendLines(const char* _bytes, size_t _count, string& _data);
+static int CreateListenSocket(const string& _socketPath);
+static void SendAll(int _fd, const char* _bytes, size_t _count);
+static void SendAll(int _fd, const string& _text);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static void OnStopSignal(int) {
+	int savedErrno = errno;
+	char stop = 1;
+	ssize_t written = write(stopPipe[1], &stop, 1);
+	(void)written;
+	errno = savedErrno;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "Usage: SortDaemon <socket path> [worker threads]" << endl;
+		return 1;
+	}
+	string socketPath = argv[1];
+	unsigned int numWorkers = max(1u, thread::hardware_concurrency());
+	if (argc > 2) {
+		numWorkers = (unsigned int)max(1, atoi(argv[2]));
+	}
+	const char* hugePages = getenv("SORT_HUGE_PAGES");
+	sortHugePages = hugePages != nullptr && strcmp(hugePages, "0") != 0;
+	const char* prefetch = getenv("SORT_PREFETCH");
+	sortPrefetch = prefetch == nullptr || strcmp(prefetch, "0") != 0;
+	const char* root = getenv("SORT_ROOT");
+	if (root != nullptr && root[0] != '\0') {
+		char* resolved = realpath(root, nullptr);
+		sortRootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		char* cwd = getcwd(nullptr, 0);
+		if (resolved == nullptr || sortRootFd < 0 || cwd == nullptr) {
+			cerr << "SORT_ROOT is not a directory: " << root << endl;
+			return 1;
+		}
+		sortRoot = resolved;
+		sortRootGiven = root;
+		workingDirectory = cwd;
+		free(resolved);
+		free(cwd);
+	}
+
+	// A signal that lands while the accepting thread is not yet waiting is still seen, the byte it
+	// wrote wakes the next poll()
+	if (pipe2(stopPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+		cerr << "pipe: " << strerror(errno) << endl;
+		return 1;
+	}
+	struct sigaction stopAction = {};
+	stopAction.sa_handler = OnStopSignal;
+	sigemptyset(&stopAction.sa_mask);
+	sigaction(SIGINT, &stopAction, nullptr);
+	sigaction(SIGTERM, &stopAction, nullptr);
+	signal(SIGPIPE, SIG_IGN);
+
+	int listenFd;
+	try {
+		listenFd = CreateListenSocket(socketPath);
+		// Non-blocking, so that a connection that goes away between poll() and accept() does not block
+		fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+	}
+	catch (const exception& e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	// Readers and workers are started with the stop signals blocked, so the signals reach the accepting
+	// thread
+	sigset_t stopSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+	ConnectionQueue connections;
+	JobQueue queue(thread::hardware_concurrency());
+	vector<thread> readers;
+	for (unsigned int i = 0; i < READER_THREADS; ++i) {
+		readers.emplace_back(RunReader, ref(connections), ref(queue));
+	}
+	vector<thread> workers;
+	for (unsigned int i = 0; i < numWorkers; ++i) {
+		workers.emplace_back(RunWorker, ref(queue));
+	}
+	pthread_sigmask(SIG_UNBLOCK, &stopSignals, nullptr);
+
+	cout << "Listening on " << socketPath << " with " << numWorkers << " workers" << endl;
+	pollfd waitFds[2] = { { listenFd, POLLIN, 0 }, { stopPipe[0], POLLIN, 0 } };
+	while (true) {
+		if (poll(waitFds, 2, -1) < 0) {
+			if (errno != EINTR)
+				cerr << "poll: " << strerror(errno) << endl;
+			continue;
+		}
+		if (waitFds[1].revents != 0)
+			break;
+		if (waitFds[0].revents == 0)
+			continue;
+		int clientFd = accept(listenFd, nullptr, nullptr);
+		if (clientFd < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+				cerr << "accept: " << strerror(errno) << endl;
+			continue;
+		}
+		connections.Push(clientFd);
+	}
+
+	connections.Stop();
+	for (auto& reader : readers) {
+		reader.join();
+	}
+	queue.Stop();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	close(listenFd);
+	unlink(socketPath.c_str());
+
+	cout << endl << "Finished..." << endl;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The Stuff
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static bool IsSmallJob(const SortJob& _job) {
+	return _job.inputBytes < SMALL_JOB_BYTES;
+}
+
+static bool HasExtension(const string& _path, const char* _extension) {
+	size_t length = strlen(_extension);
+	return _path.size() >= length && _path.compare(_path.size() - length, length, _extension) == 0;
+}
+
+void ConnectionQueue::Push(int _clientFd) {
+	{
+		lock_guard<mutex> guard(lock);
+		clientFds.push_back(_clientFd);
+	}
+	ready.notify_one();
+}
+
+int ConnectionQueue::Pop() {
+	unique_lock<mutex> guard(lock);
+	ready.wait(guard, [this] { return stopped || !clientFds.empty(); });
+	if (clientFds.empty())
+		return -1;
+	int clientFd = clientFds.front();
+	clientFds.pop_front();
+	return clientFd;
+}
+
+void ConnectionQueue::Stop() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopped = true;
+	}
+	ready.notify_all();
+}
+
+void JobQueue::Push(SortJob* _job) {
+	{
+		lock_guard<mutex> guard(lock);
+		jobs.push_back(_job);
+	}
+	ready.notify_one();
+}
+
+vector<SortJob*> JobQueue::PopBatch(unsigned int& _threadsOut) {
+	unique_lock<mutex> guard(lock);
+	++idleWorkers;
+	ready.wait(guard, [this] { return stopped || !jobs.empty(); });
+	--idleWorkers;
+
+	vector<SortJob*> batch;
+	_threadsOut = 0;
+	if (jobs.empty())
+		return batch;
+	batch.push_back(jobs.front());
+	jobs.pop_front();
+
+	// A large job runs on its own, with the free threads shared evenly between it and the waiting jobs
+	// that idle workers will take. A batch of small jobs takes one thread.
+	if (!IsSmallJob(*batch[0])) {
+		unsigned int freeThreads = threadsInUse < numThreads ? numThreads - threadsInUse : 0;
+		size_t sharingJobs = 1 + min(jobs.size(), idleWorkers);
+		_threadsOut = max(1u, (unsigned int)(freeThreads / sharingJobs));
+		threadsInUse += _threadsOut;
+		return batch;
+	}
+	_threadsOut = 1;
+	++threadsInUse;
+
+	// Small jobs that come in together share one wake-up and one worker's warm buffers. A job that
+	// arrives at an idle daemon does not wait for company, only a burst already under way does.
+	if (jobs.empty())
+		return batch;
+	Clock::time_point deadline = Clock::now() + BATCH_WINDOW;
+	while (batch.size() < BATCH_MAX_JOBS) {
+		if (!jobs.empty()) {
+			// The jobs in hand and waiting, split evenly with the idle workers and rounded up
+			size_t share = (batch.size() + jobs.size() + idleWorkers) / (idleWorkers + 1);
+			if (!IsSmallJob(*jobs.front()) || batch.size() >= share)
+				break;
+			batch.push_back(jobs.front());
+			jobs.pop_front();
+			continue;
+		}
+		if (stopped || ready.wait_until(guard, deadline) == cv_status::timeout)
+			break;
+	}
+	// The wake-up for the jobs left behind may have gone to this worker
+	if (!jobs.empty())
+		ready.notify_all();
+	return batch;
+}
+
+void JobQueue::Done(unsigned int _threads) {
+	lock_guard<mutex> guard(lock);
+	threadsInUse -= _threads;
+}
+
+void JobQueue::Stop() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopped = true;
+	}
+	ready.notify_all();
+}
+
+static void RunReader(ConnectionQueue& _connections, JobQueue& _queue) {
+	while (true) {
+		int clientFd = _connections.Pop();
+		if (clientFd < 0)
+			return;
+
+		timeval timeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+		setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		try {
+			SortJob* job = ReadJob(clientFd);
+			job->id = nextJobId++;
+			job->received = Clock::now();
+			_queue.Push(job);
+		}
+		catch (const exception& e) {
+			SendAll(clientFd, string("ERROR ") + e.what() + "\n");
+			close(clientFd);
+		}
+	}
+}
+
+static void RunWorker(JobQueue& _queue) {
+	WorkerBuffers buffers;
+	while (true) {
+		unsigned int numThreads;
+		vector<SortJob*> batch = _queue.PopBatch(numThreads);
+		if (batch.empty())
+			return;
+
+		// Batched jobs run one after the other on this thread
+		for (SortJob* job : batch) {
+			RunJob(*job, buffers, numThreads, batch.size());
+			delete job;
+		}
+		_queue.Done(numThreads);
+	}
+}
+
+static void RunJob(SortJob& _job, WorkerBuffers& _buffers, unsigned int _numThreads, size_t _batchSize) {
+	Clock::time_point started = Clock::now();
+	string error;
+	size_t lineCount = 0;
+	try {
+		_buffers.data.clear();
+		for (const string& inputPath : _job.inputPaths) {
+			AppendFile(inputPath, _buffers.data, _numThreads);
+		}
+		AppendLines(_job.inlineData.data(), _job.inlineData.size(), _buffers.data);
+		_buffers.lines.clear();
+		_buffers.repairedLines.clear();
+		SplitTextLines(_buffers.data.data(), _buffers.data.size(), _job.invalidUtf8, _buffers.lines, _buffers.repairedLines);
+
+		SortConfig config;
+		config.sortType = _job.sortType;
+		config.numThreads = _numThreads;
+		config.hugePages = sortHugePages;
+		config.prefetch = sortPrefetch;
+		vector<size_t> order = SortLineOrder(_buffers.lines.data(), _buffers.lines.size(), config);
+
+		lineCount = order.size();
+
+		// Sorted tables and front coded files are written from the lines themselves, not the text
+		bool sortedTable = HasExtension(_job.outputPath, ".sst");
+		bool frontCoded = HasExtension(_job.outputPath, ".fc");
+		if (sortedTable || frontCoded) {
+			if (sortedTable && _job.sortType != ESortType::AlphabeticalAscending)
+				throw runtime_error("A .sst output needs SORT AlphabeticalAscending");
+			_buffers.sortedLines.clear();
+			for (size_t i : order) {
+				_buffers.sortedLines.push_back(_buffers.lines[i]);
+			}
+			int fd = CreateOutputFile(_job.outputPath);
+			try {
+				FileDescriptorBuffer fileBuffer(fd);
+				ostream fileOut(&fileBuffer);
+				if (sortedTable)
+					WriteSortedTable(fileOut, _buffers.sortedLines.data(), _buffers.sortedLines.size());
+				else
+					WriteFrontCoded(fileOut, _buffers.sortedLines.data(), _buffers.sortedLines.size());
+				if (!fileOut.flush())
+					throw runtime_error("Cannot write " + _job.outputPath + ": " + strerror(errno));
+			}
+			catch (...) {
+				close(fd);
+				throw;
+			}
+			close(fd);
+		}
+		else {
+			_buffers.output.clear();
+			for (size_t i : order) {
+				_buffers.output.append(_buffers.lines[i]);
+				_buffers.output.push_back('\n');
+			}
+		}
+
+		if (_job.outputPath != "-" && !sortedTable && !frontCoded) {
+			ECompression compression = GetCompressionForPath(_job.outputPath);
+			if (compression != ECompression::None) {
+				_buffers.compressed.clear();
+				CompressBlocks(_buffers.output.data(), _buffers.output.size(), compression, _buffers.compressed, _numThreads);
+			}
+			const string& fileData = compression != ECompression::None ? _buffers.compressed : _buffers.output;
+			int fd = CreateOutputFile(_job.outputPath);
+			bool written = WriteAll(fd, fileData.data(), fileData.size());
+			int writeError = errno;
+			close(fd);
+			if (!written)
+				throw runtime_error("Cannot write " + _job.outputPath + ": " + strerror(writeError));
+		}
+	}
+	catch (const exception& e) {
+		error = e.what();
+	}
+	Clock::time_point finished = Clock::now();
+
+	long long queuedMicros = chrono::duration_cast<chrono::microseconds>(started - _job.received).count();
+	long long runMicros = chrono::duration_cast<chrono::microseconds>(finished - started).count();
+	if (error.empty()) {
+		SendAll(_job.clientFd, "OK " + to_string(lineCount) + " " + to_string(queuedMicros) + " " + to_string(runMicros) + " " + to_string(queuedMicros + runMicros) + "\n");
+		if (_job.outputPath == "-") {
+			SendAll(_job.clientFd, "DATA " + to_string(_buffers.output.size()) + "\n");
+			SendAll(_job.clientFd, _buffers.output.data(), _buffers.output.size());
+		}
+	}
+	else {
+		SendAll(_job.clientFd, "ERROR " + error + "\n");
+	}
+	close(_job.clientFd);
+
+	lock_guard<mutex> guard(reportLock);
+	cout << "Job " << _job.id << "\t- " << GetSortTypeName(_job.sortType) << "\t- Lines: " << lineCount << "\t- Batch: " << _batchSize
+		<< "\t- Queued: " << queuedMicros << "us\t- Run: " << runMicros << "us\t- Total: " << queuedMicros + runMicros << "us";
+	if (!error.empty())
+		cout << "\t- Error: " << error;
+	cout << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Requests
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void RequestReader::Fill() {
+	if (position > 0) {
+		buffer.erase(0, position);
+		position = 0;
+	}
+	char chunk[64 * 1024];
+	ssize_t received;
+	do {
+		received = recv(fd, chunk, sizeof(chunk), 0);
+	} while (received < 0 && errno == EINTR);
+	if (received < 0)
+		throw runtime_error(string("Cannot read request: ") + strerror(errno));
+	if (received == 0)
+		throw runtime_error("Request ended before END");
+	if (Clock::now() > deadline)
+		throw runtime_error("Request took too long");
+	buffer.append(chunk, (size_t)received);
+}
+
+string RequestReader::ReadLine() {
+	while (true) {
+		size_t end = buffer.find('\n', position);
+		if (end != string::npos) {
+			string line = buffer.substr(position, end - position);
+			position = end + 1;
+			return line;
+		}
+		if (buffer.size() - position > MAX_REQUEST_LINE)
+			throw runtime_error("Request line too long");
+		Fill();
+	}
+}
+
+void RequestReader::ReadBytes(size_t _count, string& _out) {
+	while (_count > 0) {
+		if (position == buffer.size())
+			Fill();
+		size_t taken = min(_count, buffer.size() - position);
+		_out.append(buffer, position, taken);
+		position += taken;
+		_count -= taken;
+	}
+}
+
+static SortJob* ReadJob(int _clientFd) {
+	unique_ptr<SortJob> job(new SortJob());
+	job->clientFd = _clientFd;
+	RequestReader reader(_clientFd);
+	bool hasSortType = false;
+	while (true) {
+		string line = reader.ReadLine();
+		size_t space = line.find(' ');
+		string command = line.substr(0, space);
+		string argument = space == string::npos ? string() : line.substr(space + 1);
+
+		if (command == "SORT") {
+			job->sortType = ParseSortType(argument);
+			hasSortType = true;
+		}
+		else if (command == "INPUT") {
+			// Only sized here, the job opens it again when it runs
+			string inputPath = ConfinePath(argument);
+			int fd = OpenPath(inputPath, O_RDONLY);
+			struct stat status;
+			if (fd >= 0 && fstat(fd, &status) == 0)
+				job->inputBytes += (size_t)status.st_size;
+			if (fd >= 0)
+				close(fd);
+			job->inputPaths.push_back(inputPath);
+		}
+		else if (command == "DATA") {
+			char* end = nullptr;
+			errno = 0;
+			unsigned long long count = strtoull(argument.c_str(), &end, 10);
+			if (argument.empty() || *end != '\0' || errno != 0)
+				throw runtime_error("Bad DATA byte count " + argument);
+			if (count > MAX_DATA_BYTES - job->inlineData.size())
+				throw runtime_error("DATA over the limit of " + to_string(MAX_DATA_BYTES) + " bytes per request");
+			reader.ReadBytes((size_t)count, job->inlineData);
+		}
+		else if (command == "UTF8") {
+			job->invalidUtf8 = ParseInvalidUtf8(argument);
+		}
+		else if (command == "OUTPUT") {
+			job->outputPath = argument == "-" ? argument : ConfinePath(argument);
+		}
+		else if (command == "END") {
+			break;
+		}
+		else {
+			throw runtime_error("Unknown command " + command);
+		}
+	}
+
+	if (!hasSortType)
+		throw runtime_error("Missing SORT");
+	if (job->outputPath.empty())
+		throw runtime_error("Missing OUTPUT");
+	job->inputBytes += job->inlineData.size();
+	return job.release();
+}
+
+// Returns the path to use for _path, an INPUT or OUTPUT of a request: _path itself without SORT_ROOT,
+// otherwise _path relative to SORT_ROOT, for OpenPath(). _path may name the root as it was given or
+// resolved, or be relative to the working directory. Throws if it is not inside the root or goes up
+// with "..". Only the names are checked here, OpenPath() makes sure they do not lead elsewhere.
+static string ConfinePath(const string& _path) {
+	if (sortRootFd < 0)
+		return _path;
+	string absolute = !_path.empty() && _path[0] == '/' ? _path : workingDirectory + "/" + _path;
+	string relative;
+	bool inside = false;
+	for (const string& root : { sortRoot, sortRootGiven }) {
+		string rootPrefix = root.back() == '/' ? root : root + "/";
+		if (absolute.compare(0, rootPrefix.size(), rootPrefix) == 0) {
+			relative = absolute.substr(rootPrefix.size());
+			inside = true;
+			break;
+		}
+	}
+
+	string confined;
+	size_t start = 0;
+	while (inside && start <= relative.size()) {
+		size_t slash = min(relative.find('/', start), relative.size());
+		string name = relative.substr(start, slash - start);
+		start = slash + 1;
+		if (name.empty() || name == ".")
+			continue;
+		if (name == "..")
+			inside = false;
+		confined += (confined.empty() ? "" : "/") + name;
+	}
+	if (!inside || confined.empty())
+		throw runtime_error("Path outside SORT_ROOT: " + _path);
+	return confined;
+}
+
+// Opens _path, as returned by ConfinePath(), with _flags; returns -1 and sets errno if it cannot.
+// Under SORT_ROOT the path is opened one directory at a time from the root's descriptor, each with
+// O_NOFOLLOW, so no symbolic link is followed on the way and the file found is inside the root
+// whatever has changed since the path was checked.
+static int OpenPath(const string& _path, int _flags) {
+	if (sortRootFd < 0)
+		return open(_path.c_str(), _flags | O_CLOEXEC, 0666);
+	int directoryFd = sortRootFd;
+	size_t start = 0;
+	int fd = -1;
+	while (true) {
+		size_t slash = _path.find('/', start);
+		string name = _path.substr(start, slash == string::npos ? string::npos : slash - start);
+		fd = openat(directoryFd, name.c_str(), (slash == string::npos ? _flags | O_NOFOLLOW | O_CLOEXEC : DIRECTORY_OPEN_FLAGS), 0666);
+		int openError = errno;
+		if (directoryFd != sortRootFd)
+			close(directoryFd);
+		errno = openError;
+		if (fd < 0 || slash == string::npos)
+			return fd;
+		directoryFd = fd;
+		start = slash + 1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// File Processing
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Appends the whole file to _data, decompressed if it is zstd or lz4, see AppendLines.
+static void AppendFile(const string& _fileName, string& _data, unsigned int _numThreads) {
+	int fd = OpenPath(_fileName, O_RDONLY);
+	if (fd < 0)
+		throw runtime_error("Cannot open " + _fileName + ": " + strerror(errno));
+	struct stat status;
+	if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+		close(fd);
+		throw runtime_error("Not a file: " + _fileName);
+	}
+
+	size_t start = _data.size();
+	_data.resize(start + (size_t)status.st_size);
+	size_t filled = start;
+	while (filled < _data.size()) {
+		ssize_t got = read(fd, &_data[filled], _data.size() - filled);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0) {
+			string error = strerror(errno);
+			close(fd);
+			throw runtime_error("Cannot read " + _fileName + ": " + error);
+		}
+		if (got == 0)
+			break;
+		filled += (size_t)got;
+	}
+	close(fd);
+	_data.resize(filled);
+
+	ECompression compression = DetectCompression(_data.data() + start, _data.size() - start);
+	if (compression != ECompression::None) {
+		string compressed(_data, start);
+		_data.resize(start);
+		DecompressFrames(compressed.data(), compressed.size(), compression, _data, _numThreads);
+	}
+	if (_data.size() > start && _data.back() != '\n')
+		_data.push_back('\n');
+}
+
+// Creates or truncates _fileName, an output path from ConfinePath(), for writing. Throws if it cannot.
+static int CreateOutputFile(const string& _fileName) {
+	int fd = OpenPath(_fileName, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0)
+		throw runtime_error("Cannot write " + _fileName + ": " + strerror(errno));
+	return fd;
+}
+
+// Writes everything to a file. Returns false with errno set if it cannot.
+static bool WriteAll(int _fd, const char* _bytes, size_t _count) {
+	while (_count > 0) {
+		ssize_t written = write(_fd, _bytes, _count);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			return false;
+		_bytes += written;
+		_count -= (size_t)written;
+	}
+	return true;
+}
+
+int FileDescriptorBuffer::overflow(int _c) {
+	if (sync() != 0)
+		return traits_type::eof();
+	if (_c != traits_type::eof()) {
+		*pptr() = (char)_c;
+		pbump(1);
+	}
+	return traits_type::not_eof(_c);
+}
+
+int FileDescriptorBuffer::sync() {
+	if (!WriteAll(fd, pbase(), (size_t)(pptr() - pbase())))
+		return -1;
+	setp(buffer.data(), buffer.data() + buffer.size());
+	return 0;
+}
+
+// Appends the lines in _bytes to _data and ends them with a line break if they do not have one, so
+// that the last line of one input is not joined to the first line of the next.
+static void AppendLines(const char* _bytes, size_t _count, string& _data) {
+	_data.append(_bytes, _count);
+	if (_count > 0 && _bytes[_count - 1] != '\n')
+		_data.push_back('\n');
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sockets
+////////////////////////////////////////////////////////////////////////////////////////////////////
+static int CreateListenSocket(const string& _socketPath) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (_socketPath.size() >= sizeof(address.sun_path))
+		throw runtime_error("Socket path too long: " + _socketPath);
+	memcpy(address.sun_path, _socketPath.c_str(), _socketPath.size() + 1);
+
+	// A socket left behind by a daemon that did not shut down cleanly is replaced, anything else is not
+	struct stat status;
+	if (stat(_socketPath.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+		unlink(_socketPath.c_str());
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0)
+		throw runtime_error(string("socket: ") + strerror(errno));
+	if (::bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, LISTEN_BACKLOG) != 0) {
+		string error = strerror(errno);
+		close(listenFd);
+		throw runtime_error("Cannot listen on " + _socketPath + ": " + error);
+	}
+	return listenFd;
+}
+
+// Sends everything, or gives up quietly if the client has gone away.
+static void SendAll(int _fd, const char* _bytes, size_t _count) {
+	while (_count > 0) {
+		ssize_t sent = send(_fd, _bytes, _count, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return;
+		_bytes += sent;
+		_count -= (size_t)sent;
+	}
+}
+
+static void SendAll(int _fd, const string& _text) {
+	SendAll(_fd, _text.data(), _text.size());
+}
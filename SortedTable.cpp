@@ -0,0 +1,328 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "SortedTable.h"
+#include "Crc32.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char SORTED_TABLE_MAGIC[8] = { 'S', 'O', 'R', 'T', 'T', 'B', 'L', '\0' };
+const uint32_t SORTED_TABLE_VERSION = 1;
+const size_t SORTED_TABLE_FOOTER_SIZE = 4 * 8 + 4 * 4 + sizeof(SORTED_TABLE_MAGIC);
+const size_t SORTED_TABLE_INDEX_ENTRY_SIZE = 8 + 4 * 4;
+const uint32_t SORTED_TABLE_FLAG_CHECKSUMS = 1;
+// A block must at least hold its line count and one line length.
+const size_t SORTED_TABLE_MIN_BLOCK_SIZE = 64;
+
+static void AppendLittleEndian(string& _out, uint64_t _value, size_t _bytes) {
+	for (size_t i = 0; i < _bytes; ++i) {
+		_out.push_back((char)(_value >> (8 * i)));
+	}
+}
+
+static uint64_t ReadLittleEndian(const char* _bytes, size_t _count) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < _count; ++i) {
+		value |= (uint64_t)(unsigned char)_bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+static void ThrowCorrupt(const string& _what) {
+	throw runtime_error("Corrupt sorted table: " + _what);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writing
+////////////////////////////////////////////////////////////////////////////////////////////////////
+void WriteSortedTable(ostream& _out, const string_view* _lines, size_t _count, const SortedTableOptions& _options) {
+	size_t blockSize = max(_options.blockSize, SORTED_TABLE_MIN_BLOCK_SIZE);
+	if (blockSize > UINT32_MAX)
+		throw runtime_error("Sorted table blocks must be smaller than 4 GiB");
+	for (size_t i = 1; i < _count; ++i) {
+		if (_lines[i] < _lines[i - 1])
+			throw runtime_error("Sorted table lines must be in ascending byte order");
+	}
+
+	string block;
+	string index;
+	uint64_t offset = 0;
+	uint64_t blockCount = 0;
+	size_t line = 0;
+	while (line < _count) {
+		// Fill the block with as many lines as fit, or the one line that does not fit in any block
+		size_t firstLine = line;
+		block.assign(4, '\0');
+		while (line < _count && (line == firstLine || block.size() + 4 + _lines[line].size() <= blockSize)) {
+			if (_lines[line].size() > UINT32_MAX - 8)
+				throw runtime_error("Sorted table lines must be shorter than 4 GiB");
+			AppendLittleEndian(block, _lines[line].size(), 4);
+			block.append(_lines[line]);
+			++line;
+		}
+		uint32_t blockLines = (uint32_t)(line - firstLine);
+		for (size_t i = 0; i < 4; ++i) {
+			block[i] = (char)(blockLines >> (8 * i));
+		}
+		size_t paddedSize = (block.size() + blockSize - 1) / blockSize * blockSize;
+		if (paddedSize > UINT32_MAX)
+			throw runtime_error("Sorted table lines must be shorter than 4 GiB");
+		block.resize(paddedSize, '\0');
+
+		AppendLittleEndian(index, offset, 8);
+		AppendLittleEndian(index, block.size(), 4);
+		AppendLittleEndian(index, blockLines, 4);
+		AppendLittleEndian(index, _options.checksums ? Crc32(block.data(), block.size()) : 0, 4);
+		AppendLittleEndian(index, _lines[firstLine].size(), 4);
+		index.append(_lines[firstLine]);
+
+		_out.write(block.data(), block.size());
+		offset += block.size();
+		++blockCount;
+	}
+
+	string footer;
+	AppendLittleEndian(footer, offset, 8);
+	AppendLittleEndian(footer, index.size(), 8);
+	AppendLittleEndian(footer, _count, 8);
+	AppendLittleEndian(footer, blockCount, 8);
+	AppendLittleEndian(footer, blockSize, 4);
+	AppendLittleEndian(footer, _options.checksums ? SORTED_TABLE_FLAG_CHECKSUMS : 0, 4);
+	AppendLittleEndian(footer, _options.checksums ? Crc32(index.data(), index.size()) : 0, 4);
+	AppendLittleEndian(footer, SORTED_TABLE_VERSION, 4);
+	footer.append(SORTED_TABLE_MAGIC, sizeof(SORTED_TABLE_MAGIC));
+
+	_out.write(index.data(), index.size());
+	_out.write(footer.data(), footer.size());
+	if (!_out)
+		throw runtime_error("Cannot write sorted table");
+}
+
+void WriteSortedTable(const string& _fileName, const string_view* _lines, size_t _count, const SortedTableOptions& _options) {
+	ofstream fileOut(_fileName, ofstream::binary | ofstream::trunc);
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _fileName);
+	WriteSortedTable(fileOut, _lines, _count, _options);
+	fileOut.close();
+	if (!fileOut)
+		throw runtime_error("Cannot write " + _fileName);
+}
+
+void WriteSortedTable(const string& _fileName, const vector<string>& _lines, const SortedTableOptions& _options) {
+	vector<string_view> views(_lines.begin(), _lines.end());
+	WriteSortedTable(_fileName, views.data(), views.size(), _options);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lookups
+////////////////////////////////////////////////////////////////////////////////////////////////////
+SortedTable::SortedTable(const string& _fileName) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(_fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw runtime_error("Cannot open " + _fileName);
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	size = (size_t)fileSize.QuadPart;
+	if (size > 0) {
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		data = mapping != nullptr ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	}
+	CloseHandle(file);
+	if (size > 0 && data == nullptr) {
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		throw runtime_error("Cannot map " + _fileName);
+	}
+#else
+	int file = open(_fileName.c_str(), O_RDONLY);
+	if (file < 0)
+		throw runtime_error("Cannot open " + _fileName);
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0) {
+		close(file);
+		throw runtime_error("Cannot open " + _fileName);
+	}
+	size = (size_t)fileStat.st_size;
+	if (size > 0) {
+		void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+		data = mapped != MAP_FAILED ? (const char*)mapped : nullptr;
+	}
+	close(file);
+	if (size > 0 && data == nullptr)
+		throw runtime_error("Cannot map " + _fileName);
+#endif
+
+	// The index is read once here; the blocks are only touched by lookups
+	try {
+		if (size < SORTED_TABLE_FOOTER_SIZE || memcmp(data + size - sizeof(SORTED_TABLE_MAGIC), SORTED_TABLE_MAGIC, sizeof(SORTED_TABLE_MAGIC)) != 0)
+			throw runtime_error(_fileName + " is not a sorted table");
+		const char* footer = data + size - SORTED_TABLE_FOOTER_SIZE;
+		uint64_t indexOffset = ReadLittleEndian(footer, 8);
+		uint64_t indexSize = ReadLittleEndian(footer + 8, 8);
+		lineCount = (size_t)ReadLittleEndian(footer + 16, 8);
+		uint64_t blockCount = ReadLittleEndian(footer + 24, 8);
+		uint32_t blockSize = (uint32_t)ReadLittleEndian(footer + 32, 4);
+		uint32_t flags = (uint32_t)ReadLittleEndian(footer + 36, 4);
+		checksums = (flags & SORTED_TABLE_FLAG_CHECKSUMS) != 0;
+		uint32_t indexChecksum = (uint32_t)ReadLittleEndian(footer + 40, 4);
+		if (ReadLittleEndian(footer + 44, 4) != SORTED_TABLE_VERSION)
+			throw runtime_error(_fileName + " has an unsupported sorted table version");
+
+		// The footer has no checksum of its own, so every field is checked against what it implies: the
+		// CRC-32 fields are zero without checksums, and the blocks fill whole multiples of the block size
+		// from the start of the file up to the index
+		size_t footerOffset = size - SORTED_TABLE_FOOTER_SIZE;
+		if (indexOffset > footerOffset || indexSize != footerOffset - indexOffset || blockCount > indexSize / SORTED_TABLE_INDEX_ENTRY_SIZE
+			|| blockSize < SORTED_TABLE_MIN_BLOCK_SIZE || (flags & ~SORTED_TABLE_FLAG_CHECKSUMS) != 0 || (!checksums && indexChecksum != 0))
+			ThrowCorrupt("bad footer");
+		const char* index = data + indexOffset;
+		if (checksums && Crc32(index, (size_t)indexSize) != indexChecksum)
+			ThrowCorrupt("index checksum mismatch");
+
+		blocks.reserve((size_t)blockCount);
+		uint64_t blockOffset = 0;
+		size_t position = 0;
+		uint64_t linesInBlocks = 0;
+		for (uint64_t i = 0; i < blockCount; ++i) {
+			if (indexSize - position < SORTED_TABLE_INDEX_ENTRY_SIZE)
+				ThrowCorrupt("truncated index");
+			Block block;
+			block.offset = ReadLittleEndian(index + position, 8);
+			block.size = (uint32_t)ReadLittleEndian(index + position + 8, 4);
+			block.lineCount = (uint32_t)ReadLittleEndian(index + position + 12, 4);
+			block.checksum = (uint32_t)ReadLittleEndian(index + position + 16, 4);
+			size_t firstLineSize = (size_t)ReadLittleEndian(index + position + 20, 4);
+			position += SORTED_TABLE_INDEX_ENTRY_SIZE;
+			if (indexSize - position < firstLineSize)
+				ThrowCorrupt("truncated index");
+			block.firstLine = string_view(index + position, firstLineSize);
+			position += firstLineSize;
+
+			if (block.offset != blockOffset || block.size > indexOffset - block.offset || block.size == 0 || block.size % blockSize != 0
+				|| block.lineCount == 0 || (!checksums && block.checksum != 0))
+				ThrowCorrupt("bad block entry");
+			blockOffset += block.size;
+			linesInBlocks += block.lineCount;
+			blocks.push_back(block);
+		}
+		if (position != indexSize || blockOffset != indexOffset || linesInBlocks != lineCount)
+			ThrowCorrupt("index does not match the footer");
+	}
+	catch (...) {
+		Unmap();
+		throw;
+	}
+}
+
+SortedTable::~SortedTable() {
+	Unmap();
+}
+
+void SortedTable::Unmap() {
+	if (data == nullptr)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+#else
+	munmap((void*)data, size);
+#endif
+	data = nullptr;
+}
+
+bool SortedTable::Contains(string_view _line) const {
+	bool found = false;
+	ScanFrom(_line, [&](string_view _tableLine) {
+		found = _tableLine == _line;
+		return false;
+	});
+	return found;
+}
+
+vector<string_view> SortedTable::Find(string_view _line) const {
+	vector<string_view> linesOut;
+	ScanFrom(_line, [&](string_view _tableLine) {
+		if (_tableLine != _line)
+			return false;
+		linesOut.push_back(_tableLine);
+		return true;
+	});
+	return linesOut;
+}
+
+vector<string_view> SortedTable::FindPrefix(string_view _prefix) const {
+	// Lines that start with _prefix sort together, right from the first line not below it
+	vector<string_view> linesOut;
+	ScanFrom(_prefix, [&](string_view _tableLine) {
+		if (_tableLine.compare(0, _prefix.size(), _prefix) != 0)
+			return false;
+		linesOut.push_back(_tableLine);
+		return true;
+	});
+	return linesOut;
+}
+
+template <typename TLineVisitor>
+void SortedTable::ScanFrom(string_view _from, TLineVisitor _visitLine) const {
+	// The last block that starts below _from: its later lines, or those of the blocks after it, may
+	// equal _from. If every block starts at or above it, the first block holds the first match.
+	auto firstNotBelow = lower_bound(blocks.begin(), blocks.end(), _from, [](const Block& _block, string_view _line) {
+		return _block.firstLine < _line;
+	});
+	size_t block = firstNotBelow == blocks.begin() ? 0 : (size_t)(firstNotBelow - blocks.begin()) - 1;
+
+	bool started = false;
+	for (; block < blocks.size(); ++block) {
+		const char* blockData = ReadBlock(block);
+		const char* blockEnd = blockData + blocks[block].size;
+		const char* position = blockData + 4;
+		for (uint32_t i = 0; i < blocks[block].lineCount; ++i) {
+			if (blockEnd - position < 4)
+				ThrowCorrupt("truncated block");
+			size_t lineSize = (size_t)ReadLittleEndian(position, 4);
+			position += 4;
+			if ((size_t)(blockEnd - position) < lineSize)
+				ThrowCorrupt("truncated block");
+			string_view line(position, lineSize);
+			position += lineSize;
+
+			if (!started && line < _from)
+				continue;
+			started = true;
+			if (!_visitLine(line))
+				return;
+		}
+	}
+}
+
+const char* SortedTable::ReadBlock(size_t _block) const {
+	const Block& block = blocks[_block];
+	const char* blockData = data + block.offset;
+	if (checksums && Crc32(blockData, block.size) != block.checksum)
+		ThrowCorrupt("block " + to_string(_block) + " checksum mismatch");
+	if (block.size < 4 || ReadLittleEndian(blockData, 4) != block.lineCount)
+		ThrowCorrupt("block " + to_string(_block) + " line count mismatch");
+	return blockData;
+}
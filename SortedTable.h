@@ -0,0 +1,82 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorted Table
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// A binary file of lines in ascending byte order that can be searched without reading all of it.
+// The lines are packed into data blocks of a fixed size, followed by a sparse index holding the first
+// line of every block and a fixed size footer that locates the index:
+//
+//	block		uint32 line count, then per line a uint32 length and its bytes, zero padded to the
+//				block size (a line longer than a block gets a block of whole multiples of it)
+//	index		per block: uint64 offset, uint32 size, uint32 line count, uint32 CRC-32, uint32 first
+//				line length and the first line
+//	footer		uint64 index offset, uint64 index size, uint64 line count, uint64 block count, uint32
+//				block size, uint32 flags, uint32 index CRC-32, uint32 version, "SORTTBL\0"
+//
+// All integers are little endian. With checksums off the CRC-32 fields are zero and not checked.
+//
+// SortedTable maps the file and keeps only the index in memory; a lookup binary searches the index
+// and then scans a single block, or the run of blocks its matches span.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct SortedTableOptions {
+	size_t blockSize = 64 * 1024;
+	bool checksums = true;
+};
+
+// Writes _lines to _out as a sorted table. Throws if the lines are not in ascending byte order
+// (AlphabeticalAscending) or _out fails.
+void WriteSortedTable(std::ostream& _out, const std::string_view* _lines, size_t _count, const SortedTableOptions& _options = SortedTableOptions());
+// Writes _lines to _fileName as a sorted table. Throws like the above or if the file cannot be written.
+void WriteSortedTable(const std::string& _fileName, const std::string_view* _lines, size_t _count, const SortedTableOptions& _options = SortedTableOptions());
+void WriteSortedTable(const std::string& _fileName, const std::vector<std::string>& _lines, const SortedTableOptions& _options = SortedTableOptions());
+
+// A sorted table opened for lookups. The views it returns point into the mapped file and stay valid
+// as long as the table. Throws if the file is missing, truncated or fails a checksum.
+class SortedTable {
+public:
+	explicit SortedTable(const std::string& _fileName);
+	~SortedTable();
+	SortedTable(const SortedTable&) = delete;
+	SortedTable& operator=(const SortedTable&) = delete;
+
+	size_t GetLineCount() const { return lineCount; }
+	size_t GetBlockCount() const { return blocks.size(); }
+
+	bool Contains(std::string_view _line) const;
+	// Every copy of _line, in table order.
+	std::vector<std::string_view> Find(std::string_view _line) const;
+	// The lines starting with _prefix, in table order. An empty prefix returns every line.
+	std::vector<std::string_view> FindPrefix(std::string_view _prefix) const;
+
+private:
+	struct Block {
+		uint64_t offset;
+		uint32_t size;
+		uint32_t lineCount;
+		uint32_t checksum;
+		std::string_view firstLine;
+	};
+
+	// Calls _visitLine on the lines from the first one not below _from, for as long as it returns true.
+	template <typename TLineVisitor>
+	void ScanFrom(std::string_view _from, TLineVisitor _visitLine) const;
+	const char* ReadBlock(size_t _block) const;
+	void Unmap();
+
+	const char* data = nullptr;
+	size_t size = 0;
+	void* mapping = nullptr;
+	bool checksums = false;
+	size_t lineCount = 0;
+	std::vector<Block> blocks;
+};
@@ -0,0 +1,167 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorted Table Test
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Notes
+//	* Run by ctest. Writes sorted tables with small blocks, so that lookups cross many block
+//	  boundaries, and checks every lookup against a scan of the lines written. Then cuts the file
+//	  short at every length and flips a bit in every byte, and checks that opening and reading the
+//	  whole table throws.
+//	* Prints what failed and returns 1, or returns 0.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#include "SortedTable.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include <exception>
+#include <cstdio>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const char* TEST_TABLE_NAME = "SortedTableTest.sst";
+const char* CORRUPT_TABLE_NAME = "SortedTableTest.corrupt.sst";
+// The smallest block the writer allows, a handful of the test lines each.
+const size_t TEST_BLOCK_SIZE = 64;
+
+static int failures = 0;
+
+vector<string> MakeLines();
+void TestRoundTrip(const vector<string>& _lines, const SortedTableOptions& _options);
+void TestCorruption(const vector<string>& _lines);
+void Check(bool _passed, const string& _what);
+bool Throws(function<void()> _run);
+string ReadBytes(const string& _fileName);
+void WriteBytes(const string& _fileName, const string& _bytes);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////////////////////////
+int main() {
+	vector<string> lines = MakeLines();
+	SortedTableOptions options;
+	options.blockSize = TEST_BLOCK_SIZE;
+	TestRoundTrip(lines, options);
+	options.checksums = false;
+	TestRoundTrip(lines, options);
+	TestRoundTrip(vector<string>(), SortedTableOptions());
+	TestRoundTrip(vector<string>(1, string()), SortedTableOptions());
+	TestCorruption(lines);
+
+	remove(TEST_TABLE_NAME);
+	remove(CORRUPT_TABLE_NAME);
+	if (failures > 0) {
+		cout << failures << " checks failed" << endl;
+		return 1;
+	}
+	cout << "Passed" << endl;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The Stuff
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lines in ascending byte order with shared prefixes, an empty line, runs of copies long enough to
+// span blocks and a line longer than a block.
+vector<string> MakeLines() {
+	vector<string> lines;
+	lines.push_back(string());
+	for (char group = 'a'; group <= 'e'; ++group) {
+		for (int i = 0; i < 40; ++i) {
+			char number[8];
+			snprintf(number, sizeof(number), "%03d", i);
+			string line = string(1, group) + "/" + number;
+			lines.insert(lines.end(), i % 13 == 0 ? 12 : 1, line);
+			if (i == 20)
+				lines.push_back(line + string(3 * TEST_BLOCK_SIZE, 'z'));
+		}
+	}
+	return lines;
+}
+
+void TestRoundTrip(const vector<string>& _lines, const SortedTableOptions& _options) {
+	string name = to_string(_lines.size()) + " lines" + (_options.checksums ? "" : " without checksums");
+	WriteSortedTable(TEST_TABLE_NAME, _lines, _options);
+	SortedTable table(TEST_TABLE_NAME);
+	Check(table.GetLineCount() == _lines.size(), name + ": line count");
+	Check(_lines.size() < 2 * TEST_BLOCK_SIZE || table.GetBlockCount() > 1, name + ": more than one block");
+
+	// Every line and every prefix of it, and keys between and around them that are not in the table
+	vector<string> keys = { "0", "a/", "a/0005", "a/020y", "b/0391", "f", string(1, '\xFF') };
+	for (const string& line : _lines) {
+		for (size_t length = 0; length <= line.size() && length <= 6; ++length) {
+			keys.push_back(line.substr(0, length));
+		}
+		keys.push_back(line);
+	}
+	for (const string& key : keys) {
+		vector<string_view> expectedCopies;
+		vector<string_view> expectedPrefixed;
+		for (const string& line : _lines) {
+			if (line == key)
+				expectedCopies.push_back(line);
+			if (line.compare(0, key.size(), key) == 0)
+				expectedPrefixed.push_back(line);
+		}
+		Check(table.Find(key) == expectedCopies, name + ": Find(\"" + key + "\")");
+		Check(table.Contains(key) == !expectedCopies.empty(), name + ": Contains(\"" + key + "\")");
+		Check(table.FindPrefix(key) == expectedPrefixed, name + ": FindPrefix(\"" + key + "\")");
+	}
+}
+
+void TestCorruption(const vector<string>& _lines) {
+	SortedTableOptions options;
+	options.blockSize = TEST_BLOCK_SIZE;
+	WriteSortedTable(TEST_TABLE_NAME, _lines, options);
+	string bytes = ReadBytes(TEST_TABLE_NAME);
+	auto readAll = [] {
+		SortedTable table(CORRUPT_TABLE_NAME);
+		table.FindPrefix(string_view());
+	};
+
+	for (size_t size = 0; size < bytes.size(); ++size) {
+		WriteBytes(CORRUPT_TABLE_NAME, bytes.substr(0, size));
+		Check(Throws(readAll), "truncated to " + to_string(size) + " bytes");
+	}
+	for (size_t i = 0; i < bytes.size(); ++i) {
+		string flipped = bytes;
+		flipped[i] ^= (char)(1 << (i % 8));
+		WriteBytes(CORRUPT_TABLE_NAME, flipped);
+		Check(Throws(readAll), "bit " + to_string(i % 8) + " of byte " + to_string(i) + " flipped");
+	}
+}
+
+void Check(bool _passed, const string& _what) {
+	if (!_passed) {
+		cout << "FAILED: " << _what << endl;
+		++failures;
+	}
+}
+
+bool Throws(function<void()> _run) {
+	try {
+		_run();
+	}
+	catch (const exception&) {
+		return true;
+	}
+	return false;
+}
+
+string ReadBytes(const string& _fileName) {
+	ifstream fileIn(_fileName, ifstream::binary);
+	return string(istreambuf_iterator<char>(fileIn), istreambuf_iterator<char>());
+}
+
+void WriteBytes(const string& _fileName, const string& _bytes) {
+	ofstream fileOut(_fileName, ofstream::binary | ofstream::trunc);
+	fileOut.write(_bytes.data(), _bytes.size());
+}
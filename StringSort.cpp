@@ -0,0 +1,2233 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "StringSort.h"
+#include "LargePages.h"
+#include "Metrics.h"
+#include "TextLines.h"
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <future>
+#include <unordered_map>
+#include <iomanip>
+#include <sstream>
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+using std::future;
+using std::async;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// How the engines count their work into SortPlan::counters. With STRINGSORT_COUNTERS the counts go
+// to plain thread_local fields and are added to the job's counters when the task that made them
+// ends (see Scope), so that the threads of an instrumented sort do not fight over shared counters.
+// Without it every call is an empty inline function and nothing of the counting is left.
+template <bool TEnabled>
+struct SortTallyPolicy {
+	// Counts the work done on this thread while it lives towards _counters, which may be null.
+	class Scope {
+	public:
+		explicit Scope(SortCounters*) {}
+	};
+	static SortCounters* Current() { return nullptr; }
+	// How many bytes a comparison of _first and _second from _from on looks at.
+	static size_t BytesExamined(string_view, string_view, size_t) { return 0; }
+	static void Comparison(size_t) {}
+	static void Move(size_t) {}
+	static void Depth(size_t) {}
+};
+
+// What one thread has counted for the job it is working on.
+struct SortTallyState {
+	SortCounters* counters = nullptr;
+	uint64_t comparisons = 0;
+	uint64_t bytesCompared = 0;
+	uint64_t moves = 0;
+	uint64_t maxDepth = 0;
+};
+
+template <>
+struct SortTallyPolicy<true> {
+	static inline thread_local SortTallyState state;
+
+	class Scope {
+	public:
+		explicit Scope(SortCounters* _counters) : saved(state) {
+			state = SortTallyState();
+			state.counters = _counters;
+		}
+		~Scope() {
+			SortCounters* counters = state.counters;
+			if (counters != nullptr) {
+				counters->comparisons.fetch_add(state.comparisons, memory_order_relaxed);
+				counters->bytesCompared.fetch_add(state.bytesCompared, memory_order_relaxed);
+				counters->moves.fetch_add(state.moves, memory_order_relaxed);
+				uint64_t depth = counters->maxDepth.load(memory_order_relaxed);
+				while (depth < state.maxDepth && !counters->maxDepth.compare_exchange_weak(depth, state.maxDepth, memory_order_relaxed)) {
+				}
+			}
+			state = saved;
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		SortTallyState saved;
+	};
+
+	static SortCounters* Current() { return state.counters; }
+	static size_t BytesExamined(string_view _first, string_view _second, size_t _from) {
+		size_t length = min(_first.size(), _second.size());
+		size_t start = min(_from, length);
+		size_t i = start;
+		while (i < length && _first[i] == _second[i]) {
+			++i;
+		}
+		return min(i + 1, length) - start;
+	}
+	static void Comparison(size_t _bytes) {
+		++state.comparisons;
+		state.bytesCompared += _bytes;
+	}
+	static void Move(size_t _count) { state.moves += _count; }
+	static void Depth(size_t _depth) { state.maxDepth = max<uint64_t>(state.maxDepth, _depth); }
+};
+
+using SortTally = SortTallyPolicy<SORT_COUNTERS_ENABLED>;
+
+// Wraps _work, a function or lambda to run on another thread, so that its work counts towards the
+// caller's SortCounters. Without STRINGSORT_COUNTERS it is _work itself.
+template <typename TWork>
+static auto CountedWork(TWork _work) {
+	if constexpr (SORT_COUNTERS_ENABLED) {
+		return [counters = SortTally::Current(), _work](auto... _args) {
+			SortTally::Scope scope(counters);
+			_work(_args...);
+		};
+	}
+	else {
+		return _work;
+	}
+}
+
+class AlphabeticalAscendingStringComparer : public IStringComparer {
+public:
+	virtual bool IsFirstAboveSecond(string_view _first, string_view _second);
+};
+
+class AlphabeticalDescendingStringComparer : public IStringComparer {
+public:
+	virtual bool IsFirstAboveSecond(string_view _first, string_view _second) override{
+	SortTally::Comparison(SortTally::BytesExamined(_first, _second, 0));
+	return _first >= _second;
+	}
+};
+
+class LastLetterAscendingStringComparer : public IStringComparer {
+public:
+	virtual bool IsFirstAboveSecond(string_view _first, string_view _second) override {
+		if (_first.empty() || _second.empty()) {
+			SortTally::Comparison(0);
+			return _first.empty();
+		}
+
+		unsigned char lastCharFirst = _first[_first.length() - 1];
+		unsigned char lastCharSecond = _second[_second.length() - 1];
+
+		// Same tie-break as the suffix radix sort: whole line ascending
+		if (lastCharFirst != lastCharSecond) {
+			SortTally::Comparison(1);
+			return lastCharFirst < lastCharSecond;
+		}
+		SortTally::Comparison(1 + SortTally::BytesExamined(_first, _second, 0));
+		return _first <= _second;
+	}
+};
+
+// How many elements ahead of the one being looked at the radix and merge loops prefetch.
+const size_t PREFETCH_DISTANCE = 16;
+
+// Asks for the cache line at _address ahead of its use. Does nothing on compilers without a prefetch
+// intrinsic; an address that is not mapped is ignored rather than faulting.
+static inline void PrefetchRead(const void* _address) {
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(_address, 0, 1);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_prefetch((const char*)_address, _MM_HINT_T1);
+#else
+	(void)_address;
+#endif
+}
+
+// Adapts a comparer to the engines that sort lines in place. Prefetch() is how the merge asks for a
+// line it will compare soon.
+struct LineComparer {
+	IStringComparer* comparer;
+	bool prefetch;
+	bool operator()(const string& _first, const string& _second) const { return comparer->IsFirstAboveSecond(_first, _second); }
+	void Prefetch(const string& _line) const { if (prefetch) PrefetchRead(_line.data()); }
+};
+
+// Adapts a comparer to the engines that sort line indices, comparing the lines they point at.
+struct LineIndexComparer {
+	const string_view* lines;
+	IStringComparer* comparer;
+	bool prefetch;
+	bool operator()(size_t _first, size_t _second) const { return comparer->IsFirstAboveSecond(lines[_first], lines[_second]); }
+	void Prefetch(size_t _index) const { if (prefetch) PrefetchRead(lines[_index].data()); }
+};
+
+const ESortType ALL_SORT_TYPES[] = { ESortType::AlphabeticalAscending, ESortType::AlphabeticalDescending, ESortType::LastLetterAscending, ESortType::CaseInsensitiveAscending, ESortType::LocaleAscending, ESortType::NaturalAscending, ESortType::SuffixAscending, ESortType::LastCharacterAscending };
+
+const char* GetSortTypeName(ESortType _sortType) {
+	switch (_sortType) {
+	case ESortType::AlphabeticalAscending:
+		return "AlphabeticalAscending";
+	case ESortType::AlphabeticalDescending:
+		return "AlphabeticalDescending";
+	case ESortType::LastLetterAscending:
+		return "LastLetterAscending";
+	case ESortType::CaseInsensitiveAscending:
+		return "CaseInsensitiveAscending";
+	case ESortType::LocaleAscending:
+		return "LocaleAscending";
+	case ESortType::NaturalAscending:
+		return "NaturalAscending";
+	case ESortType::SuffixAscending:
+		return "SuffixAscending";
+	case ESortType::LastCharacterAscending:
+		return "LastCharacterAscending";
+	}
+	return "Unknown";
+}
+
+ESortType ParseSortType(string_view _name) {
+	for (ESortType sortType : ALL_SORT_TYPES) {
+		if (_name == GetSortTypeName(sortType))
+			return sortType;
+	}
+	throw runtime_error("Unknown sort type " + string(_name));
+}
+
+// Function to create the appropriate comparer
+IStringComparer* CreateComparer(ESortType _sortType) {
+	switch (_sortType) {
+	case ESortType::AlphabeticalAscending:
+		return new AlphabeticalAscendingStringComparer();
+	case ESortType::AlphabeticalDescending:
+		return new AlphabeticalDescendingStringComparer();
+	case ESortType::LastLetterAscending:
+		return new LastLetterAscendingStringComparer();
+	default:
+		break;
+	}
+	return nullptr;  // Sort types ordered by keys or suffixes have no comparer, see HasComparer()
+}
+
+static void merge(vector<string>& arr, int low, int mid, int high, ESortType _sortType);
+static void parallelMerge(vector<string>& arr, int low, int mid, int high, ESortType _sortType, int numThreads);
+static void mergeSort(vector<string>& arr, int low, int high, ESortType _sortType, int depth=0);
+static bool HasComparer(ESortType _sortType);
+static bool UsesCollationKeys(ESortType _sortType);
+static string MakeCollationKey(string_view _line, ESortType _sortType);
+static vector<string> MakeCollationKeys(const string_view* _lines, size_t _count, ESortType _sortType, unsigned int _numThreads);
+template <typename TKey>
+static void RadixSortByKeys(const TKey* _keys, size_t* _order, size_t* _buffer, size_t _count, size_t _depth, bool _prefetch, int _threadDepth=0);
+static size_t GetSuffixLength(ESortType _sortType);
+static uint32_t MakeCodePointKey(string_view _line);
+static bool IsCodePointBelow(const uint32_t* _keys, const string_view* _lines, size_t _first, size_t _second);
+static LargeBuffer<uint32_t> MakeCodePointKeys(const string_view* _lines, size_t _count, unsigned int _numThreads, bool _hugePages);
+static void CodePointRadixSort(const uint32_t* _keys, const string_view* _lines, size_t* _order, size_t* _buffer, size_t _count, size_t _depth, bool _prefetch, int _threadDepth=0);
+static bool IsSuffixBelow(string_view _first, string_view _second, size_t _depth, size_t _suffixLength);
+static void SuffixRadixSort(const string_view* _lines, size_t* _order, size_t* _buffer, size_t _count, size_t _depth, size_t _suffixLength, bool _prefetch, int _threadDepth=0);
+static void TimSort(vector<string>& _lines, IStringComparer* _comparer);
+static void TimSort(vector<size_t>& _order, const string_view* _lines, IStringComparer* _comparer);
+static void SortLinesPacked(vector<string>& _lines, bool _hugePages, bool _prefetch, int _threadDepth=0);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorting
+////////////////////////////////////////////////////////////////////////////////////////////////////
+bool AlphabeticalAscendingStringComparer::IsFirstAboveSecond(string_view _first, string_view _second) {
+	SortTally::Comparison(SortTally::BytesExamined(_first, _second, 0));
+	unsigned int i = 0;
+	while (i < _first.length() && i < _second.length()) {
+		if ((unsigned char)_first[i] < (unsigned char)_second[i])
+			return true;
+		else if ((unsigned char)_first[i] > (unsigned char)_second[i])
+			return false;
+		++i;
+	}
+	return (i == _first.length());
+}
+
+// merge function to merge two sorted sublists
+static void merge(vector<string>& arr, int low, int mid, int high, ESortType _sortType) {
+	vector<string> temp(high - low + 1);
+	int i = low, j = mid + 1, k = 0;
+	IStringComparer* comparer = CreateComparer(_sortType);
+
+	while (i <= mid && j <= high) {
+		if (comparer->IsFirstAboveSecond(arr[i], arr[j])) {
+			temp[k++] = move(arr[i++]);
+		}
+		else {
+			temp[k++] = move(arr[j++]);
+		}
+	}
+	delete comparer;
+
+	while (i <= mid) {
+		temp[k++] = move(arr[i++]);
+	}
+
+	while (j <= high) {
+		temp[k++] = move(arr[j++]);
+	}
+
+	for (k = 0, i = low; i <= high; ++i, ++k) {
+		arr[i] = move(temp[k]);
+	}
+	SortTally::Move(2 * (size_t)(high - low + 1));
+	AddMetric(EMetric::LinesMerged, high - low + 1);
+}
+
+// A threshold for the size of the list below which we will not create new threads.
+const int THREAD_THRESHOLD = 1000;
+// A limit on the depth of the recursion at which we will stop creating new threads.
+const int MAX_THREAD_DEPTH = 3;
+// Merges of at least this many lines are split across the threads that are idle at that depth.
+const int PARALLEL_MERGE_THRESHOLD = 65536;
+
+// Runs _work(0) .. _work(_numThreads - 1), all but the first on their own threads.
+template <typename TWork>
+static void RunOnThreads(int _numThreads, TWork _work) {
+	vector<thread> workers;
+	for (int p = 1; p < _numThreads; ++p) {
+		workers.emplace_back(CountedWork(_work), p);
+	}
+	_work(0);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+// Co-rank of _outputPosition in the merge of the sorted runs [_left, _left + _leftCount) and
+// [_right, _right + _rightCount): how many of the first _outputPosition merged lines come from the
+// left run, found by binary search along the merge path. Ties go to the left run, as in merge().
+template <typename T, typename TIsFirstAboveSecond>
+static size_t coRank(const vector<T>& arr, size_t _outputPosition, size_t _left, size_t _leftCount, size_t _right, size_t _rightCount, TIsFirstAboveSecond _isFirstAboveSecond) {
+	size_t low = _outputPosition > _rightCount ? _outputPosition - _rightCount : 0;
+	size_t high = min(_outputPosition, _leftCount);
+	while (low < high) {
+		size_t i = low + (high - low) / 2;
+		size_t j = _outputPosition - i;
+		// Does the left line at i still go before the right line at j - 1?
+		if (_isFirstAboveSecond(arr[_left + i], arr[_right + j - 1]))
+			low = i + 1;
+		else
+			high = i;
+	}
+	return low;
+}
+
+// Same result as merge(), but the output is cut into numThreads equal chunks. The co-ranks of the
+// chunk boundaries tell each thread which part of each run it merges, so the threads never touch
+// each other's lines.
+static void parallelMerge(vector<string>& arr, int low, int mid, int high, ESortType _sortType, int numThreads) {
+	size_t left = low;
+	size_t leftCount = mid - low + 1;
+	size_t right = mid + 1;
+	size_t rightCount = high - mid;
+	size_t total = leftCount + rightCount;
+
+	// All boundaries are found before any line is moved
+	vector<size_t> outputBounds(numThreads + 1);
+	vector<size_t> leftBounds(numThreads + 1);
+	IStringComparer* comparer = CreateComparer(_sortType);
+	for (int p = 0; p <= numThreads; ++p) {
+		outputBounds[p] = total * p / numThreads;
+		leftBounds[p] = coRank(arr, outputBounds[p], left, leftCount, right, rightCount, LineComparer{ comparer, false });
+	}
+	delete comparer;
+
+	vector<string> temp(total);
+	auto mergeChunk = [&](int p) {
+		IStringComparer* chunkComparer = CreateComparer(_sortType);
+		size_t i = left + leftBounds[p];
+		size_t iEnd = left + leftBounds[p + 1];
+		size_t j = right + outputBounds[p] - leftBounds[p];
+		size_t jEnd = right + outputBounds[p + 1] - leftBounds[p + 1];
+		size_t k = outputBounds[p];
+		while (i < iEnd && j < jEnd) {
+			if (chunkComparer->IsFirstAboveSecond(arr[i], arr[j]))
+				temp[k++] = move(arr[i++]);
+			else
+				temp[k++] = move(arr[j++]);
+		}
+		while (i < iEnd) {
+			temp[k++] = move(arr[i++]);
+		}
+		while (j < jEnd) {
+			temp[k++] = move(arr[j++]);
+		}
+		delete chunkComparer;
+		AddMetric(EMetric::LinesMerged, outputBounds[p + 1] - outputBounds[p]);
+	};
+	auto copyBackChunk = [&](int p) {
+		move(temp.begin() + outputBounds[p], temp.begin() + outputBounds[p + 1], arr.begin() + low + outputBounds[p]);
+	};
+
+	RunOnThreads(numThreads, mergeChunk);
+	RunOnThreads(numThreads, copyBackChunk);
+	SortTally::Move(2 * total);
+}
+
+// Depth of mergeSort's recursion over _count lines, which halves them at every level.
+static size_t MergeSortLevels(size_t _count) {
+	size_t levels = 0;
+	while (((size_t)1 << levels) < _count) {
+		++levels;
+	}
+	return levels;
+}
+
+static void mergeSort(vector<string>& arr, int low, int high, ESortType _sortType, int depth) {
+	if (low < high) {
+		int mid = low + (high - low) / 2;
+
+		if (depth < MAX_THREAD_DEPTH && high - low > THREAD_THRESHOLD) {
+			std::thread left_thread(CountedWork(mergeSort), std::ref(arr), low, mid, _sortType, depth + 1);
+			std::thread right_thread(CountedWork(mergeSort), std::ref(arr), mid + 1, high, _sortType, depth + 1);
+
+			left_thread.join();
+			right_thread.join();
+		}
+		else {
+			mergeSort(arr, low, mid, _sortType, depth + 1);
+			mergeSort(arr, mid + 1, high, _sortType, depth + 1);
+		}
+
+		// Both halves are done, so the threads that sorted them are free to share the merge
+		int mergeThreads = depth < MAX_THREAD_DEPTH ? 1 << (MAX_THREAD_DEPTH - depth) : 1;
+		if (mergeThreads > 1 && high - low + 1 >= PARALLEL_MERGE_THRESHOLD)
+			parallelMerge(arr, low, mid, high, _sortType, mergeThreads);
+		else
+			merge(arr, low, mid, high, _sortType);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bottom-Up Merge Sort
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Merge sort without recursion or per-merge allocations. Runs of INSERTION_SORT_CUTOFF lines are
+// insertion sorted in place, then every level merges pairs of runs from one vector into the other
+// and the two swap roles, so the job allocates exactly one buffer and only moves lines (no string
+// is copied). Each level's output is split into equal chunks across the threads along the merge
+// path, like parallelMerge(), so every level is balanced whatever the run sizes. The elements are
+// lines or line indices, compared by LineComparer or LineIndexComparer.
+
+// Runs up to this length are insertion sorted before the first merge level.
+const size_t INSERTION_SORT_CUTOFF = 24;
+
+// Where one thread starts merging a level: the output position and the next line of each run.
+struct MergeCursor {
+	size_t output;
+	size_t left;
+	size_t right;
+};
+
+// Finds where the merge of the level with runs of _width reaches output position _output.
+template <typename T, typename TIsFirstAboveSecond>
+static MergeCursor FindMergeCursor(const vector<T>& _source, size_t _width, size_t _output, TIsFirstAboveSecond _isFirstAboveSecond) {
+	size_t count = _source.size();
+	if (_output >= count)
+		return { count, count, count };
+
+	size_t pairStart = _output / (2 * _width) * (2 * _width);
+	size_t mid = min(pairStart + _width, count);
+	size_t pairEnd = min(pairStart + 2 * _width, count);
+	size_t fromLeft = coRank(_source, _output - pairStart, pairStart, mid - pairStart, mid, pairEnd - mid, _isFirstAboveSecond);
+	return { _output, pairStart + fromLeft, mid + (_output - pairStart - fromLeft) };
+}
+
+// Merges the level with runs of _width from _source into _destination, from _begin up to _end.
+template <typename T, typename TIsFirstAboveSecond>
+static void MergeLevelChunk(vector<T>& _source, vector<T>& _destination, size_t _width, MergeCursor _begin, MergeCursor _end, TIsFirstAboveSecond _isFirstAboveSecond) {
+	size_t count = _source.size();
+	size_t dest = _begin.output;
+	size_t i = _begin.left;
+	size_t j = _begin.right;
+	while (dest < _end.output) {
+		size_t pairStart = dest / (2 * _width) * (2 * _width);
+		size_t mid = min(pairStart + _width, count);
+		size_t pairEnd = min(pairStart + 2 * _width, count);
+
+		// The chunk either ends inside this pair or takes the rest of it
+		size_t iEnd = mid;
+		size_t jEnd = pairEnd;
+		if (_end.output < pairEnd) {
+			iEnd = _end.left;
+			jEnd = _end.right;
+		}
+
+		// Each run asks for its line PREFETCH_DISTANCE ahead whenever it gives one up
+		while (i < iEnd && j < jEnd) {
+			if (_isFirstAboveSecond(_source[i], _source[j])) {
+				if (i + PREFETCH_DISTANCE < iEnd)
+					_isFirstAboveSecond.Prefetch(_source[i + PREFETCH_DISTANCE]);
+				_destination[dest++] = move(_source[i++]);
+			}
+			else {
+				if (j + PREFETCH_DISTANCE < jEnd)
+					_isFirstAboveSecond.Prefetch(_source[j + PREFETCH_DISTANCE]);
+				_destination[dest++] = move(_source[j++]);
+			}
+		}
+		while (i < iEnd) {
+			_destination[dest++] = move(_source[i++]);
+		}
+		while (j < jEnd) {
+			_destination[dest++] = move(_source[j++]);
+		}
+
+		// On to the start of the next pair
+		i = pairEnd;
+		j = min(pairEnd + _width, count);
+	}
+	AddMetric(EMetric::LinesMerged, _end.output - _begin.output);
+}
+
+template <typename T, typename TIsFirstAboveSecond>
+static void BottomUpMergeSort(vector<T>& _lines, TIsFirstAboveSecond _isFirstAboveSecond, int _numThreads) {
+	size_t count = _lines.size();
+	if (count < 2)
+		return;
+	size_t numThreads = max(1, min(_numThreads, (int)((count + THREAD_THRESHOLD - 1) / THREAD_THRESHOLD)));
+
+	// Whole runs per thread, so no run is shared
+	size_t runCount = (count + INSERTION_SORT_CUTOFF - 1) / INSERTION_SORT_CUTOFF;
+	RunOnThreads((int)numThreads, [&](int p) {
+		size_t runEnd = runCount * (p + 1) / numThreads;
+		for (size_t run = runCount * p / numThreads; run < runEnd; ++run) {
+			size_t low = run * INSERTION_SORT_CUTOFF;
+			size_t high = min(low + INSERTION_SORT_CUTOFF, count);
+			for (size_t i = low + 1; i < high; ++i) {
+				T line = move(_lines[i]);
+				size_t j = i;
+				while (j > low && !_isFirstAboveSecond(_lines[j - 1], line)) {
+					_lines[j] = move(_lines[j - 1]);
+					--j;
+				}
+				_lines[j] = move(line);
+				SortTally::Move(i - j + 1);
+			}
+		}
+	});
+
+	vector<T> buffer(count);
+	vector<T>* source = &_lines;
+	vector<T>* destination = &buffer;
+	vector<MergeCursor> cursors(numThreads + 1);
+	size_t level = 0;
+	for (size_t width = INSERTION_SORT_CUTOFF; width < count; width *= 2) {
+		SortTally::Depth(++level);
+		SortTally::Move(count);
+		// Every cursor is found before any line of the level is moved
+		for (size_t p = 0; p <= numThreads; ++p) {
+			cursors[p] = FindMergeCursor(*source, width, count * p / numThreads, _isFirstAboveSecond);
+		}
+		RunOnThreads((int)numThreads, [&](int p) {
+			MergeLevelChunk(*source, *destination, width, cursors[p], cursors[p + 1], _isFirstAboveSecond);
+		});
+		swap(source, destination);
+	}
+
+	if (source != &_lines) {
+		_lines.swap(buffer);
+	}
+}
+
+// Moves the lines into the order given by the index permutation _order.
+static void ApplyOrder(vector<string>& _lines, const vector<size_t>& _order) {
+	vector<string> sortedLines;
+	sortedLines.reserve(_lines.size());
+	for (size_t i = 0; i < _order.size(); ++i) {
+		sortedLines.push_back(move(_lines[_order[i]]));
+	}
+	SortTally::Move(_order.size());
+	_lines.swap(sortedLines);
+}
+
+static vector<size_t> IdentityOrder(size_t _count) {
+	vector<size_t> order(_count);
+	for (size_t i = 0; i < _count; ++i) {
+		order[i] = i;
+	}
+	return order;
+}
+
+// Number of levels of the recursive engines that fork, so that about _numThreads threads are busy.
+static int ThreadDepthFor(unsigned int _numThreads) {
+	int depth = 0;
+	while (depth < MAX_THREAD_DEPTH && (1u << depth) < _numThreads) {
+		++depth;
+	}
+	return depth;
+}
+
+// Collapses duplicate lines, sorts one index per unique line with _plan's engine and expands them
+// again. The copies of a line follow each other in input order.
+static vector<size_t> SortLineOrderDistinct(const string_view* _lines, size_t _count, ESortType _sortType, const SortPlan& _plan) {
+	unordered_map<string_view, size_t> uniqueIds;
+	vector<string_view> uniqueLines;
+	vector<size_t> firstCopy;
+	vector<size_t> lastCopy;
+	vector<size_t> nextCopy(_count, SIZE_MAX);
+	for (size_t i = 0; i < _count; ++i) {
+		auto inserted = uniqueIds.emplace(_lines[i], uniqueLines.size());
+		if (inserted.second) {
+			uniqueLines.push_back(_lines[i]);
+			firstCopy.push_back(i);
+			lastCopy.push_back(i);
+		}
+		else {
+			size_t id = inserted.first->second;
+			nextCopy[lastCopy[id]] = i;
+			lastCopy[id] = i;
+		}
+	}
+	uniqueIds.clear();
+
+	vector<size_t> uniqueOrder = SortLineOrder(uniqueLines.data(), uniqueLines.size(), _sortType, _plan);
+	vector<size_t> order;
+	order.reserve(_count);
+	for (size_t id : uniqueOrder) {
+		for (size_t i = firstCopy[id]; i != SIZE_MAX; i = nextCopy[i]) {
+			order.push_back(i);
+		}
+	}
+	return order;
+}
+
+// Sorts _lines in place in the order given by _sortType, with an automatically planned engine.
+void SortLines(vector<string>& _lines, ESortType _sortType) {
+	SortLines(_lines, _sortType, PlanSort(_lines, _sortType, thread::hardware_concurrency()));
+}
+
+// Sorts _lines in place in the order given by _sortType with the engine and threads from _plan.
+void SortLines(vector<string>& _lines, ESortType _sortType, const SortPlan& _plan) {
+	SortTally::Scope tallyScope(_plan.counters);
+	// The engines fork while their depth is below MAX_THREAD_DEPTH, so start them part way down
+	int threadDepth = MAX_THREAD_DEPTH - ThreadDepthFor(_plan.numThreads);
+
+	// Engines that move the strings themselves
+	if (_plan.engine == ESortEngine::TimSort) {
+		IStringComparer* comparer = CreateComparer(_sortType);
+		if (comparer != nullptr) {
+			TimSort(_lines, comparer);
+			delete comparer;
+			return;
+		}
+	}
+	if (HasComparer(_sortType)) {
+		if (_plan.engine == ESortEngine::MergeSort) {
+			mergeSort(_lines, 0, _lines.size() - 1, _sortType, threadDepth);
+			SortTally::Depth(MergeSortLevels(_lines.size()));
+			return;
+		}
+		if (_plan.engine == ESortEngine::BottomUpMerge) {
+			IStringComparer* comparer = CreateComparer(_sortType);
+			BottomUpMergeSort(_lines, LineComparer{ comparer, _plan.prefetch }, _plan.numThreads);
+			delete comparer;
+			return;
+		}
+		if (_plan.engine == ESortEngine::PackedRadix) {
+			SortLinesPacked(_lines, _plan.hugePages, _plan.prefetch, threadDepth);
+			if (_sortType == ESortType::AlphabeticalDescending) {
+				reverse(_lines.begin(), _lines.end());
+			}
+			return;
+		}
+	}
+
+	// The rest sort line indices
+	LargeBuffer<string_view> lineViews(_lines.begin(), _lines.end(), PageAllocator<string_view>(_plan.hugePages));
+	vector<size_t> order = SortLineOrder(lineViews.data(), lineViews.size(), _sortType, _plan);
+	lineViews.clear();
+	ApplyOrder(_lines, order);
+}
+
+// Returns the order of _lines given by _sortType, sorted with the engine and threads from _plan.
+vector<size_t> SortLineOrder(const string_view* _lines, size_t _count, ESortType _sortType, const SortPlan& _plan) {
+	SortTally::Scope tallyScope(_plan.counters);
+	int threadDepth = MAX_THREAD_DEPTH - ThreadDepthFor(_plan.numThreads);
+	vector<size_t> order = IdentityOrder(_count);
+
+	if (_plan.engine == ESortEngine::TimSort) {
+		IStringComparer* comparer = CreateComparer(_sortType);
+		if (comparer != nullptr) {
+			TimSort(order, _lines, comparer);
+			delete comparer;
+			return order;
+		}
+	}
+	if (_plan.engine == ESortEngine::Distinct) {
+		SortPlan uniquePlan = _plan;
+		uniquePlan.engine = ESortEngine::Radix;
+		return SortLineOrderDistinct(_lines, _count, _sortType, uniquePlan);
+	}
+	if (GetSuffixLength(_sortType) != 0) {
+		LargeBuffer<size_t> buffer(_count, PageAllocator<size_t>(_plan.hugePages));
+		SuffixRadixSort(_lines, order.data(), buffer.data(), _count, 0, GetSuffixLength(_sortType), _plan.prefetch, threadDepth);
+		return order;
+	}
+	if (_sortType == ESortType::LastCharacterAscending) {
+		LargeBuffer<uint32_t> keys = MakeCodePointKeys(_lines, _count, _plan.numThreads, _plan.hugePages);
+		LargeBuffer<size_t> buffer(_count, PageAllocator<size_t>(_plan.hugePages));
+		CodePointRadixSort(keys.data(), _lines, order.data(), buffer.data(), _count, 0, _plan.prefetch, threadDepth);
+		return order;
+	}
+	if (!UsesCollationKeys(_sortType)) {
+		// Only the bottom-up merge sort can sort indices, the recursive one works on the lines
+		if (_plan.engine == ESortEngine::MergeSort || _plan.engine == ESortEngine::BottomUpMerge) {
+			IStringComparer* comparer = CreateComparer(_sortType);
+			BottomUpMergeSort(order, LineIndexComparer{ _lines, comparer, _plan.prefetch }, _plan.numThreads);
+			delete comparer;
+			return order;
+		}
+
+		// Alphabetical orders are plain byte orders, the lines are their own radix keys. Packed records
+		// do not keep the index of a short line, so PackedRadix sorts indices like Radix does.
+		LargeBuffer<size_t> buffer(_count, PageAllocator<size_t>(_plan.hugePages));
+		RadixSortByKeys(_lines, order.data(), buffer.data(), _count, 0, _plan.prefetch, threadDepth);
+		if (_sortType == ESortType::AlphabeticalDescending) {
+			reverse(order.begin(), order.end());
+		}
+		return order;
+	}
+
+	vector<string> keys = MakeCollationKeys(_lines, _count, _sortType, _plan.numThreads);
+	LargeBuffer<size_t> buffer(_count, PageAllocator<size_t>(_plan.hugePages));
+	RadixSortByKeys(keys.data(), order.data(), buffer.data(), _count, 0, _plan.prefetch, threadDepth);
+	return order;
+}
+
+vector<size_t> SortLineOrder(const string_view* _lines, size_t _count, const SortConfig& _config) {
+	return SortLineOrder(_lines, _count, _config.sortType, MakeSortPlan(_lines, _count, _config));
+}
+
+vector<size_t> SortLineOrder(const LineArena& _arena, const SortConfig& _config) {
+	LargeBuffer<string_view> lines(_arena.count, PageAllocator<string_view>(_config.hugePages));
+	for (size_t i = 0; i < _arena.count; ++i) {
+		if (_arena.offsets[i + 1] < _arena.offsets[i])
+			throw runtime_error("Line arena offsets must not decrease");
+		lines[i] = string_view(_arena.data + _arena.offsets[i], _arena.offsets[i + 1] - _arena.offsets[i]);
+	}
+	return SortLineOrder(lines.data(), lines.size(), _config);
+}
+
+bool IsLineBelow(string_view _first, string_view _second, ESortType _sortType) {
+	if (UsesCollationKeys(_sortType))
+		return MakeCollationKey(_first, _sortType) < MakeCollationKey(_second, _sortType);
+	size_t suffixLength = GetSuffixLength(_sortType);
+	if (suffixLength != 0)
+		return IsSuffixBelow(_first, _second, 0, suffixLength);
+	if (_sortType == ESortType::LastCharacterAscending) {
+		uint32_t keys[2] = { MakeCodePointKey(_first), MakeCodePointKey(_second) };
+		string_view lines[2] = { _first, _second };
+		return IsCodePointBelow(keys, lines, 0, 1);
+	}
+	if (_sortType == ESortType::AlphabeticalDescending)
+		return _second < _first;
+	return _first < _second;
+}
+
+// Sort types that the comparison engines (the merge sorts and TimSort) can sort.
+static bool HasComparer(ESortType _sortType) {
+	return GetSuffixLength(_sortType) == 0 && !UsesCollationKeys(_sortType) && _sortType != ESortType::LastCharacterAscending;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Collation Keys
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Orderings that would need to transform both strings on every comparison (case folding, ignoring
+// punctuation, ...) are instead sorted by a binary key that is built once per line. Comparing two
+// keys byte by byte (unsigned, shorter first) gives the same result as the expensive comparison
+// would on the original lines, so the keys can go through a plain radix sort.
+
+static bool UsesCollationKeys(ESortType _sortType) {
+	switch (_sortType) {
+	case ESortType::CaseInsensitiveAscending:
+	case ESortType::LocaleAscending:
+	case ESortType::NaturalAscending:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Maps every byte to its lower case equivalent. Only ASCII is folded, UTF-8 sequences are kept as is.
+static const array<unsigned char, 256>& CaseFoldTable() {
+	static const array<unsigned char, 256> table = [] {
+		array<unsigned char, 256> t{};
+		for (int c = 0; c < 256; ++c) {
+			t[c] = (c >= 'A' && c <= 'Z') ? (unsigned char)(c - 'A' + 'a') : (unsigned char)c;
+		}
+		return t;
+	}();
+	return table;
+}
+
+// Primary weight of every byte for LocaleAscending, in dictionary order: punctuation, spaces and
+// control characters are ignorable (0), digits come before letters, letters are case-insensitive
+// and non-ASCII bytes sort after all ASCII letters.
+static const array<unsigned char, 256>& LocalePrimaryTable() {
+	static const array<unsigned char, 256> table = [] {
+		array<unsigned char, 256> t{};
+		for (int c = '0'; c <= '9'; ++c) {
+			t[c] = (unsigned char)(0x10 + c - '0');
+		}
+		for (int c = 'a'; c <= 'z'; ++c) {
+			t[c] = (unsigned char)(0x20 + c - 'a');
+			t[c - 'a' + 'A'] = t[c];
+		}
+		for (int c = 0x80; c < 0x100; ++c) {
+			t[c] = (unsigned char)c;
+		}
+		return t;
+	}();
+	return table;
+}
+
+// The folded line, then a 0x00 and the original line so that lines differing only in case have a
+// fixed order (upper case first, as in byte order) whatever the engine.
+static string MakeCaseInsensitiveKey(string_view _line) {
+	const array<unsigned char, 256>& fold = CaseFoldTable();
+	string key(_line.size() * 2 + 1, '\0');
+	for (size_t i = 0; i < _line.size(); ++i) {
+		key[i] = (char)fold[(unsigned char)_line[i]];
+	}
+	_line.copy(key.data() + _line.size() + 1, _line.size());
+	return key;
+}
+
+// Three levels separated by 0x00, which is below every weight so that a shorter level sorts first.
+// Primary weights, then one case weight per weighted character (lower case before upper case), then
+// the original bytes so that the order is fully deterministic.
+static string MakeLocaleKey(string_view _line) {
+	const array<unsigned char, 256>& primary = LocalePrimaryTable();
+	string key;
+	key.reserve(_line.size() * 3 + 2);
+	for (char c : _line) {
+		unsigned char weight = primary[(unsigned char)c];
+		if (weight != 0)
+			key.push_back((char)weight);
+	}
+	key.push_back('\0');
+	for (char c : _line) {
+		if (primary[(unsigned char)c] != 0)
+			key.push_back((c >= 'A' && c <= 'Z') ? 2 : 1);
+	}
+	key.push_back('\0');
+	key.append(_line);
+	return key;
+}
+
+// Text is copied as is. Every run of digits becomes a '0' marker (no digit is left in the text, so
+// the marker sorts where a digit would), the number of significant digits and then the digits
+// themselves without leading zeros, so a longer number always sorts after a shorter one and numbers
+// of the same length compare digit by digit. Counts from 255 up are written as 0xFF and four big
+// endian bytes. A 0x00 and the original line follow so that "01" and "1" still have a fixed order.
+static string MakeNaturalKey(string_view _line) {
+	string key;
+	key.reserve(_line.size() + 8);
+	size_t i = 0;
+	while (i < _line.size()) {
+		if (!isdigit((unsigned char)_line[i])) {
+			key.push_back(_line[i++]);
+			continue;
+		}
+
+		while (i < _line.size() && _line[i] == '0') {
+			++i;
+		}
+		size_t digitsStart = i;
+		while (i < _line.size() && isdigit((unsigned char)_line[i])) {
+			++i;
+		}
+		size_t digitCount = i - digitsStart;
+
+		key.push_back('0');
+		if (digitCount < 0xFF) {
+			key.push_back((char)digitCount);
+		}
+		else {
+			key.push_back((char)0xFF);
+			for (int shift = 24; shift >= 0; shift -= 8) {
+				key.push_back((char)((digitCount >> shift) & 0xFF));
+			}
+		}
+		key.append(_line, digitsStart, digitCount);
+	}
+	key.push_back('\0');
+	key.append(_line);
+	return key;
+}
+
+static string MakeCollationKey(string_view _line, ESortType _sortType) {
+	switch (_sortType) {
+	case ESortType::CaseInsensitiveAscending:
+		return MakeCaseInsensitiveKey(_line);
+	case ESortType::LocaleAscending:
+		return MakeLocaleKey(_line);
+	case ESortType::NaturalAscending:
+		return MakeNaturalKey(_line);
+	default:
+		throw runtime_error("Sort type has no collation key");
+	}
+}
+
+// Builds the keys for all lines, in parallel chunks once there are enough lines to be worth it.
+static vector<string> MakeCollationKeys(const string_view* _lines, size_t _count, ESortType _sortType, unsigned int _numThreads) {
+	vector<string> keys(_count);
+	size_t numThreads = max(1u, _numThreads);
+	if (_count < (size_t)THREAD_THRESHOLD * numThreads)
+		numThreads = 1;
+
+	size_t chunkSize = (_count + numThreads - 1) / numThreads;
+	vector<future<void>> workerFutures;
+	for (size_t start = 0; start < _count; start += chunkSize) {
+		size_t end = min(start + chunkSize, _count);
+		workerFutures.push_back(async(launch::async, [&, start, end] {
+			for (size_t i = start; i < end; ++i) {
+				keys[i] = MakeCollationKey(_lines[i], _sortType);
+			}
+		}));
+	}
+	for (auto& workerFuture : workerFutures) {
+		workerFuture.get();
+	}
+	return keys;
+}
+
+// Below this many entries a bucket is finished with an insertion sort instead of another radix pass.
+const size_t RADIX_INSERTION_THRESHOLD = 32;
+// Past this many bytes of shared prefix a range is merge sorted instead of given more radix passes.
+// Every recursion goes at least one byte deeper, so this bounds the recursion whatever the lines are.
+const size_t RADIX_MAX_DEPTH = 1024;
+
+// Stable merge sort of _items by _isBelow, with _buffer of the same size as the scratch space: runs of
+// RADIX_INSERTION_THRESHOLD items are insertion sorted and then merged bottom up. Finishes the small
+// buckets of the radix sorts and the ranges they leave at RADIX_MAX_DEPTH.
+template <typename TItem, typename TIsBelow>
+static void MergeSortRange(TItem* _items, TItem* _buffer, size_t _count, TIsBelow _isBelow) {
+	for (size_t runStart = 0; runStart < _count; runStart += RADIX_INSERTION_THRESHOLD) {
+		size_t runEnd = min(runStart + RADIX_INSERTION_THRESHOLD, _count);
+		for (size_t i = runStart + 1; i < runEnd; ++i) {
+			TItem item = _items[i];
+			size_t j = i;
+			while (j > runStart && _isBelow(item, _items[j - 1])) {
+				_items[j] = _items[j - 1];
+				--j;
+			}
+			_items[j] = item;
+			SortTally::Move(i - j + 1);
+		}
+	}
+
+	TItem* from = _items;
+	TItem* to = _buffer;
+	for (size_t width = RADIX_INSERTION_THRESHOLD; width < _count; width *= 2) {
+		for (size_t start = 0; start < _count; start += 2 * width) {
+			size_t middle = min(start + width, _count);
+			size_t end = min(start + 2 * width, _count);
+			size_t left = start;
+			size_t right = middle;
+			size_t next = start;
+			// The right item is only taken if it is strictly below, so equal items keep their order
+			while (left < middle && right < end) {
+				to[next++] = _isBelow(from[right], from[left]) ? from[right++] : from[left++];
+			}
+			next = copy(from + left, from + middle, to + next) - to;
+			copy(from + right, from + end, to + next);
+		}
+		SortTally::Move(_count);
+		swap(from, to);
+	}
+	if (from != _items) {
+		copy(from, from + _count, _items);
+		SortTally::Move(_count);
+	}
+}
+
+// Returns true if _first sorts before _second, looking only at the bytes from _depth onwards.
+static bool IsKeyBelow(string_view _first, string_view _second, size_t _depth) {
+	SortTally::Comparison(SortTally::BytesExamined(_first, _second, _depth));
+	size_t length = min(_first.size(), _second.size());
+	if (length > _depth) {
+		int result = memcmp(_first.data() + _depth, _second.data() + _depth, length - _depth);
+		if (result != 0)
+			return result < 0;
+	}
+	return _first.size() < _second.size();
+}
+
+// Number of bytes from _depth on that all the keys in the range have in common. Every key must have a
+// byte at _depth.
+template <typename TKey>
+static size_t SharedKeyLength(const TKey* _keys, const size_t* _order, size_t _count, size_t _depth) {
+	string_view first = _keys[_order[0]];
+	size_t shared = first.size() - _depth;
+	for (size_t i = 1; i < _count && shared > 0; ++i) {
+		string_view key = _keys[_order[i]];
+		size_t length = min(shared, key.size() - _depth);
+		size_t same = 0;
+		while (same < length && key[_depth + same] == first[_depth + same]) {
+			++same;
+		}
+		shared = same;
+	}
+	return shared;
+}
+
+// Entry _i of a radix pass over _order is about to be read. Asks for the byte at _depth of the key
+// PREFETCH_DISTANCE entries on, and for the key itself (the string or string_view holding the
+// pointer to its bytes) twice as far on, so that its pointer is in the cache by the time it is needed.
+template <typename TKey>
+static inline void PrefetchKeyAhead(const TKey* _keys, const size_t* _order, size_t _i, size_t _count, size_t _depth) {
+	if (_i + 2 * PREFETCH_DISTANCE < _count)
+		PrefetchRead(&_keys[_order[_i + 2 * PREFETCH_DISTANCE]]);
+	if (_i + PREFETCH_DISTANCE < _count) {
+		const TKey& key = _keys[_order[_i + PREFETCH_DISTANCE]];
+		PrefetchRead(key.data() + min(_depth, key.size()));
+	}
+}
+
+// Stable MSD radix sort of the line indices in _order by _keys. All keys in the range share their
+// first _depth bytes. Keys that end at _depth go first, the rest are distributed by their byte at
+// _depth into _buffer and each bucket is sorted recursively, the biggest ones on their own threads.
+// A pass that would leave every key in one bucket is replaced by one scan for the prefix they all
+// share, so duplicated long lines cost one recursion rather than one per byte. The bucket counts are
+// kept off the stack. TKey is string or string_view. With _prefetch, both passes over the range ask
+// for the key bytes they will need PREFETCH_DISTANCE entries ahead, see PrefetchKeyAhead().
+template <typename TKey>
+static void RadixSortByKeys(const TKey* _keys, size_t* _order, size_t* _buffer, size_t _count, size_t _depth, bool _prefetch, int _threadDepth) {
+	SortTally::Depth(_depth + 1);
+	if (_count < RADIX_INSERTION_THRESHOLD || _depth >= RADIX_MAX_DEPTH) {
+		MergeSortRange(_order, _buffer, _count, [&](size_t _first, size_t _second) { return IsKeyBelow(_keys[_first], _keys[_second], _depth); });
+		return;
+	}
+
+	// Bucket 0 holds the keys that end here, bucket b + 1 the keys with byte b at _depth
+	vector<size_t> bucketStart(258);
+	for (;;) {
+		for (size_t i = 0; i < _count; ++i) {
+			if (_prefetch)
+				PrefetchKeyAhead(_keys, _order, i, _count, _depth);
+			const TKey& key = _keys[_order[i]];
+			++bucketStart[key.size() > _depth ? (unsigned char)key[_depth] + 2 : 1];
+		}
+		auto fullBucket = find(bucketStart.begin() + 1, bucketStart.end(), _count);
+		if (fullBucket == bucketStart.end())
+			break;
+		// Keys that all end here are equal
+		if (fullBucket == bucketStart.begin() + 1)
+			return;
+		_depth += SharedKeyLength(_keys, _order, _count, _depth);
+		SortTally::Depth(_depth + 1);
+		fill(bucketStart.begin(), bucketStart.end(), 0);
+	}
+	for (int b = 1; b < 258; ++b) {
+		bucketStart[b] += bucketStart[b - 1];
+	}
+	vector<size_t> bucketNext(bucketStart.begin(), bucketStart.begin() + 257);
+	for (size_t i = 0; i < _count; ++i) {
+		if (_prefetch)
+			PrefetchKeyAhead(_keys, _order, i, _count, _depth);
+		const TKey& key = _keys[_order[i]];
+		_buffer[bucketNext[key.size() > _depth ? (unsigned char)key[_depth] + 1 : 0]++] = _order[i];
+	}
+	copy(_buffer, _buffer + _count, _order);
+	SortTally::Move(2 * _count);
+
+	vector<future<void>> workerFutures;
+	for (int b = 1; b < 257; ++b) {
+		size_t start = bucketStart[b];
+		size_t count = bucketStart[b + 1] - start;
+		if (count < 2)
+			continue;
+		if (_threadDepth < MAX_THREAD_DEPTH && count > (size_t)THREAD_THRESHOLD) {
+			workerFutures.push_back(async(launch::async, CountedWork(RadixSortByKeys<TKey>), _keys, _order + start, _buffer + start, count, _depth + 1, _prefetch, _threadDepth + 1));
+		}
+		else {
+			RadixSortByKeys(_keys, _order + start, _buffer + start, count, _depth + 1, _prefetch, _threadDepth);
+		}
+	}
+	for (auto& workerFuture : workerFutures) {
+		workerFuture.get();
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Packed Sort Records
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sorting vector<string> follows a pointer to the heap for every byte looked at once a line is too
+// long for the small string buffer, and every radix pass goes through an index to the string object
+// first. For the byte ordered sorts the lines are instead packed into 16 byte records, four to a
+// cache line: a line of up to 12 bytes is held inline, a longer one keeps its first 4 bytes inline
+// and the rest is read from one contiguous arena. The records themselves are moved by the radix
+// passes. Once sorted, short lines are rebuilt from their record (they fit the small string buffer,
+// so nothing is allocated) and long ones are moved from their original string, whose index is kept
+// in the arena just before the line. Equal lines are interchangeable, so the result is the same as
+// sorting the strings.
+
+const uint32_t RECORD_INLINE_LENGTH = 12;
+const uint32_t RECORD_PREFIX_LENGTH = 4;
+
+struct SortRecord {
+	uint32_t length;
+	char prefix[RECORD_PREFIX_LENGTH];
+	union {
+		char rest[RECORD_INLINE_LENGTH - RECORD_PREFIX_LENGTH];	// Inline lines
+		uint64_t arenaOffset;									// Longer lines, the whole line is in the arena
+	};
+};
+static_assert(sizeof(SortRecord) == 16, "SortRecord must stay 16 bytes");
+
+static inline bool IsRecordInline(const SortRecord& _record) {
+	return _record.length <= RECORD_INLINE_LENGTH;
+}
+
+// Byte _depth of the line, which must be shorter than the record's length.
+static inline unsigned char GetRecordByte(const SortRecord& _record, size_t _depth, const char* _arena) {
+	if (_depth < RECORD_PREFIX_LENGTH)
+		return _record.prefix[_depth];
+	if (IsRecordInline(_record))
+		return _record.rest[_depth - RECORD_PREFIX_LENGTH];
+	return _arena[_record.arenaOffset + _depth];
+}
+
+// Pointer to the whole line: the inline bytes are contiguous from prefix on.
+static inline const char* GetRecordData(const SortRecord& _record, const char* _arena) {
+	return IsRecordInline(_record) ? _record.prefix : _arena + _record.arenaOffset;
+}
+
+static bool IsRecordBelow(const SortRecord& _first, const SortRecord& _second, size_t _depth, const char* _arena) {
+	SortTally::Comparison(SortTally::BytesExamined(string_view(GetRecordData(_first, _arena), _first.length), string_view(GetRecordData(_second, _arena), _second.length), _depth));
+	size_t length = min(_first.length, _second.length);
+	if (length > _depth) {
+		int result = memcmp(GetRecordData(_first, _arena) + _depth, GetRecordData(_second, _arena) + _depth, length - _depth);
+		if (result != 0)
+			return result < 0;
+	}
+	return _first.length < _second.length;
+}
+
+// Number of bytes from _depth on that all the records in the range have in common. Every record must
+// have a byte at _depth.
+static size_t SharedRecordLength(const SortRecord* _records, size_t _count, size_t _depth, const char* _arena) {
+	const char* first = GetRecordData(_records[0], _arena);
+	size_t shared = _records[0].length - _depth;
+	for (size_t i = 1; i < _count && shared > 0; ++i) {
+		const char* record = GetRecordData(_records[i], _arena);
+		size_t length = min(shared, _records[i].length - _depth);
+		size_t same = 0;
+		while (same < length && record[_depth + same] == first[_depth + same]) {
+			++same;
+		}
+		shared = same;
+	}
+	return shared;
+}
+
+// Stable MSD radix sort of the records, moving the records themselves; see RadixSortByKeys, including
+// the shared prefix skipped in one scan and the merge sort at RADIX_MAX_DEPTH.
+static void RecordRadixSort(SortRecord* _records, SortRecord* _buffer, size_t _count, size_t _depth, const char* _arena, bool _prefetch, int _threadDepth) {
+	SortTally::Depth(_depth + 1);
+	if (_count < RADIX_INSERTION_THRESHOLD || _depth >= RADIX_MAX_DEPTH) {
+		MergeSortRange(_records, _buffer, _count, [&](const SortRecord& _first, const SortRecord& _second) { return IsRecordBelow(_first, _second, _depth, _arena); });
+		return;
+	}
+
+	// Each record's bucket is looked up once, so a line in the arena is only read once per pass
+	vector<uint16_t> buckets(_count);
+	vector<size_t> bucketStart(258);
+	for (;;) {
+		for (size_t i = 0; i < _count; ++i) {
+			// The records are read in order, only the arena bytes of long lines are worth asking for
+			if (_prefetch && i + PREFETCH_DISTANCE < _count) {
+				const SortRecord& ahead = _records[i + PREFETCH_DISTANCE];
+				if (!IsRecordInline(ahead) && ahead.length > _depth)
+					PrefetchRead(_arena + ahead.arenaOffset + _depth);
+			}
+			const SortRecord& record = _records[i];
+			buckets[i] = record.length > _depth ? GetRecordByte(record, _depth, _arena) + 1 : 0;
+			++bucketStart[buckets[i] + 1];
+		}
+		auto fullBucket = find(bucketStart.begin() + 1, bucketStart.end(), _count);
+		if (fullBucket == bucketStart.end())
+			break;
+		// Records that all end here are equal
+		if (fullBucket == bucketStart.begin() + 1)
+			return;
+		_depth += SharedRecordLength(_records, _count, _depth, _arena);
+		SortTally::Depth(_depth + 1);
+		fill(bucketStart.begin(), bucketStart.end(), 0);
+	}
+	for (int b = 1; b < 258; ++b) {
+		bucketStart[b] += bucketStart[b - 1];
+	}
+	vector<size_t> bucketNext(bucketStart.begin(), bucketStart.begin() + 257);
+	for (size_t i = 0; i < _count; ++i) {
+		_buffer[bucketNext[buckets[i]]++] = _records[i];
+	}
+	copy(_buffer, _buffer + _count, _records);
+	SortTally::Move(2 * _count);
+	buckets.clear();
+	buckets.shrink_to_fit();
+
+	vector<future<void>> workerFutures;
+	for (int b = 1; b < 257; ++b) {
+		size_t start = bucketStart[b];
+		size_t count = bucketStart[b + 1] - start;
+		if (count < 2)
+			continue;
+		if (_threadDepth < MAX_THREAD_DEPTH && count > (size_t)THREAD_THRESHOLD) {
+			workerFutures.push_back(async(launch::async, CountedWork(RecordRadixSort), _records + start, _buffer + start, count, _depth + 1, _arena, _prefetch, _threadDepth + 1));
+		}
+		else {
+			RecordRadixSort(_records + start, _buffer + start, count, _depth + 1, _arena, _prefetch, _threadDepth);
+		}
+	}
+	for (auto& workerFuture : workerFutures) {
+		workerFuture.get();
+	}
+}
+
+// Sorts _lines in place in ascending byte order through packed records.
+static void SortLinesPacked(vector<string>& _lines, bool _hugePages, bool _prefetch, int _threadDepth) {
+	size_t arenaSize = 0;
+	for (const string& line : _lines) {
+		if (line.size() > RECORD_INLINE_LENGTH)
+			arenaSize += sizeof(uint64_t) + line.size();
+	}
+
+	LargeBuffer<char> arena(arenaSize, PageAllocator<char>(_hugePages));
+	LargeBuffer<SortRecord> records(_lines.size(), PageAllocator<SortRecord>(_hugePages));
+	size_t arenaNext = 0;
+	for (size_t i = 0; i < _lines.size(); ++i) {
+		const string& line = _lines[i];
+		SortRecord& record = records[i];
+		if (line.size() > UINT32_MAX)
+			throw runtime_error("Line too long to sort");
+		record.length = (uint32_t)line.size();
+		if (IsRecordInline(record)) {
+			memset(record.prefix, 0, RECORD_INLINE_LENGTH);
+			memcpy(record.prefix, line.data(), line.size());
+		}
+		else {
+			uint64_t lineIndex = i;
+			memcpy(arena.data() + arenaNext, &lineIndex, sizeof(lineIndex));
+			arenaNext += sizeof(lineIndex);
+			memcpy(record.prefix, line.data(), RECORD_PREFIX_LENGTH);
+			record.arenaOffset = arenaNext;
+			memcpy(arena.data() + arenaNext, line.data(), line.size());
+			arenaNext += line.size();
+		}
+	}
+
+	LargeBuffer<SortRecord> buffer(records.size(), PageAllocator<SortRecord>(_hugePages));
+	RecordRadixSort(records.data(), buffer.data(), records.size(), 0, arena.data(), _prefetch, _threadDepth);
+	buffer.clear();
+
+	vector<string> sortedLines;
+	sortedLines.reserve(records.size());
+	for (const SortRecord& record : records) {
+		if (IsRecordInline(record)) {
+			sortedLines.emplace_back(record.prefix, record.length);
+		}
+		else {
+			uint64_t lineIndex;
+			memcpy(&lineIndex, arena.data() + record.arenaOffset - sizeof(lineIndex), sizeof(lineIndex));
+			sortedLines.push_back(move(_lines[lineIndex]));
+		}
+	}
+	SortTally::Move(records.size());
+	_lines.swap(sortedLines);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Suffix Ordering
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Orders lines by their last bytes, read from the end backwards, which groups lines by file
+// extension, domain suffix and so on. Either only the last N bytes are compared (LastLetterAscending
+// is N = 1) or the whole reversed line (SuffixAscending). Lines are read in place from the back, no
+// reversed copies are made. A line that runs out of bytes sorts before the lines it is a suffix of.
+// Lines that tie on their last N bytes are ordered by the whole line ascending, so the result does
+// not depend on the input order.
+
+const size_t FULL_SUFFIX = SIZE_MAX;
+
+// Number of trailing bytes that _sortType orders by: 0 if it is not a suffix ordering.
+static size_t GetSuffixLength(ESortType _sortType) {
+	switch (_sortType) {
+	case ESortType::LastLetterAscending:
+		return 1;
+	case ESortType::SuffixAscending:
+		return FULL_SUFFIX;
+	default:
+		return 0;
+	}
+}
+
+// Returns true if _first sorts before _second by suffix, given that they share their last _depth bytes.
+static bool IsSuffixBelow(string_view _first, string_view _second, size_t _depth, size_t _suffixLength) {
+	size_t firstLength = min(_first.size(), _suffixLength);
+	size_t secondLength = min(_second.size(), _suffixLength);
+	const char* first = _first.data() + _first.size();
+	const char* second = _second.data() + _second.size();
+	size_t i = _depth;
+	for (; i < firstLength && i < secondLength; ++i) {
+		unsigned char firstChar = first[-1 - (ptrdiff_t)i];
+		unsigned char secondChar = second[-1 - (ptrdiff_t)i];
+		if (firstChar != secondChar) {
+			SortTally::Comparison(i - _depth + 1);
+			return firstChar < secondChar;
+		}
+	}
+	// A tie on the suffix is counted once more by the whole line comparison that breaks it
+	SortTally::Comparison(i > _depth ? i - _depth : 0);
+	if (firstLength != secondLength)
+		return firstLength < secondLength;
+	return _suffixLength != FULL_SUFFIX && IsKeyBelow(_first, _second, 0);
+}
+
+// PrefetchKeyAhead() for the suffix passes, which read the byte _depth from the end of the line.
+static inline void PrefetchSuffixAhead(const string_view* _lines, const size_t* _order, size_t _i, size_t _count, size_t _depth) {
+	if (_i + 2 * PREFETCH_DISTANCE < _count)
+		PrefetchRead(&_lines[_order[_i + 2 * PREFETCH_DISTANCE]]);
+	if (_i + PREFETCH_DISTANCE < _count) {
+		string_view line = _lines[_order[_i + PREFETCH_DISTANCE]];
+		PrefetchRead(line.data() + (line.size() > _depth ? line.size() - 1 - _depth : 0));
+	}
+}
+
+// Number of bytes counted back from byte _depth from the end that all the lines in the range have in
+// common, at most _suffixLength - _depth. Every line must have a byte at _depth from the end.
+static size_t SharedSuffixLength(const string_view* _lines, const size_t* _order, size_t _count, size_t _depth, size_t _suffixLength) {
+	string_view first = _lines[_order[0]];
+	size_t shared = min(first.size(), _suffixLength) - _depth;
+	for (size_t i = 1; i < _count && shared > 0; ++i) {
+		string_view line = _lines[_order[i]];
+		size_t length = min(shared, line.size() - _depth);
+		size_t same = 0;
+		while (same < length && line[line.size() - 1 - _depth - same] == first[first.size() - 1 - _depth - same]) {
+			++same;
+		}
+		shared = same;
+	}
+	return shared;
+}
+
+// Stable MSD radix sort of the line indices in _order by the bytes of each line counted from the end.
+// All lines in the range share their last _depth bytes; see RadixSortByKeys for the general scheme,
+// including the shared suffix skipped in one scan and the merge sort at RADIX_MAX_DEPTH.
+static void SuffixRadixSort(const string_view* _lines, size_t* _order, size_t* _buffer, size_t _count, size_t _depth, size_t _suffixLength, bool _prefetch, int _threadDepth) {
+	SortTally::Depth(_depth + 1);
+	if (_count < RADIX_INSERTION_THRESHOLD || _depth >= RADIX_MAX_DEPTH) {
+		MergeSortRange(_order, _buffer, _count, [&](size_t _first, size_t _second) { return IsSuffixBelow(_lines[_first], _lines[_second], _depth, _suffixLength); });
+		return;
+	}
+
+	// Bucket 0 holds the lines that have no byte left, bucket b + 1 the lines with byte b at _depth from the end
+	vector<size_t> bucketStart(258);
+	for (;;) {
+		// Every line in the range has its last _suffixLength bytes in common: break the tie by the whole line
+		if (_depth == _suffixLength) {
+			RadixSortByKeys(_lines, _order, _buffer, _count, 0, _prefetch, _threadDepth);
+			return;
+		}
+		for (size_t i = 0; i < _count; ++i) {
+			if (_prefetch)
+				PrefetchSuffixAhead(_lines, _order, i, _count, _depth);
+			string_view line = _lines[_order[i]];
+			++bucketStart[line.size() > _depth ? (unsigned char)line[line.size() - 1 - _depth] + 2 : 1];
+		}
+		auto fullBucket = find(bucketStart.begin() + 1, bucketStart.end(), _count);
+		if (fullBucket == bucketStart.end())
+			break;
+		// Lines that all ran out of bytes are identical
+		if (fullBucket == bucketStart.begin() + 1)
+			return;
+		_depth += SharedSuffixLength(_lines, _order, _count, _depth, _suffixLength);
+		SortTally::Depth(_depth + 1);
+		fill(bucketStart.begin(), bucketStart.end(), 0);
+	}
+	for (int b = 1; b < 258; ++b) {
+		bucketStart[b] += bucketStart[b - 1];
+	}
+	vector<size_t> bucketNext(bucketStart.begin(), bucketStart.begin() + 257);
+	for (size_t i = 0; i < _count; ++i) {
+		if (_prefetch)
+			PrefetchSuffixAhead(_lines, _order, i, _count, _depth);
+		string_view line = _lines[_order[i]];
+		_buffer[bucketNext[line.size() > _depth ? (unsigned char)line[line.size() - 1 - _depth] + 1 : 0]++] = _order[i];
+	}
+	copy(_buffer, _buffer + _count, _order);
+	SortTally::Move(2 * _count);
+
+	// Lines that ran out of bytes are identical, bucket 0 needs no further sorting
+	vector<future<void>> workerFutures;
+	for (int b = 1; b < 257; ++b) {
+		size_t start = bucketStart[b];
+		size_t count = bucketStart[b + 1] - start;
+		if (count < 2)
+			continue;
+		if (_threadDepth < MAX_THREAD_DEPTH && count > (size_t)THREAD_THRESHOLD) {
+			workerFutures.push_back(async(launch::async, CountedWork(SuffixRadixSort), _lines, _order + start, _buffer + start, count, _depth + 1, _suffixLength, _prefetch, _threadDepth + 1));
+		}
+		else {
+			SuffixRadixSort(_lines, _order + start, _buffer + start, count, _depth + 1, _suffixLength, _prefetch, _threadDepth);
+		}
+	}
+	for (auto& workerFuture : workerFutures) {
+		workerFuture.get();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Last Character Ordering
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// LastCharacterAscending orders lines by the code point they end with rather than by their last byte,
+// which for a UTF-8 character of more than one byte is a continuation byte. The code point is decoded
+// once per line into a 32 bit key before sorting, and the radix passes and their insertion sorts only
+// compare keys; lines with the same key are ordered by the whole line ascending, as for
+// LastLetterAscending.
+//
+// An empty line has key 0 and goes first. A line ending with code point c has key c + 1, and a line
+// that does not end with a valid UTF-8 sequence sorts after all of those, by its last byte.
+
+const uint32_t CODE_POINT_KEY_INVALID = 0x10FFFF + 2;
+// Bytes of the keys the radix passes take, from the most significant: the largest key,
+// CODE_POINT_KEY_INVALID + 0xFF, fits in 3.
+const size_t CODE_POINT_KEY_BYTES = 3;
+
+static uint32_t MakeCodePointKey(string_view _line) {
+	if (_line.empty())
+		return 0;
+	uint32_t codePoint;
+	if (DecodeLastCodePoint(_line, codePoint))
+		return codePoint + 1;
+	return CODE_POINT_KEY_INVALID + (unsigned char)_line.back();
+}
+
+// Returns true if line _first sorts before line _second by their keys, then by the whole lines.
+static bool IsCodePointBelow(const uint32_t* _keys, const string_view* _lines, size_t _first, size_t _second) {
+	if (_keys[_first] != _keys[_second]) {
+		SortTally::Comparison(0);
+		return _keys[_first] < _keys[_second];
+	}
+	return IsKeyBelow(_lines[_first], _lines[_second], 0);
+}
+
+// Builds the keys for all lines, in parallel chunks once there are enough lines to be worth it.
+static LargeBuffer<uint32_t> MakeCodePointKeys(const string_view* _lines, size_t _count, unsigned int _numThreads, bool _hugePages) {
+	LargeBuffer<uint32_t> keys(_count, PageAllocator<uint32_t>(_hugePages));
+	size_t numThreads = max(1u, _numThreads);
+	if (_count < (size_t)THREAD_THRESHOLD * numThreads)
+		numThreads = 1;
+
+	size_t chunkSize = (_count + numThreads - 1) / numThreads;
+	vector<future<void>> workerFutures;
+	for (size_t start = 0; start < _count; start += chunkSize) {
+		size_t end = min(start + chunkSize, _count);
+		workerFutures.push_back(async(launch::async, [&, start, end] {
+			for (size_t i = start; i < end; ++i) {
+				keys[i] = MakeCodePointKey(_lines[i]);
+			}
+		}));
+	}
+	for (auto& workerFuture : workerFutures) {
+		workerFuture.get();
+	}
+	return keys;
+}
+
+// Stable MSD radix sort of the line indices in _order by _keys, one key byte per pass, and then by the
+// whole line with RadixSortByKeys. All keys in the range share their first _depth bytes; see
+// RadixSortByKeys for the general scheme. A pass that would leave every line in one bucket is skipped.
+static void CodePointRadixSort(const uint32_t* _keys, const string_view* _lines, size_t* _order, size_t* _buffer, size_t _count, size_t _depth, bool _prefetch, int _threadDepth) {
+	SortTally::Depth(_depth + 1);
+	if (_count < RADIX_INSERTION_THRESHOLD) {
+		MergeSortRange(_order, _buffer, _count, [&](size_t _first, size_t _second) { return IsCodePointBelow(_keys, _lines, _first, _second); });
+		return;
+	}
+
+	size_t bucketStart[257];
+	unsigned int shift;
+	for (;; ++_depth) {
+		// Every line in the range has the same key: break the tie by the whole line
+		if (_depth == CODE_POINT_KEY_BYTES) {
+			RadixSortByKeys(_lines, _order, _buffer, _count, 0, _prefetch, _threadDepth);
+			return;
+		}
+		shift = (unsigned int)(8 * (CODE_POINT_KEY_BYTES - 1 - _depth));
+		fill(bucketStart, bucketStart + 257, 0);
+		for (size_t i = 0; i < _count; ++i) {
+			if (_prefetch && i + PREFETCH_DISTANCE < _count)
+				PrefetchRead(&_keys[_order[i + PREFETCH_DISTANCE]]);
+			++bucketStart[((_keys[_order[i]] >> shift) & 0xFF) + 1];
+		}
+		if (find(bucketStart + 1, bucketStart + 257, _count) == bucketStart + 257)
+			break;
+		SortTally::Depth(_depth + 2);
+	}
+	for (int b = 1; b < 257; ++b) {
+		bucketStart[b] += bucketStart[b - 1];
+	}
+	size_t bucketNext[256];
+	copy(bucketStart, bucketStart + 256, bucketNext);
+	for (size_t i = 0; i < _count; ++i) {
+		if (_prefetch && i + PREFETCH_DISTANCE < _count)
+			PrefetchRead(&_keys[_order[i + PREFETCH_DISTANCE]]);
+		_buffer[bucketNext[(_keys[_order[i]] >> shift) & 0xFF]++] = _order[i];
+	}
+	copy(_buffer, _buffer + _count, _order);
+	SortTally::Move(2 * _count);
+
+	vector<future<void>> workerFutures;
+	for (int b = 0; b < 256; ++b) {
+		size_t start = bucketStart[b];
+		size_t count = bucketStart[b + 1] - start;
+		if (count < 2)
+			continue;
+		if (_threadDepth < MAX_THREAD_DEPTH && count > (size_t)THREAD_THRESHOLD) {
+			workerFutures.push_back(async(launch::async, CountedWork(CodePointRadixSort), _keys, _lines, _order + start, _buffer + start, count, _depth + 1, _prefetch, _threadDepth + 1));
+		}
+		else {
+			CodePointRadixSort(_keys, _lines, _order + start, _buffer + start, count, _depth + 1, _prefetch, _threadDepth);
+		}
+	}
+	for (auto& workerFuture : workerFutures) {
+		workerFuture.get();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Run-Adaptive Sorting
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// A stable Timsort for inputs that are already mostly in order, such as append-only logs. Natural
+// ascending runs are taken as they are and strictly descending runs are reversed in place; short
+// runs are extended to a minimum length with a binary insertion sort. Runs are merged according to
+// the usual stack invariants, and a merge switches to galloping (exponential search) once one side
+// keeps winning, so a sorted input costs n - 1 comparisons and a nearly sorted one close to O(n).
+// Equal lines keep their input order. The elements are either the lines themselves or indices of
+// the lines, compared through TIsFirstAboveSecond.
+
+// Number of consecutive wins by one run after which a merge starts galloping.
+const size_t MIN_GALLOP = 7;
+
+template <typename T, typename TIsFirstAboveSecond>
+class TimSorter {
+public:
+	TimSorter(T* _lines, size_t _count, TIsFirstAboveSecond _isFirstAboveSecond) : lines(_lines), count(_count), isFirstAboveSecond(_isFirstAboveSecond) {}
+	void Sort();
+
+private:
+	// Strict order from the comparer, which also returns true for equal lines
+	bool IsBelow(const T& _first, const T& _second) { return !isFirstAboveSecond(_second, _first); }
+
+	size_t CountRunAndMakeAscending(size_t _low, size_t _high);
+	void BinaryInsertionSort(size_t _low, size_t _high, size_t _start);
+	size_t GallopLeft(const T& _key, const T* _base, size_t _length, size_t _hint);
+	size_t GallopRight(const T& _key, const T* _base, size_t _length, size_t _hint);
+	void MergeCollapse();
+	void MergeForceCollapse();
+	void MergeAt(size_t _run);
+	void MergeLow(size_t _base1, size_t _length1, size_t _base2, size_t _length2);
+	void MergeHigh(size_t _base1, size_t _length1, size_t _base2, size_t _length2);
+
+	struct Run {
+		size_t base;
+		size_t length;
+	};
+
+	T* lines;
+	size_t count;
+	TIsFirstAboveSecond isFirstAboveSecond;
+	vector<T> buffer;
+	vector<Run> runs;
+	size_t minGallop = MIN_GALLOP;
+};
+
+static void TimSort(vector<string>& _lines, IStringComparer* _comparer) {
+	TimSorter<string, LineComparer>(_lines.data(), _lines.size(), LineComparer{ _comparer, false }).Sort();
+}
+
+static void TimSort(vector<size_t>& _order, const string_view* _lines, IStringComparer* _comparer) {
+	TimSorter<size_t, LineIndexComparer>(_order.data(), _order.size(), LineIndexComparer{ _lines, _comparer, false }).Sort();
+}
+
+// Shortest run worth merging: between 32 and 64, chosen so that n / minRun is close to a power of two.
+static size_t MinRunLength(size_t _count) {
+	size_t lowBits = 0;
+	while (_count >= 64) {
+		lowBits |= _count & 1;
+		_count >>= 1;
+	}
+	return _count + lowBits;
+}
+
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::Sort() {
+	if (count < 2)
+		return;
+
+	size_t minRun = MinRunLength(count);
+	size_t low = 0;
+	while (low < count) {
+		size_t runLength = CountRunAndMakeAscending(low, count);
+		if (runLength < minRun) {
+			size_t forcedLength = min(minRun, count - low);
+			BinaryInsertionSort(low, low + forcedLength, low + runLength);
+			runLength = forcedLength;
+		}
+
+		runs.push_back({ low, runLength });
+		SortTally::Depth(runs.size());
+		MergeCollapse();
+		low += runLength;
+	}
+	MergeForceCollapse();
+}
+
+// Returns the length of the run starting at _low. A strictly descending run is reversed so that it
+// can be merged like the others without breaking stability.
+template <typename T, typename TIsFirstAboveSecond>
+size_t TimSorter<T, TIsFirstAboveSecond>::CountRunAndMakeAscending(size_t _low, size_t _high) {
+	size_t runHigh = _low + 1;
+	if (runHigh == _high)
+		return 1;
+
+	if (IsBelow(lines[runHigh++], lines[_low])) {
+		while (runHigh < _high && IsBelow(lines[runHigh], lines[runHigh - 1])) {
+			++runHigh;
+		}
+		reverse(lines + _low, lines + runHigh);
+		SortTally::Move(runHigh - _low);
+	}
+	else {
+		while (runHigh < _high && !IsBelow(lines[runHigh], lines[runHigh - 1])) {
+			++runHigh;
+		}
+	}
+	return runHigh - _low;
+}
+
+// Sorts [_low, _high) given that [_low, _start) is already sorted. Each line is placed after the
+// equal lines before it, which keeps the sort stable.
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::BinaryInsertionSort(size_t _low, size_t _high, size_t _start) {
+	if (_start == _low)
+		++_start;
+	for (; _start < _high; ++_start) {
+		size_t left = _low;
+		size_t right = _start;
+		while (left < right) {
+			size_t mid = left + (right - left) / 2;
+			if (IsBelow(lines[_start], lines[mid]))
+				right = mid;
+			else
+				left = mid + 1;
+		}
+
+		T pivot = move(lines[_start]);
+		move_backward(lines + left, lines + _start, lines + _start + 1);
+		lines[left] = move(pivot);
+		SortTally::Move(_start - left + 1);
+	}
+}
+
+// Returns the position in the sorted _base where _key would go before any equal lines, searching
+// outwards from _hint in steps of 1, 3, 7, ... and then by bisection.
+template <typename T, typename TIsFirstAboveSecond>
+size_t TimSorter<T, TIsFirstAboveSecond>::GallopLeft(const T& _key, const T* _base, size_t _length, size_t _hint) {
+	ptrdiff_t hint = (ptrdiff_t)_hint;
+	ptrdiff_t lastOffset = 0;
+	ptrdiff_t offset = 1;
+	if (IsBelow(_base[hint], _key)) {
+		ptrdiff_t maxOffset = (ptrdiff_t)_length - hint;
+		while (offset < maxOffset && IsBelow(_base[hint + offset], _key)) {
+			lastOffset = offset;
+			offset = offset * 2 + 1;
+		}
+		offset = min(offset, maxOffset);
+		lastOffset += hint;
+		offset += hint;
+	}
+	else {
+		ptrdiff_t maxOffset = hint + 1;
+		while (offset < maxOffset && !IsBelow(_base[hint - offset], _key)) {
+			lastOffset = offset;
+			offset = offset * 2 + 1;
+		}
+		offset = min(offset, maxOffset);
+		ptrdiff_t previousLastOffset = lastOffset;
+		lastOffset = hint - offset;
+		offset = hint - previousLastOffset;
+	}
+
+	// Now _base[lastOffset] < _key <= _base[offset]
+	++lastOffset;
+	while (lastOffset < offset) {
+		ptrdiff_t mid = lastOffset + (offset - lastOffset) / 2;
+		if (IsBelow(_base[mid], _key))
+			lastOffset = mid + 1;
+		else
+			offset = mid;
+	}
+	return (size_t)offset;
+}
+
+// Like GallopLeft, but returns the position after any lines equal to _key.
+template <typename T, typename TIsFirstAboveSecond>
+size_t TimSorter<T, TIsFirstAboveSecond>::GallopRight(const T& _key, const T* _base, size_t _length, size_t _hint) {
+	ptrdiff_t hint = (ptrdiff_t)_hint;
+	ptrdiff_t lastOffset = 0;
+	ptrdiff_t offset = 1;
+	if (IsBelow(_key, _base[hint])) {
+		ptrdiff_t maxOffset = hint + 1;
+		while (offset < maxOffset && IsBelow(_key, _base[hint - offset])) {
+			lastOffset = offset;
+			offset = offset * 2 + 1;
+		}
+		offset = min(offset, maxOffset);
+		ptrdiff_t previousLastOffset = lastOffset;
+		lastOffset = hint - offset;
+		offset = hint - previousLastOffset;
+	}
+	else {
+		ptrdiff_t maxOffset = (ptrdiff_t)_length - hint;
+		while (offset < maxOffset && !IsBelow(_key, _base[hint + offset])) {
+			lastOffset = offset;
+			offset = offset * 2 + 1;
+		}
+		offset = min(offset, maxOffset);
+		lastOffset += hint;
+		offset += hint;
+	}
+
+	// Now _base[lastOffset] <= _key < _base[offset]
+	++lastOffset;
+	while (lastOffset < offset) {
+		ptrdiff_t mid = lastOffset + (offset - lastOffset) / 2;
+		if (IsBelow(_key, _base[mid]))
+			offset = mid;
+		else
+			lastOffset = mid + 1;
+	}
+	return (size_t)offset;
+}
+
+// Merges runs until the stack satisfies runs[i - 2] > runs[i - 1] + runs[i] and runs[i - 1] > runs[i],
+// which keeps the merges balanced and the stack logarithmic in size.
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::MergeCollapse() {
+	while (runs.size() > 1) {
+		size_t n = runs.size() - 2;
+		if ((n > 0 && runs[n - 1].length <= runs[n].length + runs[n + 1].length) ||
+			(n > 1 && runs[n - 2].length <= runs[n - 1].length + runs[n].length)) {
+			if (runs[n - 1].length < runs[n + 1].length)
+				--n;
+		}
+		else if (runs[n].length > runs[n + 1].length) {
+			break;
+		}
+		MergeAt(n);
+	}
+}
+
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::MergeForceCollapse() {
+	while (runs.size() > 1) {
+		size_t n = runs.size() - 2;
+		if (n > 0 && runs[n - 1].length < runs[n + 1].length)
+			--n;
+		MergeAt(n);
+	}
+}
+
+// Merges the runs at _run and _run + 1. Lines at the start of the first run that are not above the
+// start of the second, and lines at the end of the second run that are not below the end of the
+// first, are already in place and are left out of the merge.
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::MergeAt(size_t _run) {
+	size_t base1 = runs[_run].base;
+	size_t length1 = runs[_run].length;
+	size_t base2 = runs[_run + 1].base;
+	size_t length2 = runs[_run + 1].length;
+	runs[_run].length = length1 + length2;
+	runs.erase(runs.begin() + _run + 1);
+
+	size_t skipped = GallopRight(lines[base2], lines + base1, length1, 0);
+	base1 += skipped;
+	length1 -= skipped;
+	if (length1 == 0)
+		return;
+
+	length2 = GallopLeft(lines[base1 + length1 - 1], lines + base2, length2, length2 - 1);
+	if (length2 == 0)
+		return;
+
+	// Every line of both runs is written once, and those of the shorter run once more to the buffer
+	SortTally::Move(length1 + length2 + min(length1, length2));
+	AddMetric(EMetric::LinesMerged, length1 + length2);
+	if (length1 <= length2)
+		MergeLow(base1, length1, base2, length2);
+	else
+		MergeHigh(base1, length1, base2, length2);
+}
+
+// Merges from the front, with the shorter first run moved out to the buffer. The first line of the
+// second run goes first and the last line of the first run goes last (see MergeAt).
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::MergeLow(size_t _base1, size_t _length1, size_t _base2, size_t _length2) {
+	if (buffer.size() < _length1)
+		buffer.resize(_length1);
+	move(lines + _base1, lines + _base1 + _length1, buffer.begin());
+
+	T* run1 = buffer.data();
+	size_t cursor1 = 0;
+	size_t cursor2 = _base2;
+	size_t dest = _base1;
+	size_t length1 = _length1;
+	size_t length2 = _length2;
+
+	lines[dest++] = move(lines[cursor2++]);
+	if (--length2 > 0 && length1 > 1) {
+		size_t gallop = minGallop;
+		[&] {
+			while (true) {
+				// One line at a time until one run has won MIN_GALLOP times in a row
+				size_t wins1 = 0;
+				size_t wins2 = 0;
+				do {
+					if (IsBelow(lines[cursor2], run1[cursor1])) {
+						lines[dest++] = move(lines[cursor2++]);
+						++wins2;
+						wins1 = 0;
+						if (--length2 == 0)
+							return;
+					}
+					else {
+						lines[dest++] = move(run1[cursor1++]);
+						++wins1;
+						wins2 = 0;
+						if (--length1 == 1)
+							return;
+					}
+				} while ((wins1 | wins2) < gallop);
+
+				// Then whole blocks at a time for as long as galloping pays off
+				do {
+					wins1 = GallopRight(lines[cursor2], run1 + cursor1, length1, 0);
+					if (wins1 != 0) {
+						move(run1 + cursor1, run1 + cursor1 + wins1, lines + dest);
+						dest += wins1;
+						cursor1 += wins1;
+						length1 -= wins1;
+						if (length1 <= 1)
+							return;
+					}
+					lines[dest++] = move(lines[cursor2++]);
+					if (--length2 == 0)
+						return;
+
+					wins2 = GallopLeft(run1[cursor1], lines + cursor2, length2, 0);
+					if (wins2 != 0) {
+						move(lines + cursor2, lines + cursor2 + wins2, lines + dest);
+						dest += wins2;
+						cursor2 += wins2;
+						length2 -= wins2;
+						if (length2 == 0)
+							return;
+					}
+					lines[dest++] = move(run1[cursor1++]);
+					if (--length1 == 1)
+						return;
+					if (gallop > 0)
+						--gallop;
+				} while (wins1 >= MIN_GALLOP || wins2 >= MIN_GALLOP);
+				gallop += 2;
+			}
+		}();
+		minGallop = max((size_t)1, gallop);
+	}
+
+	if (length1 == 1) {
+		move(lines + cursor2, lines + cursor2 + length2, lines + dest);
+		lines[dest + length2] = move(run1[cursor1]);
+	}
+	else if (length1 == 0) {
+		throw runtime_error("Comparer does not define a consistent order");
+	}
+	else {
+		move(run1 + cursor1, run1 + cursor1 + length1, lines + dest);
+	}
+}
+
+// Merges from the back, with the shorter second run moved out to the buffer. Mirror image of MergeLow.
+template <typename T, typename TIsFirstAboveSecond>
+void TimSorter<T, TIsFirstAboveSecond>::MergeHigh(size_t _base1, size_t _length1, size_t _base2, size_t _length2) {
+	if (buffer.size() < _length2)
+		buffer.resize(_length2);
+	move(lines + _base2, lines + _base2 + _length2, buffer.begin());
+
+	T* run2 = buffer.data();
+	// Cursors point at the last unmerged line of each run and may step one before the start
+	ptrdiff_t cursor1 = (ptrdiff_t)(_base1 + _length1) - 1;
+	ptrdiff_t cursor2 = (ptrdiff_t)_length2 - 1;
+	ptrdiff_t dest = (ptrdiff_t)(_base2 + _length2) - 1;
+	size_t length1 = _length1;
+	size_t length2 = _length2;
+
+	lines[dest--] = move(lines[cursor1--]);
+	if (--length1 > 0 && length2 > 1) {
+		size_t gallop = minGallop;
+		[&] {
+			while (true) {
+				size_t wins1 = 0;
+				size_t wins2 = 0;
+				do {
+					if (IsBelow(run2[cursor2], lines[cursor1])) {
+						lines[dest--] = move(lines[cursor1--]);
+						++wins1;
+						wins2 = 0;
+						if (--length1 == 0)
+							return;
+					}
+					else {
+						lines[dest--] = move(run2[cursor2--]);
+						++wins2;
+						wins1 = 0;
+						if (--length2 == 1)
+							return;
+					}
+				} while ((wins1 | wins2) < gallop);
+
+				do {
+					wins1 = length1 - GallopRight(run2[cursor2], lines + _base1, length1, length1 - 1);
+					if (wins1 != 0) {
+						dest -= wins1;
+						cursor1 -= wins1;
+						length1 -= wins1;
+						move_backward(lines + cursor1 + 1, lines + cursor1 + 1 + wins1, lines + dest + 1 + wins1);
+						if (length1 == 0)
+							return;
+					}
+					lines[dest--] = move(run2[cursor2--]);
+					if (--length2 == 1)
+						return;
+
+					wins2 = length2 - GallopLeft(lines[cursor1], run2, length2, length2 - 1);
+					if (wins2 != 0) {
+						dest -= wins2;
+						cursor2 -= wins2;
+						length2 -= wins2;
+						move(run2 + cursor2 + 1, run2 + cursor2 + 1 + wins2, lines + dest + 1);
+						if (length2 <= 1)
+							return;
+					}
+					lines[dest--] = move(lines[cursor1--]);
+					if (--length1 == 0)
+						return;
+					if (gallop > 0)
+						--gallop;
+				} while (wins1 >= MIN_GALLOP || wins2 >= MIN_GALLOP);
+				gallop += 2;
+			}
+		}();
+		minGallop = max((size_t)1, gallop);
+	}
+
+	if (length2 == 1) {
+		dest -= length1;
+		cursor1 -= length1;
+		move_backward(lines + cursor1 + 1, lines + cursor1 + 1 + length1, lines + dest + 1 + length1);
+		lines[dest] = move(run2[cursor2]);
+	}
+	else if (length2 == 0) {
+		throw runtime_error("Comparer does not define a consistent order");
+	}
+	else {
+		move(run2, run2 + length2, lines + dest - (length2 - 1));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Engine Selection
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Looks at an evenly spread sample of the loaded lines and picks the engine and thread count for the
+// job: tiny inputs are not worth any threads, heavily duplicated inputs are collapsed first, and the
+// number of threads follows the estimated work (lines times the bytes each comparison has to look at).
+
+const size_t PLAN_SAMPLE_SIZE = 4096;
+// Below this many lines a single-threaded merge sort finishes before threads would have started.
+const size_t PLAN_TINY_INPUT = 2048;
+// At or below this ratio of unique lines in the sample, sort the unique lines only.
+const double PLAN_DISTINCT_RATIO = 0.1;
+// From this mean LCP on, comparing whole lines beats a radix sort that has to take the shared
+// prefixes one byte per pass.
+const double PLAN_LONG_LCP = 32;
+// From this many lines on, chasing a pointer per line on every radix pass costs more than packing
+// byte ordered lines into 16 byte records and rebuilding them afterwards.
+const size_t PLAN_PACKED_LINES = 1000000;
+// At or above this ratio of neighbours already in order (or at or below it reversed), merge the runs.
+const double PLAN_PRESORTED_RATIO = 0.9;
+// Estimated byte comparisons that make one more thread worthwhile.
+const double PLAN_WORK_PER_THREAD = 1e6;
+
+// TLine is string or string_view.
+template <typename TLine>
+static CorpusStats SampleLines(const TLine* _lines, size_t _count, ESortType _sortType) {
+	CorpusStats stats;
+	stats.lineCount = _count;
+	if (_count == 0)
+		return stats;
+
+	size_t stride = max((size_t)1, _count / PLAN_SAMPLE_SIZE);
+	vector<string_view> sample;
+	for (size_t i = 0; i < _count && sample.size() < PLAN_SAMPLE_SIZE; i += stride) {
+		sample.push_back(_lines[i]);
+	}
+	stats.sampleSize = sample.size();
+
+	size_t totalLength = 0;
+	unordered_map<string_view, size_t> sampleCounts;
+	for (string_view line : sample) {
+		totalLength += line.size();
+		stats.maxLength = max(stats.maxLength, line.size());
+		++sampleCounts[line];
+	}
+	stats.meanLength = (double)totalLength / sample.size();
+
+	// The unique lines in a sample say little about the whole input, so extrapolate with the Chao1
+	// estimator from how many sampled lines were seen once (f1) and twice (f2)
+	double f1 = 0;
+	double f2 = 0;
+	for (const auto& entry : sampleCounts) {
+		if (entry.second == 1)
+			++f1;
+		else if (entry.second == 2)
+			++f2;
+	}
+	double estimatedDistinct = sampleCounts.size() + (f2 > 0 ? f1 * f1 / (2 * f2) : f1 * (f1 - 1) / 2);
+	stats.distinctRatio = min(1.0, estimatedDistinct / _count);
+
+	// Neighbours in the input, next to each sampled position
+	IStringComparer* comparer = CreateComparer(_sortType);
+	if (comparer != nullptr && _count > 1) {
+		size_t pairs = 0;
+		size_t inOrder = 0;
+		for (size_t i = 0; i + 1 < _count && pairs < PLAN_SAMPLE_SIZE; i += stride) {
+			++pairs;
+			if (comparer->IsFirstAboveSecond(_lines[i], _lines[i + 1]))
+				++inOrder;
+		}
+		stats.sortedRatio = (double)inOrder / pairs;
+	}
+	delete comparer;
+
+	// Neighbours in sorted order
+	vector<size_t> order = IdentityOrder(sample.size());
+	vector<size_t> buffer(sample.size());
+	RadixSortByKeys(sample.data(), order.data(), buffer.data(), order.size(), 0, false, MAX_THREAD_DEPTH);
+	size_t totalLcp = 0;
+	for (size_t i = 1; i < order.size(); ++i) {
+		string_view first = sample[order[i - 1]];
+		string_view second = sample[order[i]];
+		size_t lcp = 0;
+		while (lcp < first.size() && lcp < second.size() && first[lcp] == second[lcp]) {
+			++lcp;
+		}
+		totalLcp += lcp;
+	}
+	if (order.size() > 1) {
+		stats.meanLcp = (double)totalLcp / (order.size() - 1);
+	}
+	return stats;
+}
+
+CorpusStats SampleCorpus(const string_view* _lines, size_t _count, ESortType _sortType) {
+	return SampleLines(_lines, _count, _sortType);
+}
+
+const char* GetEngineName(ESortEngine _engine) {
+	switch (_engine) {
+	case ESortEngine::Auto:
+		return "Auto";
+	case ESortEngine::MergeSort:
+		return "MergeSort";
+	case ESortEngine::Radix:
+		return "Radix";
+	case ESortEngine::Distinct:
+		return "Distinct";
+	case ESortEngine::TimSort:
+		return "TimSort";
+	case ESortEngine::BottomUpMerge:
+		return "BottomUpMerge";
+	case ESortEngine::PackedRadix:
+		return "PackedRadix";
+	}
+	return "Unknown";
+}
+
+SortPlan PlanSort(const CorpusStats& _stats, ESortType _sortType, unsigned int _maxThreads) {
+	SortPlan plan;
+	ostringstream reasons;
+	reasons << fixed << setprecision(2) << _stats.lineCount << " lines, mean length " << _stats.meanLength
+		<< ", max length " << _stats.maxLength << ", mean LCP " << _stats.meanLcp
+		<< ", distinct " << _stats.distinctRatio;
+	if (_stats.sortedRatio >= 0) {
+		reasons << ", in order " << _stats.sortedRatio;
+	}
+	reasons << "; ";
+
+	bool hasComparer = HasComparer(_sortType);
+	if (_stats.lineCount < PLAN_TINY_INPUT) {
+		plan.engine = hasComparer ? ESortEngine::BottomUpMerge : ESortEngine::Radix;
+		plan.numThreads = 1;
+		reasons << "tiny input, no threads";
+		plan.reasons = reasons.str();
+		return plan;
+	}
+
+	// Only sort types with a comparer have a sorted ratio
+	if (_stats.sortedRatio >= PLAN_PRESORTED_RATIO || (_stats.sortedRatio >= 0 && _stats.sortedRatio <= 1 - PLAN_PRESORTED_RATIO)) {
+		plan.engine = ESortEngine::TimSort;
+		plan.numThreads = 1;
+		reasons << "mostly " << (_stats.sortedRatio >= PLAN_PRESORTED_RATIO ? "sorted" : "reversed") << " input, merging existing runs on one thread";
+		plan.reasons = reasons.str();
+		return plan;
+	}
+
+	if (_stats.distinctRatio <= PLAN_DISTINCT_RATIO) {
+		plan.engine = ESortEngine::Distinct;
+		reasons << "heavy duplicates, sorting unique lines only";
+	}
+	else if (hasComparer && _stats.meanLcp >= PLAN_LONG_LCP) {
+		plan.engine = ESortEngine::BottomUpMerge;
+		reasons << "long shared prefixes, comparison merge sort";
+	}
+	else if (hasComparer && _stats.lineCount >= PLAN_PACKED_LINES) {
+		plan.engine = ESortEngine::PackedRadix;
+		reasons << "many lines, byte order, radix sort of packed records";
+	}
+	else {
+		plan.engine = ESortEngine::Radix;
+		reasons << (hasComparer ? "byte order, radix sort" : "key based order, radix sort");
+	}
+
+	// Each line costs about its shared prefix plus one byte per radix pass or merge level
+	double lines = plan.engine == ESortEngine::Distinct ? _stats.lineCount * _stats.distinctRatio : _stats.lineCount;
+	double work = lines * (_stats.meanLcp + log2(max(2.0, lines)));
+	double wantedThreads = ceil(work / PLAN_WORK_PER_THREAD);
+	plan.numThreads = (unsigned int)max(1.0, min(wantedThreads, (double)max(1u, _maxThreads)));
+	reasons << ", " << plan.numThreads << " of " << max(1u, _maxThreads) << " threads for ~" << (size_t)work << " byte comparisons";
+	plan.reasons = reasons.str();
+	return plan;
+}
+
+SortPlan PlanSort(const string_view* _lines, size_t _count, ESortType _sortType, unsigned int _maxThreads) {
+	return PlanSort(SampleLines(_lines, _count, _sortType), _sortType, _maxThreads);
+}
+
+SortPlan PlanSort(const vector<string>& _lines, ESortType _sortType, unsigned int _maxThreads) {
+	return PlanSort(SampleLines(_lines.data(), _lines.size(), _sortType), _sortType, _maxThreads);
+}
+
+SortPlan MakeSortPlan(const string_view* _lines, size_t _count, const SortConfig& _config) {
+	unsigned int numThreads = _config.numThreads != 0 ? _config.numThreads : max(1u, thread::hardware_concurrency());
+	SortPlan plan;
+	if (_config.engine == ESortEngine::Auto) {
+		plan = PlanSort(_lines, _count, _config.sortType, numThreads);
+	}
+	else {
+		plan.engine = _config.engine;
+		plan.numThreads = numThreads;
+		plan.reasons = "requested by the caller";
+	}
+	plan.hugePages = _config.hugePages;
+	plan.prefetch = _config.prefetch;
+	plan.counters = _config.counters;
+	return plan;
+}
+
+// Bytes of one unique line in SortLineOrderDistinct()'s hash table: the node with its key, id and
+// cached hash, and the node's bucket.
+const size_t DISTINCT_ENTRY_BYTES = 48 + sizeof(void*);
+
+// Peak bytes SortLineOrder() allocates for _count lines of _lineBytes bytes in all, besides the order
+// it returns.
+static double EstimateOrderMemory(ESortEngine _engine, ESortType _sortType, double _count, double _lineBytes, double _distinctRatio) {
+	if (_engine == ESortEngine::Distinct) {
+		// The table and lists of unique lines, the chains of copies and the radix sort of the unique lines
+		double uniqueCount = _count * _distinctRatio;
+		double tables = uniqueCount * (DISTINCT_ENTRY_BYTES + sizeof(string_view) + 3 * sizeof(size_t)) + _count * sizeof(size_t);
+		return tables + EstimateOrderMemory(ESortEngine::Radix, _sortType, uniqueCount, _lineBytes * _distinctRatio, 1);
+	}
+
+	// The radix or merge buffer; Timsort merges through at most half the order
+	bool timSort = _engine == ESortEngine::TimSort && HasComparer(_sortType);
+	double bytes = _count * sizeof(size_t) * (timSort ? 0.5 : 1);
+	if (_sortType == ESortType::LastCharacterAscending) {
+		bytes += _count * sizeof(uint32_t);
+	}
+	if (UsesCollationKeys(_sortType)) {
+		// A key holds the line twice, locale keys a case weight per byte on top
+		double keyBytesPerByte = _sortType == ESortType::LocaleAscending ? 3 : 2;
+		bytes += _count * (sizeof(string) + 8) + _lineBytes * keyBytesPerByte;
+	}
+	return bytes;
+}
+
+size_t EstimateSortMemory(const CorpusStats& _stats, ESortType _sortType, const SortPlan& _plan) {
+	double count = (double)_stats.lineCount;
+	double lineBytes = count * _stats.meanLength;
+	double bytes;
+	if (HasComparer(_sortType) && _plan.engine == ESortEngine::TimSort) {
+		bytes = count / 2 * sizeof(string);
+	}
+	else if (HasComparer(_sortType) && (_plan.engine == ESortEngine::MergeSort || _plan.engine == ESortEngine::BottomUpMerge)) {
+		bytes = count * sizeof(string);
+	}
+	else if (HasComparer(_sortType) && _plan.engine == ESortEngine::PackedRadix) {
+		// Records and their buffer, the arena of the lines too long to inline and the rebuilt lines
+		bytes = count * (2 * sizeof(SortRecord) + sizeof(string));
+		if (_stats.meanLength > RECORD_INLINE_LENGTH) {
+			bytes += count * sizeof(uint64_t) + lineBytes;
+		}
+	}
+	else {
+		// Views of the lines, the order and the lines moved into it
+		bytes = count * (sizeof(string_view) + sizeof(size_t) + sizeof(string));
+		bytes += EstimateOrderMemory(_plan.engine, _sortType, count, lineBytes, _stats.distinctRatio);
+	}
+	return (size_t)bytes;
+}
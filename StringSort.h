@@ -0,0 +1,133 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// StringSort
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The line sorting engines as a library, without any file I/O. Lines are either sorted in place in a
+// vector<string>, or read from memory the caller owns (an array of string_views or one arena with
+// line offsets) and returned as an index permutation: order[i] is the input index of the line that
+// sorts at position i. The caller's lines are never copied or modified.
+//
+// The engine and thread count come from a SortConfig. ESortEngine::Auto lets the planner pick them
+// from a sample of the lines, see PlanSort(). Engines that do not apply to the sort type (a comparison
+// engine for a collation key order, for example) fall back to the sort type's radix sort.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// Builds the engines with counters of their work, see SortCounters. Set by the CMake option of the
+// same name, so that the library and its callers agree.
+#ifndef STRINGSORT_COUNTERS
+#define STRINGSORT_COUNTERS 0
+#endif
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// LastLetterAscending orders by the last byte of the line, LastCharacterAscending by the last UTF-8
+// code point; both break ties by the whole line ascending.
+enum class ESortType { AlphabeticalAscending, AlphabeticalDescending, LastLetterAscending, CaseInsensitiveAscending, LocaleAscending, NaturalAscending, SuffixAscending, LastCharacterAscending };
+
+// Sort engines the planner can choose from. Radix sorts by the bytes of the line, the collation key
+// or the suffix depending on the sort type; Distinct collapses duplicates before sorting; TimSort
+// merges the runs already present in the input; BottomUpMerge is the allocation-free merge sort;
+// PackedRadix radix sorts byte ordered lines as compact 16 byte records. Auto is only a request for
+// the planner to choose, a SortPlan never holds it.
+enum class ESortEngine { Auto, MergeSort, Radix, Distinct, TimSort, BottomUpMerge, PackedRadix };
+
+// IsFirstAboveSecond returns true if _first can be placed above _second: it sorts before _second or
+// they are equal.
+class IStringComparer {
+public:
+	virtual ~IStringComparer() {}
+	virtual bool IsFirstAboveSecond(std::string_view _first, std::string_view _second) = 0;
+};
+
+// Figures measured on a sample of the lines, see SampleCorpus().
+struct CorpusStats {
+	size_t lineCount = 0;
+	size_t sampleSize = 0;
+	double meanLength = 0;
+	size_t maxLength = 0;
+	double meanLcp = 0;			// Mean longest common prefix of neighbours in the sorted sample
+	double distinctRatio = 1;	// Estimated unique lines / lines
+	double sortedRatio = -1;	// Fraction of neighbouring pairs already in order, -1 without a comparer
+};
+
+// Work done by the sorts of one job, counted only in builds with STRINGSORT_COUNTERS; see
+// SortPlan::counters. comparisons counts the comparer calls and the line comparisons of the radix
+// sorts' insertion sorts, bytesCompared the bytes those comparisons looked at, moves the lines or line
+// indices written to a new place and maxDepth the deepest radix recursion, merge level or run stack.
+struct SortCounters {
+	std::atomic<uint64_t> comparisons{ 0 };
+	std::atomic<uint64_t> bytesCompared{ 0 };
+	std::atomic<uint64_t> moves{ 0 };
+	std::atomic<uint64_t> maxDepth{ 0 };
+};
+
+const bool SORT_COUNTERS_ENABLED = STRINGSORT_COUNTERS != 0;
+
+// The engine and thread count picked for one sort job, and why. hugePages backs the sort's buffers
+// with 2 MB pages (see LargePages.h); prefetch has the radix and merge loops prefetch the lines they
+// will look at next. Both are left to the caller, the planner does not change them, as is counters:
+// the sort adds its work to it if it is set and SORT_COUNTERS_ENABLED.
+struct SortPlan {
+	ESortEngine engine = ESortEngine::Radix;
+	unsigned int numThreads = 1;
+	bool hugePages = false;
+	bool prefetch = true;
+	SortCounters* counters = nullptr;
+	std::string reasons;
+};
+
+// How a caller wants its lines sorted. numThreads 0 means one per hardware thread; with Auto it is the
+// most the planner may use.
+struct SortConfig {
+	ESortType sortType = ESortType::AlphabeticalAscending;
+	ESortEngine engine = ESortEngine::Auto;
+	unsigned int numThreads = 0;
+	bool hugePages = false;		// See SortPlan
+	bool prefetch = true;
+	SortCounters* counters = nullptr;
+};
+
+// Lines stored back to back in one buffer: line i is data[offsets[i]] up to data[offsets[i + 1]], so
+// offsets holds count + 1 entries. Line breaks, if any, must be left out of the ranges.
+struct LineArena {
+	const char* data = nullptr;
+	const size_t* offsets = nullptr;
+	size_t count = 0;
+};
+
+// Returns the comparer for _sortType, or nullptr for the orders that have none (collation key, suffix
+// and last character orders). The caller deletes it.
+IStringComparer* CreateComparer(ESortType _sortType);
+const char* GetEngineName(ESortEngine _engine);
+const char* GetSortTypeName(ESortType _sortType);
+// Returns the ESortType named _name, as written by GetSortTypeName(). Throws for unknown names.
+ESortType ParseSortType(std::string_view _name);
+
+CorpusStats SampleCorpus(const std::string_view* _lines, size_t _count, ESortType _sortType);
+SortPlan PlanSort(const std::string_view* _lines, size_t _count, ESortType _sortType, unsigned int _maxThreads);
+SortPlan PlanSort(const std::vector<std::string>& _lines, ESortType _sortType, unsigned int _maxThreads);
+// The plan for lines like those _stats describes, as PlanSort() would make it from the lines, for a
+// caller that wants to plan before it has loaded them.
+SortPlan PlanSort(const CorpusStats& _stats, ESortType _sortType, unsigned int _maxThreads);
+// Rough peak bytes that SortLines() allocates with _plan for lines like those _stats describes, on top
+// of the lines themselves.
+size_t EstimateSortMemory(const CorpusStats& _stats, ESortType _sortType, const SortPlan& _plan);
+// The plan for _config: the planner's choice for ESortEngine::Auto, otherwise the requested engine.
+SortPlan MakeSortPlan(const std::string_view* _lines, size_t _count, const SortConfig& _config);
+
+std::vector<size_t> SortLineOrder(const std::string_view* _lines, size_t _count, ESortType _sortType, const SortPlan& _plan);
+std::vector<size_t> SortLineOrder(const std::string_view* _lines, size_t _count, const SortConfig& _config);
+std::vector<size_t> SortLineOrder(const LineArena& _arena, const SortConfig& _config);
+// Returns true if _first sorts strictly before _second in _sortType's order, the order every engine
+// sorts in. Meant for a few comparisons, such as against splitters: collation keys are built per call.
+bool IsLineBelow(std::string_view _first, std::string_view _second, ESortType _sortType);
+
+void SortLines(std::vector<std::string>& _lines, ESortType _sortType);
+void SortLines(std::vector<std::string>& _lines, ESortType _sortType, const SortPlan& _plan);
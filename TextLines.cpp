@@ -0,0 +1,252 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+#include "TextLines.h"
+
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXT_LINES_SSE2 1
+#include <emmintrin.h>
+#else
+#define TEXT_LINES_SSE2 0
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Definitions and Declarations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+const size_t SCAN_BLOCK_SIZE = 16;
+const char REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+const EInvalidUtf8 ALL_INVALID_UTF8_POLICIES[] = { EInvalidUtf8::Reject, EInvalidUtf8::Replace, EInvalidUtf8::PassThrough };
+
+static unsigned int LowestBit(unsigned int _mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, _mask);
+	return (unsigned int)index;
+#else
+	return (unsigned int)__builtin_ctz(_mask);
+#endif
+}
+
+const char* GetInvalidUtf8Name(EInvalidUtf8 _policy) {
+	switch (_policy) {
+	case EInvalidUtf8::Reject:
+		return "Reject";
+	case EInvalidUtf8::Replace:
+		return "Replace";
+	case EInvalidUtf8::PassThrough:
+		return "PassThrough";
+	}
+	return "Unknown";
+}
+
+EInvalidUtf8 ParseInvalidUtf8(string_view _name) {
+	for (EInvalidUtf8 policy : ALL_INVALID_UTF8_POLICIES) {
+		if (_name == GetInvalidUtf8Name(policy))
+			return policy;
+	}
+	throw runtime_error("Unknown invalid UTF-8 policy " + string(_name));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// UTF-8
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decodes the sequence starting at _bytes, of at most _available bytes, by the well-formed byte
+// sequences of the Unicode standard (table 3-7), which leave out overlong forms, surrogates and code
+// points above U+10FFFF. Returns its length if it is valid and otherwise the length of its maximal
+// invalid subpart, at least 1.
+static size_t DecodeSequence(const unsigned char* _bytes, size_t _available, bool& _validOut) {
+	unsigned char lead = _bytes[0];
+	size_t length;
+	unsigned char low = 0x80;
+	unsigned char high = 0xBF;
+	if (lead < 0x80) {
+		_validOut = true;
+		return 1;
+	}
+	else if (lead >= 0xC2 && lead <= 0xDF) {
+		length = 2;
+	}
+	else if (lead >= 0xE0 && lead <= 0xEF) {
+		length = 3;
+		if (lead == 0xE0)
+			low = 0xA0;
+		else if (lead == 0xED)
+			high = 0x9F;
+	}
+	else if (lead >= 0xF0 && lead <= 0xF4) {
+		length = 4;
+		if (lead == 0xF0)
+			low = 0x90;
+		else if (lead == 0xF4)
+			high = 0x8F;
+	}
+	else {
+		_validOut = false;
+		return 1;
+	}
+
+	// Only the second byte has a narrower range
+	size_t decoded = 1;
+	while (decoded < length && decoded < _available && _bytes[decoded] >= low && _bytes[decoded] <= high) {
+		++decoded;
+		low = 0x80;
+		high = 0xBF;
+	}
+	_validOut = decoded == length;
+	return decoded;
+}
+
+static bool IsValidUtf8(const unsigned char* _bytes, size_t _size) {
+	size_t position = 0;
+	while (position < _size) {
+		if (_bytes[position] < 0x80) {
+			++position;
+			continue;
+		}
+		bool valid;
+		position += DecodeSequence(_bytes + position, _size - position, valid);
+		if (!valid)
+			return false;
+	}
+	return true;
+}
+
+void RepairUtf8(string_view _line, string& _textOut) {
+	_textOut.clear();
+	const unsigned char* bytes = (const unsigned char*)_line.data();
+	size_t position = 0;
+	while (position < _line.size()) {
+		bool valid;
+		size_t length = DecodeSequence(bytes + position, _line.size() - position, valid);
+		if (valid)
+			_textOut.append(_line.data() + position, length);
+		else
+			_textOut.append(REPLACEMENT_CHARACTER, sizeof(REPLACEMENT_CHARACTER) - 1);
+		position += length;
+	}
+}
+
+bool DecodeLastCodePoint(string_view _line, uint32_t& _codePointOut) {
+	if (_line.empty())
+		return false;
+	// A sequence is at most 4 bytes long, its lead byte is the first that is not a continuation byte
+	const unsigned char* bytes = (const unsigned char*)_line.data();
+	size_t end = _line.size();
+	size_t start = end - 1;
+	while (start > 0 && end - start < 4 && (bytes[start] & 0xC0) == 0x80) {
+		--start;
+	}
+	bool valid;
+	size_t length = DecodeSequence(bytes + start, end - start, valid);
+	if (!valid || start + length != end)
+		return false;
+
+	uint32_t codePoint = length == 1 ? bytes[start] : bytes[start] & (0x7F >> length);
+	for (size_t i = 1; i < length; ++i) {
+		codePoint = codePoint << 6 | (bytes[start + i] & 0x3F);
+	}
+	_codePointOut = codePoint;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scanning
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bit i of _breaksOut is set if byte i of the block is a line break and bit i of _highOut if it is
+// above 0x7F.
+static void ScanBlock(const char* _block, size_t _size, unsigned int& _breaksOut, unsigned int& _highOut) {
+#if TEXT_LINES_SSE2
+	if (_size == SCAN_BLOCK_SIZE) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)_block);
+		_breaksOut = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+		_highOut = (unsigned int)_mm_movemask_epi8(bytes);
+		return;
+	}
+#endif
+	_breaksOut = 0;
+	_highOut = 0;
+	for (size_t i = 0; i < _size; ++i) {
+		_breaksOut |= (unsigned int)(_block[i] == '\n') << i;
+		_highOut |= (unsigned int)((unsigned char)_block[i] >= 0x80) << i;
+	}
+}
+
+static TextLine MakeLine(const char* _data, size_t _start, size_t _end, bool _hasHighBytes) {
+	TextLine line;
+	line.start = _start;
+	line.length = _end - _start;
+	if (line.length > 0 && _data[_end - 1] == '\r')
+		--line.length;
+	line.validUtf8 = !_hasHighBytes || IsValidUtf8((const unsigned char*)_data + _start, line.length);
+	return line;
+}
+
+size_t ScanTextLines(const char* _data, size_t _size, size_t _position, TextLine* _linesOut, size_t _maxLines, size_t& _countOut) {
+	size_t count = 0;
+	size_t lineStart = _position;
+	bool lineHasHighBytes = false;
+	for (size_t blockStart = _position; blockStart < _size && count < _maxLines; blockStart += SCAN_BLOCK_SIZE) {
+		size_t blockSize = min(SCAN_BLOCK_SIZE, _size - blockStart);
+		unsigned int breaks;
+		unsigned int high;
+		ScanBlock(_data + blockStart, blockSize, breaks, high);
+		while (breaks != 0) {
+			unsigned int bit = LowestBit(breaks);
+			size_t lineEnd = blockStart + bit;
+			_linesOut[count++] = MakeLine(_data, lineStart, lineEnd, lineHasHighBytes || (high & ((1u << bit) - 1)) != 0);
+			lineStart = lineEnd + 1;
+			if (count == _maxLines) {
+				_countOut = count;
+				return lineStart;
+			}
+			// Whatever is left of the block belongs to the next line
+			high &= ~((2u << bit) - 1);
+			lineHasHighBytes = false;
+			breaks &= breaks - 1;
+		}
+		lineHasHighBytes |= high != 0;
+	}
+
+	// The last line need not end with a line break
+	if (lineStart < _size && count < _maxLines) {
+		_linesOut[count++] = MakeLine(_data, lineStart, _size, lineHasHighBytes);
+		lineStart = _size;
+	}
+	_countOut = count;
+	return lineStart;
+}
+
+size_t SplitTextLines(const char* _data, size_t _size, EInvalidUtf8 _policy, vector<string_view>& _linesOut, deque<string>& _repairedOut) {
+	// ForEachTextLine() with the repaired lines kept
+	TextLine lines[TEXT_LINE_BATCH];
+	size_t invalidLines = 0;
+	size_t lineNumber = 0;
+	for (size_t position = 0; position < _size;) {
+		size_t count = 0;
+		position = ScanTextLines(_data, _size, position, lines, TEXT_LINE_BATCH, count);
+		for (size_t i = 0; i < count; ++i) {
+			++lineNumber;
+			string_view line(_data + lines[i].start, lines[i].length);
+			if (!lines[i].validUtf8) {
+				++invalidLines;
+				if (_policy == EInvalidUtf8::Reject)
+					throw runtime_error("Invalid UTF-8 on line " + to_string(lineNumber));
+				if (_policy == EInvalidUtf8::Replace) {
+					_repairedOut.emplace_back();
+					RepairUtf8(line, _repairedOut.back());
+					line = _repairedOut.back();
+				}
+			}
+			_linesOut.push_back(line);
+		}
+	}
+	return invalidLines;
+}
@@ -0,0 +1,86 @@
+// Copyright Mass Media. All rights reserved. DO NOT redistribute.
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Text Lines
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Splits input text into lines the way getline() would, but with Windows line endings normalized:
+// a CR right before a line break (or at the end of the text) is left out of the line, so "word\r\n"
+// sorts and compares as "word".
+//
+// The same pass checks that every line is valid UTF-8. It runs over 16 byte blocks with SSE2, taking
+// the line breaks and the bytes above 0x7F of a block from two masks; only lines with such bytes are
+// decoded, so ASCII text costs no more than finding its line breaks. What happens to a line that is
+// not valid UTF-8 is up to EInvalidUtf8.
+////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <stdexcept>
+
+enum class EInvalidUtf8 {
+	Reject,			// Throws, naming the line
+	Replace,		// Replaces every maximal invalid subsequence with U+FFFD, as Unicode recommends
+	PassThrough		// Keeps the bytes as they are
+};
+
+const char* GetInvalidUtf8Name(EInvalidUtf8 _policy);
+// Returns the EInvalidUtf8 named _name, as written by GetInvalidUtf8Name(). Throws for unknown names.
+EInvalidUtf8 ParseInvalidUtf8(std::string_view _name);
+
+// One line found by ScanTextLines(): _length bytes from _data + start, without its line break or the
+// CR before it.
+struct TextLine {
+	size_t start;
+	size_t length;
+	bool validUtf8;
+};
+
+// Finds the lines of _data from _position on, which must be the start of a line, up to _maxLines of
+// them. Sets _countOut to the number found and returns the position to carry on from.
+size_t ScanTextLines(const char* _data, size_t _size, size_t _position, TextLine* _linesOut, size_t _maxLines, size_t& _countOut);
+// Sets _textOut to _line with its invalid UTF-8 replaced as by EInvalidUtf8::Replace.
+void RepairUtf8(std::string_view _line, std::string& _textOut);
+// Sets _codePointOut to the code point _line ends with. Returns false if _line is empty or does not
+// end with a valid UTF-8 sequence.
+bool DecodeLastCodePoint(std::string_view _line, uint32_t& _codePointOut);
+
+// Lines ScanTextLines() finds per call from ForEachTextLine().
+const size_t TEXT_LINE_BATCH = 256;
+
+// Calls _visitLine(string_view) for every line of _data and returns how many were not valid UTF-8. A
+// line is a view of _data unless it was repaired, in which case it only lives until the next call.
+template <typename TLineVisitor>
+size_t ForEachTextLine(const char* _data, size_t _size, EInvalidUtf8 _policy, TLineVisitor _visitLine) {
+	TextLine lines[TEXT_LINE_BATCH];
+	std::string repaired;
+	size_t invalidLines = 0;
+	size_t lineNumber = 0;
+	for (size_t position = 0; position < _size;) {
+		size_t count = 0;
+		position = ScanTextLines(_data, _size, position, lines, TEXT_LINE_BATCH, count);
+		for (size_t i = 0; i < count; ++i) {
+			++lineNumber;
+			std::string_view line(_data + lines[i].start, lines[i].length);
+			if (!lines[i].validUtf8) {
+				++invalidLines;
+				if (_policy == EInvalidUtf8::Reject)
+					throw std::runtime_error("Invalid UTF-8 on line " + std::to_string(lineNumber));
+				if (_policy == EInvalidUtf8::Replace) {
+					RepairUtf8(line, repaired);
+					line = repaired;
+				}
+			}
+			_visitLine(line);
+		}
+	}
+	return invalidLines;
+}
+
+// Appends a view of every line of _data to _linesOut and returns how many were not valid UTF-8.
+// Repaired lines are kept in _repairedOut, which must live as long as their views.
+size_t SplitTextLines(const char* _data, size_t _size, EInvalidUtf8 _policy, std::vector<std::string_view>& _linesOut, std::deque<std::string>& _repairedOut);